@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <signal.h>
+#include <termios.h>
+#include "reptyr.h"
+#include "agent.h"
+#include "daemon.h"
+#include "platform/platform.h"
+
+/* How long a client gets to send its request, so one can't wedge us. */
+#define AGENT_REQUEST_TIMEOUT_S 2
+
+static volatile sig_atomic_t agent_stopping;
+
+static void agent_signal(int sig) {
+    agent_stopping = 1;
+}
+
+static int agent_path(struct sockaddr_un *addr, const char *path) {
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    int n;
+
+    if (path)
+        n = snprintf(addr->sun_path, sizeof addr->sun_path, "%s", path);
+    else if (dir && *dir)
+        n = snprintf(addr->sun_path, sizeof addr->sun_path,
+                     "%s/reptyr-agent.sock", dir);
+    else
+        n = snprintf(addr->sun_path, sizeof addr->sun_path,
+                     "/tmp/reptyr-%d-agent.sock", (int)getuid());
+    return n < sizeof addr->sun_path ? 0 : ENAMETOOLONG;
+}
+
+static int agent_attach_pid(pid_t pid, uint32_t flags,
+                            struct proc_table *procs, int *pty) {
+    int fd, err;
+
+    if ((fd = get_pt()) < 0)
+        return errno;
+    if (unlockpt(fd) < 0 || grantpt(fd) < 0) {
+        err = errno;
+        close(fd);
+        return err;
+    }
+    if ((err = attach_child_procs(pid, ptsname(fd),
+                                  !!(flags & AGENT_FORCE_STDIO), procs))) {
+        close(fd);
+        return err;
+    }
+    *pty = fd;
+    return 0;
+}
+
+static void agent_serve(int fd, struct proc_table *procs) {
+    struct agent_request req;
+    struct agent_reply reply = { .magic = AGENT_MAGIC };
+    struct timeval tv = { .tv_sec = AGENT_REQUEST_TIMEOUT_S };
+    int pty = -1;
+
+    if (!daemon_peer_allowed(fd)) {
+        debug("Turning away a client that isn't us");
+        return;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    if (daemon_read_all(fd, &req, sizeof req) < 0) {
+        debug("No request from the client: %s", strerror(errno));
+        return;
+    }
+    if (req.magic != AGENT_MAGIC) {
+        debug("Ignoring a request with bad magic %#x", (unsigned)req.magic);
+        return;
+    }
+
+    if (req.pid <= 0)
+        reply.error = EINVAL;
+    else if (req.op == agent_attach)
+        reply.error = agent_attach_pid(req.pid, req.flags, procs, &pty);
+    else if (req.op == agent_steal)
+        reply.error = steal_pty(req.pid, &pty);
+    else
+        reply.error = EINVAL;
+    debug("%s pid %d: %s", req.op == agent_steal ? "Stealing" : "Attaching",
+          (int)req.pid, reply.error ? strerror(reply.error) : "done");
+
+    if (daemon_send_fds(fd, &reply, sizeof reply, &pty, reply.error ? 0 : 1) < 0)
+        debug("Unable to reply: %s", strerror(errno));
+    if (pty >= 0)
+        close(pty);
+}
+
+int agent_run(const char *path) {
+    static const int stop_signals[] = { SIGTERM, SIGINT, SIGHUP };
+    struct sockaddr_un addr;
+    struct proc_table procs = {};
+    struct sigaction sa = {};
+    sigset_t block, waitmask;
+    struct pollfd pfd[2];
+    int lfd, fd, err = 0, i;
+
+    if ((err = agent_path(&addr, path)))
+        return err;
+    if ((lfd = daemon_listen(addr.sun_path)) < 0)
+        return errno;
+    if ((err = proc_table_track_all(&procs))) {
+        close(lfd);
+        unlink(addr.sun_path);
+        return err;
+    }
+
+    /*
+     * The stop signals are only let in while we wait for a client, so
+     * one can't land half way through an attach, and ppoll() can't
+     * miss them either.
+     */
+    sa.sa_handler = agent_signal;
+    sigemptyset(&sa.sa_mask);
+    sigemptyset(&block);
+    for (i = 0; i < sizeof stop_signals / sizeof *stop_signals; i++) {
+        sigaction(stop_signals[i], &sa, NULL);
+        sigaddset(&block, stop_signals[i]);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    sigprocmask(SIG_BLOCK, &block, &waitmask);
+    for (i = 0; i < sizeof stop_signals / sizeof *stop_signals; i++)
+        sigdelset(&waitmask, stop_signals[i]);
+
+    fprintf(stderr, "Agent listening on %s\n", addr.sun_path);
+    pfd[0].fd = lfd;
+    pfd[0].events = POLLIN;
+    pfd[1].events = POLLIN;
+    while (!agent_stopping) {
+        /*
+         * Keep up with process events while idle, so the kernel never
+         * drops any and forces a rescan on the next attach.
+         */
+        pfd[1].fd = procs.tracking ? procs.track_fd : -1;
+        pfd[1].revents = 0;
+        if (ppoll(pfd, 2, NULL, &waitmask) < 0) {
+            if (errno == EINTR)
+                continue;
+            err = errno;
+            error("Unable to wait for clients: %s", strerror(err));
+            break;
+        }
+        if ((pfd[1].revents & POLLIN) && (err = proc_table_update(&procs))) {
+            error("Unable to update the process table: %s", strerror(err));
+            break;
+        }
+        if (!(pfd[0].revents & POLLIN))
+            continue;
+        if ((fd = accept(lfd, NULL, NULL)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN)
+                continue;
+            err = errno;
+            error("Unable to accept: %s", strerror(err));
+            break;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        agent_serve(fd, &procs);
+        close(fd);
+    }
+
+    debug("Agent shutting down");
+    close(lfd);
+    unlink(addr.sun_path);
+    proc_table_free(&procs);
+    return err;
+}
+
+int agent_request(const char *path, enum agent_op op, pid_t pid,
+                  uint32_t flags, int *pty) {
+    struct sockaddr_un addr;
+    struct agent_request req = {
+        .magic = AGENT_MAGIC,
+        .op = op,
+        .pid = pid,
+        .flags = flags,
+    };
+    struct agent_reply reply;
+    ssize_t n;
+    int fd, nfds, err;
+
+    if ((err = agent_path(&addr, path)))
+        return err;
+    if ((fd = daemon_connect(addr.sun_path)) < 0) {
+        err = errno;
+        error("Unable to reach the agent on %s: %s", addr.sun_path, strerror(err));
+        return err;
+    }
+    if (daemon_send_fds(fd, &req, sizeof req, NULL, 0) < 0 ||
+        (n = daemon_recv_fds(fd, &reply, sizeof reply, pty, 1, &nfds)) < 0) {
+        err = errno;
+        close(fd);
+        return err;
+    }
+    close(fd);
+
+    if (n < sizeof reply || reply.magic != AGENT_MAGIC)
+        err = EPROTO;
+    else if (reply.error)
+        err = reply.error;
+    else if (!nfds)
+        err = EPROTO;
+    if (err && nfds)
+        close(*pty);
+    return err;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef AGENT_H
+#define AGENT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * --agent stays up on a UNIX socket and does attaches (and -T steals)
+ * for whoever asks, then hands the pty master back over SCM_RIGHTS; the
+ * caller runs the proxy itself, as it would after attaching. Because
+ * the agent outlives each attach, it can keep following the process
+ * table instead of scanning it again every time.
+ *
+ * A client sends one agent_request per connection and gets one
+ * agent_reply back, with the master attached if error is 0.
+ */
+
+#define AGENT_MAGIC 0x72706167      /* "rpag" */
+
+enum agent_op {
+    agent_attach = 1,
+    agent_steal,
+};
+
+/* Attach fds 0-2 even if they aren't the tty, as with -s. */
+#define AGENT_FORCE_STDIO 0x1
+
+struct agent_request {
+    uint32_t magic;
+    uint32_t op;
+    int32_t pid;
+    uint32_t flags;
+};
+
+struct agent_reply {
+    uint32_t magic;
+    int32_t error;
+};
+
+/*
+ * Serve requests on `path` (NULL for reptyr-agent.sock in
+ * $XDG_RUNTIME_DIR, or /tmp/reptyr-UID-agent.sock) until we're told to
+ * stop. Returns 0, or an errno value if we couldn't get started.
+ */
+int agent_run(const char *path);
+/*
+ * Ask the agent on `path` to do op on pid. Returns 0 and sets *pty to
+ * the master, or returns an errno value.
+ */
+int agent_request(const char *path, enum agent_op op, pid_t pid,
+                  uint32_t flags, int *pty);
+
+#endif
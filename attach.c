@@ -20,6 +20,7 @@
  * THE SOFTWARE.
  */
 #include <sys/types.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <dirent.h>
 #include <sys/syscall.h>
@@ -43,6 +44,8 @@
 #include "ptrace.h"
 #include "reptyr.h"
 #include "reallocarray.h"
+#include "stats.h"
+#include "plan.h"
 #include "platform/platform.h"
 
 int fd_array_push(struct fd_array *fda, int fd) {
@@ -63,17 +66,111 @@ int fd_array_push(struct fd_array *fda, int fd) {
     return 0;
 }
 
+int proc_table_append(struct proc_table *pt, const struct proc_entry *e) {
+    struct proc_entry *tmp;
+
+    if (pt->n == pt->allocated) {
+        int n = pt->allocated ? 2 * pt->allocated : 256;
+        tmp = xreallocarray(pt->procs, n, sizeof *tmp);
+        if (tmp == NULL)
+            return -1;
+        pt->procs = tmp;
+        pt->allocated = n;
+    }
+    pt->procs[pt->n++] = *e;
+    return 0;
+}
+
+static int proc_entry_cmp(const void *a, const void *b) {
+    pid_t pa = ((const struct proc_entry *)a)->pid;
+    pid_t pb = ((const struct proc_entry *)b)->pid;
+    return (pa > pb) - (pa < pb);
+}
+
+/* Both /proc and sysctl usually hand us pids in order already. */
+void proc_table_sort(struct proc_table *pt) {
+    int i;
+
+    for (i = 1; i < pt->n; i++)
+        if (pt->procs[i - 1].pid > pt->procs[i].pid)
+            break;
+    if (i < pt->n)
+        qsort(pt->procs, pt->n, sizeof *pt->procs, proc_entry_cmp);
+}
+
+struct proc_entry *proc_table_find(struct proc_table *pt, pid_t pid) {
+    struct proc_entry key = { .pid = pid };
+    if (!pt->n)
+        return NULL;
+    return bsearch(&key, pt->procs, pt->n, sizeof *pt->procs, proc_entry_cmp);
+}
+
+void proc_table_free(struct proc_table *pt) {
+    if (pt->tracking)
+        close(pt->track_fd);
+    pt->tracking = 0;
+    free(pt->procs);
+    pt->procs = NULL;
+    pt->n = pt->allocated = 0;
+}
+
+void move_process_group(struct ptrace_child *child, struct proc_table *pt,
+                        pid_t from, pid_t to) {
+    struct proc_entry *e;
+    int i;
+    int err;
+
+    for (i = 0; i < pt->n; i++) {
+        e = &pt->procs[i];
+        if (e->pgid == from) {
+            debug("Change pgid for pid %d", e->pid);
+            err = do_syscall(child, setpgid, e->pid, to, 0, 0, 0, 0);
+            if (err < 0)
+                error(" failed: %s", strerror(-err));
+            else
+                e->pgid = to;
+        }
+    }
+}
+
+/*
+ * SIGTSTP does nothing to a process that ignores or blocks it. Nor,
+ * unless it has a handler, to one in an orphaned process group, one in
+ * which nobody has a parent in another group of the same session: the
+ * kernel throws the signal away, since there's no shell there to tell.
+ */
+int tstp_will_stop(struct proc_table *pt, pid_t pid,
+                   const struct proc_info *info) {
+    struct proc_entry *e, *parent;
+    int i;
+
+    if (info->tstp_ignored)
+        return 0;
+    if (info->tstp_caught)
+        return 1;
+    if ((e = proc_table_find(pt, pid)) == NULL)
+        return 1;
+    for (i = 0; i < pt->n; i++) {
+        if (pt->procs[i].pgid != e->pgid)
+            continue;
+        parent = proc_table_find(pt, pt->procs[i].ppid);
+        if (parent && parent->pgid != e->pgid && parent->sid == e->sid)
+            return 1;
+    }
+    return 0;
+}
+
 static void do_unmap(struct ptrace_child *child, child_addr_t addr, unsigned long len) {
     if (addr == (child_addr_t) - 1)
         return;
     do_syscall(child, munmap, (unsigned long)addr, len, 0, 0, 0, 0);
 }
 
-int do_setsid(struct ptrace_child *child) {
+int do_setsid(struct ptrace_child *child, struct proc_table *procs) {
     int err = 0;
     struct ptrace_child dummy;
 
-    err = do_syscall(child, fork, 0, 0, 0, 0, 0, 0);
+    err = do_fork(child);
     if (err < 0)
         return err;
 
@@ -96,12 +193,22 @@ int do_setsid(struct ptrace_child *child) {
         goto out_kill;
     }
 
-    move_process_group(child, child->pid, dummy.pid);
+    /*
+     * The target may have forked between check_pgroup() and our
+     * stopping it. From here on the group can't change under us, and
+     * move_process_group() keeps the table up to date itself.
+     */
+    if ((err = proc_table_update_for(procs, child->pid))) {
+        err = -err;
+        goto out_kill;
+    }
+
+    move_process_group(child, procs, child->pid, dummy.pid);
 
     err = do_syscall(child, setsid, 0, 0, 0, 0, 0, 0);
     if (err < 0) {
         error("Failed to setsid: %s", strerror(-err));
-        move_process_group(child, dummy.pid, child->pid);
+        move_process_group(child, procs, dummy.pid, child->pid);
         goto out_kill;
     }
 
@@ -115,7 +222,15 @@ out_kill:
     return err;
 }
 
-int ignore_hup(struct ptrace_child *child, child_addr_t scratch_page) {
+/*
+ * Make the child ignore SIGHUP, and save the action that replaces in
+ * *old for restore_hup. The kernel fills *old in with its own layout,
+ * which is no bigger than libc's, and which we only ever hand back to
+ * it. Needs room for two struct sigactions at scratch_page.
+ */
+int ignore_hup(struct ptrace_child *child, child_addr_t scratch_page,
+               struct sigaction *old) {
+    child_addr_t old_addr = scratch_page + sizeof *old;
     int err;
 
     struct sigaction act = {
@@ -127,39 +242,59 @@ int ignore_hup(struct ptrace_child *child, child_addr_t scratch_page) {
         return err;
     err = do_syscall(child, rt_sigaction,
                      SIGHUP, (unsigned long)scratch_page,
-                     0, 8, 0, 0);
+                     old_addr, 8, 0, 0);
+    if (err < 0)
+        return err;
 
-    return err;
+    return ptrace_memcpy_from_child(child, old, old_addr, sizeof *old);
+}
+
+int restore_hup(struct ptrace_child *child, child_addr_t scratch_page,
+                struct sigaction *old) {
+    int err;
+
+    err = ptrace_memcpy_to_child(child, scratch_page, old, sizeof *old);
+    if (err < 0)
+        return err;
+    return do_syscall(child, rt_sigaction,
+                      SIGHUP, (unsigned long)scratch_page,
+                      0, 8, 0, 0);
 }
 
+long stop_timeout_ms = 1000;
+long max_stop_ms = 0;
+int freeze_threads = 1;
+
 /*
  * Wait for the specific pid to enter state 'T', or stopped. We have to pull the
  * /proc file rather than attaching with ptrace() and doing a wait() because
  * half the point of this exercise is for the process's real parent (the shell)
  * to see the TSTP.
  *
- * In case the process is masking or ignoring SIGTSTP, we time out after a
- * second and continue with the attach -- it'll still work mostly right, you
- * just won't get the old shell back.
+ * In case the process is masking or ignoring SIGTSTP, we time out after
+ * stop_timeout_ms and continue with the attach -- it'll still work mostly
+ * right, you just won't get the old shell back.
  */
-void wait_for_stop(pid_t pid, int fd) {
-    struct timeval start, now;
+int wait_for_stop(pid_t pid, int fd) {
+    struct timespec start, now;
     struct timespec sleep;
+    long elapsed_ms;
 
-    gettimeofday(&start, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &start);
     while (1) {
-        gettimeofday(&now, NULL);
-        if ((now.tv_sec > start.tv_sec && now.tv_usec > start.tv_usec)
-                || (now.tv_sec - start.tv_sec > 1)) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed_ms = (now.tv_sec - start.tv_sec) * 1000
+            + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (elapsed_ms >= stop_timeout_ms) {
             error("Timed out waiting for child stop.");
-            break;
+            return 0;
         }
         /*
          * If anything goes wrong reading or parsing the stat node, just give
          * up.
          */
         if (check_proc_stopped(pid, fd))
-            break;
+            return 1;
 
         sleep.tv_sec  = 0;
         sleep.tv_nsec = 10000000;
@@ -167,6 +302,28 @@ void wait_for_stop(pid_t pid, int fd) {
     }
 }
 
+/*
+ * Send `sig` to pid and wait for it to stop. Where we can, we let the
+ * kernel tell us about the stop via a short-lived ptrace attach (see
+ * ptrace_signal_stop), which is the same stop the shell sees; otherwise
+ * we fall back to polling /proc. Returns whether it stopped.
+ */
+int stop_child(pid_t pid, int sig, int fd) {
+    int rv;
+
+    stats_enter(stats_wait_for_stop);
+    rv = ptrace_signal_stop(pid, sig, stop_timeout_ms);
+    if (rv == 0) {
+        error("Timed out waiting for child stop.");
+    } else if (rv < 0) {
+        debug("Unable to watch for the stop via ptrace: %s", strerror(errno));
+        kill(pid, sig);
+        rv = wait_for_stop(pid, fd);
+    }
+    stats_leave(stats_wait_for_stop);
+    return rv > 0;
+}
+
 int copy_tty_state(pid_t pid, const char *pty) {
     int fd, err = EINVAL;
     struct termios tio;
@@ -189,12 +346,25 @@ int mmap_scratch(struct ptrace_child *child, child_addr_t *addr) {
     long mmap_syscall;
     child_addr_t scratch_page;
 
-    mmap_syscall = ptrace_syscall_numbers(child)->nr_mmap2;
+    mmap_syscall = syscall_nr(child, mmap2);
     if (mmap_syscall == -1)
-        mmap_syscall = ptrace_syscall_numbers(child)->nr_mmap;
+        mmap_syscall = syscall_nr(child, mmap);
+    /*
+     * Ask for an executable page so that ptrace_remote_syscalls can use
+     * its trampoline, but settle for one that isn't if the target's
+     * policy forbids W+X mappings.
+     */
     scratch_page = ptrace_remote_syscall(child, mmap_syscall, 0,
-                                         sysconf(_SC_PAGE_SIZE), PROT_READ | PROT_WRITE,
+                                         sysconf(_SC_PAGE_SIZE),
+                                         PROT_READ | PROT_WRITE | PROT_EXEC,
                                          MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+    if (scratch_page > (unsigned long) - 1000) {
+        debug("Unable to map an executable scratch page: %s",
+              strerror(-(signed long)scratch_page));
+        scratch_page = ptrace_remote_syscall(child, mmap_syscall, 0,
+                                             sysconf(_SC_PAGE_SIZE), PROT_READ | PROT_WRITE,
+                                             MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+    }
     //MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
 
     if (scratch_page > (unsigned long) - 1000) {
@@ -207,13 +377,78 @@ int mmap_scratch(struct ptrace_child *child, child_addr_t *addr) {
     return 0;
 }
 
-int grab_pid(pid_t pid, struct ptrace_child *child, child_addr_t *scratch) {
+/*
+ * Small payloads (a sigaction, a path, a sockaddr) don't need a page of
+ * their own: we put them on the target's stack instead, below the red
+ * zone under its saved stack pointer. The thread is parked in a syscall
+ * and only ever runs the syscalls we give it until we restore its
+ * registers, so nothing else will touch that memory, and we save
+ * injecting an mmap and a munmap. We skip 128 bytes, the largest red
+ * zone of any ABI we support (amd64's).
+ */
+#define STACK_RED_ZONE 128
+
+static child_addr_t stack_scratch_addr(struct ptrace_child *child, size_t len) {
+    return (ptrace_stack_pointer(child) - STACK_RED_ZONE - len) & ~(child_addr_t)15;
+}
+
+/*
+ * Find `len` bytes of scratch memory in the child, on its stack if they
+ * fit, or else in a freshly mapped page. The stack is only used if its
+ * pages are already there, since our writes go in behind the kernel's
+ * back and won't grow it. What we read to find that out is kept, and
+ * put back by release_scratch: below the red zone isn't necessarily
+ * free, on a goroutine's stack or a small thread stack.
+ */
+static int alloc_scratch(struct ptrace_child *child, size_t len,
+                         child_addr_t *addr) {
+    child_addr_t stack;
+
+    if (len <= STACK_SCRATCH_MAX) {
+        stack = stack_scratch_addr(child, len);
+        if (ptrace_memcpy_from_child(child, child->stack_saved, stack, len) == 0) {
+            debug("Using %zu bytes of stack scratch at %lx", len, stack);
+            *addr = stack;
+            return 0;
+        }
+        debug("Stack scratch isn't mapped, mapping a page instead.");
+    }
+    return mmap_scratch(child, addr);
+}
+
+static void release_scratch(struct ptrace_child *child, child_addr_t addr,
+                            size_t len) {
+    if (len <= STACK_SCRATCH_MAX && addr == stack_scratch_addr(child, len)) {
+        if (ptrace_memcpy_to_child(child, addr, child->stack_saved, len) < 0)
+            debug("Unable to put back the stack under our scratch: %s",
+                  strerror(child->error));
+        return;
+    }
+    do_unmap(child, addr, sysconf(_SC_PAGE_SIZE));
+}
+
+/*
+ * Attach to pid, stop it at a syscall and find `len` bytes of scratch
+ * memory in it. Free the scratch with release_scratch.
+ */
+int grab_pid(pid_t pid, struct ptrace_child *child, child_addr_t *scratch,
+             size_t len) {
     int err;
 
+    stats_enter(stats_grab_pid);
     if (ptrace_attach_child(child, pid)) {
         err = child->error;
         goto out;
     }
+    if (freeze_threads) {
+        if (ptrace_freeze_threads(child)) {
+            err = child->error;
+            goto out;
+        }
+        if (child->nthreads)
+            debug("Froze %d other thread%s of %d", child->nthreads,
+                  child->nthreads == 1 ? "" : "s", pid);
+    }
     if (ptrace_advance_to_state(child, ptrace_at_syscall)) {
         err = child->error;
         goto out;
@@ -223,9 +458,10 @@ int grab_pid(pid_t pid, struct ptrace_child *child, child_addr_t *scratch) {
         goto out;
     }
 
-    if ((err = mmap_scratch(child, scratch)))
+    if ((err = alloc_scratch(child, len, scratch)))
         goto out_restore_regs;
 
+    stats_leave(stats_grab_pid);
     return 0;
 
 out_restore_regs:
@@ -234,41 +470,151 @@ out_restore_regs:
 out:
     ptrace_detach_child(child);
 
+    stats_leave(stats_grab_pid);
     return err;
 }
 
 int preflight_check(pid_t pid) {
     struct ptrace_child child;
+    int err = 0;
+
+    stats_enter(stats_preflight);
     debug("Making sure we have permission to attach...");
-    if (ptrace_attach_child(&child, pid)) {
-        return child.error;
+    if (ptrace_attach_child(&child, pid))
+        err = child.error;
+    else
+        ptrace_detach_child(&child);
+    stats_leave(stats_preflight);
+    return err;
+}
+
+static int will_stop(struct proc_table *procs, pid_t pid) {
+    struct proc_info info;
+
+    if (get_proc_info(pid, &info))
+        return 1;
+    return tstp_will_stop(procs, pid, &info);
+}
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* A batched call's result, or -1 if it failed or never ran. */
+static long call_result(const struct remote_syscall *rs) {
+    if (rs->result == REMOTE_SYSCALL_PENDING || remote_syscall_failed(rs))
+        return -1;
+    return rs->result;
+}
+
+/*
+ * What it takes to put a target back the way it was, should an attach
+ * fail part way through the stop. Only kept with --max-stop, since the
+ * copies of the fds cost a syscall each.
+ */
+struct attach_undo {
+    /* The fds we're replacing, and copies of them in the target */
+    int *fds, *saved;
+    int n;
+    /* The new tty in the target, and the SIGHUP action it replaced */
+    int child_fd;
+    child_addr_t old_act;
+    /* Whether the new tty became its ctty, or it gave up the old one */
+    int drop_ctty;
+    int retake_ctty;
+};
+
+/*
+ * Undo whatever u says got done. Each step is safe whether or not the
+ * one it reverses ran: a dup2 back from a copy leaves an fd that was
+ * never replaced as it was. A setsid can't be undone, so a target that
+ * wasn't a session leader stays in its new session.
+ */
+static void undo_attach(struct ptrace_child *child, child_addr_t scratch,
+                        long page_size, struct attach_undo *u) {
+    struct remote_syscall *calls;
+    int i, n = 0;
+
+    calls = xreallocarray(NULL, 2 * u->n + 4, sizeof *calls);
+    if (!calls) {
+        error("Out of memory; unable to undo the attach.");
+        return;
     }
-    ptrace_detach_child(&child);
-    return 0;
+    if (u->drop_ctty && u->child_fd >= 0)
+        calls[n++] = remote_syscall_init(child, ioctl, 0,
+                                         u->child_fd, TIOCNOTTY, 0, 0, 0, 0);
+    if (u->retake_ctty && u->n && u->saved[0] >= 0)
+        calls[n++] = remote_syscall_init(child, ioctl, 0,
+                                         u->saved[0], TIOCSCTTY, 0, 0, 0, 0);
+    for (i = 0; i < u->n; i++) {
+        if (u->saved[i] < 0)
+            continue;
+        calls[n++] = remote_dup2_init(child, 0, u->saved[i], u->fds[i]);
+        calls[n++] = remote_syscall_init(child, close, 0, u->saved[i], 0, 0, 0, 0, 0);
+        u->saved[i] = -1;
+    }
+    if (u->child_fd >= 0)
+        calls[n++] = remote_syscall_init(child, close, 0, u->child_fd, 0, 0, 0, 0, 0);
+    if (u->old_act)
+        calls[n++] = remote_syscall_init(child, rt_sigaction, 0,
+                                         SIGHUP, u->old_act, 0, 8, 0, 0);
+    debug("Undoing the attach: %d syscalls", n);
+    if (n && ptrace_remote_syscalls(child, scratch + page_size / 2,
+                                    page_size / 2, calls, n) < 0)
+        error("Unable to undo the attach: %s", strerror(child->error));
+    free(calls);
 }
 
-int attach_child(pid_t pid, const char *pty, int force_stdio) {
-    struct ptrace_child child;
+/*
+ * An attach comes in three parts, so the target spends as little time
+ * stopped as we can manage. Whatever can be worked out from outside
+ * (permission, termios, which of its fds are the tty, what we'll write
+ * into it) is done first, while it still runs. Then we stop it and do
+ * only the remote syscalls that move it over. Anything left (SIGWINCH,
+ * freeing memory) waits until it's on its way again.
+ */
+static int do_attach_child(pid_t pid, const char *pty, int force_stdio,
+                           struct proc_table *procs) {
+    struct ptrace_child child = { .pid = pid };
+    struct plan plan;
+    int planned, stopped = 0;
     child_addr_t scratch_page = -1;
-    int *child_tty_fds = NULL, n_fds, child_fd, statfd = -1;
-    int i;
+    int *child_tty_fds = NULL, n_fds, child_fd = -1, statfd = -1;
+    struct remote_syscall *calls = NULL;
+    struct {
+        struct sigaction act;
+        struct sigaction old_act;
+        char path[PATH_MAX];
+    } payload = {};
+    child_addr_t act_addr, old_act_addr, path_addr;
+    struct attach_undo undo = { .child_fd = -1 };
+    const char *step = "";
+    int i, n, len, sctty = -1, commit, done, leader, moved_session = 0;
     int err = 0;
     long page_size = sysconf(_SC_PAGE_SIZE);
 #ifdef __linux__
     char stat_path[PATH_MAX];
 #endif
 
-    if ((err = check_pgroup(pid))) {
+    if ((err = check_pgroup(procs, pid))) {
         return err;
     }
 
-    if ((err = preflight_check(pid))) {
+    /* --plan has already seen that we're allowed to attach. */
+    if ((planned = plan_cache_lookup(pid, &plan) == 0 && !plan.err))
+        debug("Found a plan for pid %d", pid);
+    else if ((err = preflight_check(pid)))
         return err;
-    }
 
     debug("Using tty: %s", pty);
 
-    if ((err = copy_tty_state(pid, pty))) {
+    stats_enter(stats_copy_tty_state);
+    err = copy_tty_state(pid, pty);
+    stats_leave(stats_copy_tty_state);
+    if (err) {
         if (err == ENOTTY && !force_stdio) {
             error("Target is not connected to a terminal.\n"
                   "    Use -s to force attaching anyways.");
@@ -276,6 +622,17 @@ int attach_child(pid_t pid, const char *pty, int force_stdio) {
         }
     }
 
+    /*
+     * The sigaction and the pty path go at the start of the scratch
+     * page, and the second half is used for batching syscalls, so the
+     * path has to fit in what's left of the first half.
+     */
+    payload.act.sa_handler = SIG_IGN;
+    len = snprintf(payload.path, sizeof payload.path, "%s", pty);
+    if (len < 0 || (size_t)len >= sizeof payload.path ||
+        (size_t)len >= page_size / 2 - offsetof(typeof(payload), path))
+        return ENAMETOOLONG;
+
 #ifdef __linux__
     snprintf(stat_path, sizeof stat_path, "/proc/%d/stat", pid);
     statfd = open(stat_path, O_RDONLY);
@@ -285,18 +642,11 @@ int attach_child(pid_t pid, const char *pty, int force_stdio) {
     }
 #endif
 
-    kill(pid, SIGTSTP);
-    wait_for_stop(pid, statfd);
-
-    if ((err = grab_pid(pid, &child, &scratch_page))) {
-        goto out_cont;
-    }
-
     if (force_stdio) {
         child_tty_fds = malloc(3 * sizeof(int));
         if (!child_tty_fds) {
             err = ENOMEM;
-            goto out_unmap;
+            goto out_close_stat;
         }
         n_fds = 3;
         child_tty_fds[0] = 0;
@@ -304,78 +654,244 @@ int attach_child(pid_t pid, const char *pty, int force_stdio) {
         child_tty_fds[2] = 2;
     } else {
         child_tty_fds = get_child_tty_fds(&child, statfd, &n_fds);
+        if (!child_tty_fds) {
+            err = child.error;
+            goto out_close_stat;
+        }
+    }
+
+    stats_target_stopped();
+    if (planned ? plan.tstp_stops : will_stop(procs, pid)) {
+        stopped = stop_child(pid, SIGTSTP, statfd);
+    } else {
+        /* Still send it, in case a stop gets through later after all. */
+        debug("SIGTSTP won't stop %d; not waiting for it", pid);
+        kill(pid, SIGTSTP);
+    }
+
+    stats_enter(stats_critical);
+    if (max_stop_ms > 0)
+        ptrace_deadline_ns = now_ns() + max_stop_ms * 1000000ULL;
+    step = "grabbing it";
+    if ((err = grab_pid(pid, &child, &scratch_page, page_size))) {
+        ptrace_deadline_ns = 0;
+        stats_leave(stats_critical);
+        goto out_cont;
+    }
+
+    if (!force_stdio) {
+        step = "rechecking its fds";
+        child_tty_fds = recheck_child_tty_fds(&child, statfd, child_tty_fds, &n_fds);
         if (!child_tty_fds) {
             err = child.error;
             goto out_unmap;
         }
     }
 
-    if (ptrace_memcpy_to_child(&child, scratch_page, pty, strlen(pty) + 1)) {
+    step = "copying in the tty's path";
+    if (ptrace_past_deadline(&child)) {
+        err = child.error;
+        goto out_unmap;
+    }
+    act_addr = scratch_page + offsetof(typeof(payload), act);
+    old_act_addr = scratch_page + offsetof(typeof(payload), old_act);
+    path_addr = scratch_page + offsetof(typeof(payload), path);
+    if (ptrace_memcpy_to_child(&child, scratch_page, &payload,
+                               offsetof(typeof(payload), path) + strlen(pty) + 1)) {
         err = child.error;
         error("Unable to memcpy the pty path to child.");
-        goto out_free_fds;
+        goto out_unmap;
     }
 
-    child_fd = do_syscall(&child, open,
-                          scratch_page, O_RDWR | O_NOCTTY,
-                          0, 0, 0, 0);
-    if (child_fd < 0) {
-        err = child_fd;
+    calls = xreallocarray(NULL, 2 * n_fds + 4, sizeof *calls);
+    if (!calls) {
+        err = ENOMEM;
+        goto out_unmap;
+    }
+
+    /*
+     * With --max-stop, keep a copy of each fd we're going to replace,
+     * so we can put it back if we run out of time.
+     */
+    if (max_stop_ms > 0) {
+        undo.saved = malloc(n_fds * sizeof *undo.saved);
+        if (!undo.saved) {
+            err = ENOMEM;
+            goto out_unmap;
+        }
+        undo.fds = child_tty_fds;
+        undo.n = n_fds;
+        for (i = 0; i < n_fds; i++)
+            undo.saved[i] = -1;
+    }
+
+    step = "opening the tty";
+    calls[0] = remote_open_init(&child, REMOTE_SYSCALL_ABORT_ON_ERROR,
+                                path_addr, O_RDWR | O_NOCTTY, 0);
+    calls[1] = remote_syscall_init(&child, rt_sigaction, REMOTE_SYSCALL_ABORT_ON_ERROR,
+                                   SIGHUP, act_addr, old_act_addr, 8, 0, 0);
+    calls[2] = remote_syscall_init(&child, getsid, 0, 0, 0, 0, 0, 0, 0);
+    n = 3;
+    for (i = 0; i < undo.n; i++)
+        calls[n++] = remote_syscall_init(&child, fcntl, 0, child_tty_fds[i],
+                                         F_DUPFD_CLOEXEC, 0, 0, 0, 0);
+    done = ptrace_remote_syscalls(&child, scratch_page + page_size / 2,
+                                  page_size / 2, calls, n);
+    /* Whatever ran has to be undone if we don't get any further. */
+    child_fd = call_result(&calls[0]);
+    undo.child_fd = child_fd;
+    if (call_result(&calls[1]) == 0)
+        undo.old_act = old_act_addr;
+    for (i = 0; i < undo.n; i++)
+        undo.saved[i] = call_result(&calls[3 + i]);
+    if (done < 0) {
+        err = child.error ? child.error : EIO;
+        goto out_close;
+    }
+
+    if (remote_syscall_failed(&calls[0])) {
+        err = calls[0].result;
         error("Unable to open the tty in the child.");
-        goto out_free_fds;
+        goto out_unmap;
     }
 
     debug("Opened the new tty in the child: %d", child_fd);
 
-    err = ignore_hup(&child, scratch_page);
-    if (err < 0)
+    if (remote_syscall_failed(&calls[1])) {
+        err = calls[1].result;
         goto out_close;
+    }
 
-    err = do_syscall(&child, getsid, 0, 0, 0, 0, 0, 0);
-    if (err != child.pid) {
+    for (i = 0; i < undo.n; i++) {
+        if (undo.saved[i] < 0) {
+            err = calls[3 + i].result;
+            error("Unable to keep a copy of fd %d to undo with: %s",
+                  child_tty_fds[i], strerror(-err));
+            goto out_close;
+        }
+    }
+
+    n = 0;
+    leader = (pid_t)calls[2].result == child.pid;
+    if (!leader) {
         debug("Target is not a session leader, attempting to setsid.");
-        err = do_setsid(&child);
+        step = "moving it to a new session";
+        err = do_setsid(&child, procs);
+        if (err < 0)
+            goto out_close;
+        moved_session = 1;
     } else {
-        do_syscall(&child, ioctl, child_tty_fds[0], TIOCNOTTY, 0, 0, 0, 0);
+        calls[n++] = remote_syscall_init(&child, ioctl, 0,
+                                         child_tty_fds[0], TIOCNOTTY, 0, 0, 0, 0);
     }
-    if (err < 0)
+
+    step = "moving its fds";
+    if (ptrace_past_deadline(&child)) {
+        err = child.error;
         goto out_close;
+    }
+    sctty = n;
+    calls[n++] = remote_syscall_init(&child, ioctl, REMOTE_SYSCALL_ABORT_ON_ERROR,
+                                     child_fd, TIOCSCTTY, 1, 0, 0, 0);
+    for (i = 0; i < n_fds; i++)
+        calls[n++] = remote_dup2_init(&child, 0, child_fd, child_tty_fds[i]);
+    commit = n;
+    calls[n++] = remote_syscall_init(&child, close, 0, child_fd, 0, 0, 0, 0, 0);
+    for (i = 0; i < undo.n; i++)
+        calls[n++] = remote_syscall_init(&child, close, 0, undo.saved[i], 0, 0, 0, 0, 0);
+
+    done = ptrace_remote_syscalls(&child, scratch_page + page_size / 2,
+                                  page_size / 2, calls, n);
+    /*
+     * Giving up the old tty raises a SIGHUP, and can come back ENOTTY
+     * even though it worked, so go by whether it ran at all.
+     */
+    if (leader && calls[0].result != REMOTE_SYSCALL_PENDING)
+        undo.retake_ctty = 1;
+    if (call_result(&calls[sctty]) == 0)
+        undo.drop_ctty = 1;
+    if (calls[commit].result != REMOTE_SYSCALL_PENDING) {
+        /* That's the point of no return; only tidying up is left. */
+        child_fd = -1;
+        for (i = 0; i < undo.n; i++)
+            if (calls[commit + 1 + i].result != REMOTE_SYSCALL_PENDING)
+                undo.saved[i] = -1;
+        undo.n = 0;
+    } else if (done < 0) {
+        err = child.error ? child.error : EIO;
+        goto out_close;
+    }
 
-    err = do_syscall(&child, ioctl, child_fd, TIOCSCTTY, 1, 0, 0, 0);
+    err = calls[sctty].result;
     if (err != 0) { /* Seems to be returning >0 for error */
-        error("Unable to set controlling terminal: %s", strerror(err));
+        error("Unable to set controlling terminal: %s", strerror(-err));
         goto out_close;
     }
 
     debug("Set the controlling tty");
 
-    for (i = 0; i < n_fds; i++) {
-        err = do_syscall(&child, dup2, child_fd, child_tty_fds[i], 0, 0, 0, 0);
-        if (err < 0)
-            error("Problem moving child fd number %d to new tty: %s", child_tty_fds[i], strerror(errno));
-    }
-
-
     err = 0;
 
 out_close:
-    do_syscall(&child, close, child_fd, 0, 0, 0, 0, 0);
-out_free_fds:
-    free(child_tty_fds);
+    ptrace_deadline_ns = 0;
+    if (err && undo.saved) {
+        undo_attach(&child, scratch_page, page_size, &undo);
+        child_fd = -1;
+    }
+    if (child_fd >= 0)
+        do_syscall(&child, close, child_fd, 0, 0, 0, 0, 0);
+    for (i = 0; undo.saved && i < n_fds; i++)
+        if (undo.saved[i] >= 0)
+            do_syscall(&child, close, undo.saved[i], 0, 0, 0, 0, 0);
 
 out_unmap:
-    do_unmap(&child, scratch_page, page_size);
+    ptrace_deadline_ns = 0;
+    stats_enter(stats_detach);
+    release_scratch(&child, scratch_page, page_size);
 
     ptrace_restore_regs(&child);
     ptrace_detach_child(&child);
-
-    if (err == 0) {
-        kill(child.pid, SIGSTOP);
-        wait_for_stop(child.pid, statfd);
-    }
+    stats_leave(stats_detach);
+    stats_leave(stats_critical);
+
+    /*
+     * The target should be stopped when we SIGCONT it, so it sees the
+     * same stop and continue as after a ^Z. If SIGTSTP stopped it,
+     * it's still stopped: Linux (since 3.1) puts a tracee back in its
+     * group stop when we detach. Otherwise we stop it now.
+     */
+#ifdef __linux__
+    if (stopped)
+        debug("Target is still stopped from SIGTSTP");
+    else
+#else
+    (void)stopped;
+#endif
+    if (err == 0)
+        stop_child(child.pid, SIGSTOP, statfd);
     kill(child.pid, SIGWINCH);
 out_cont:
     kill(child.pid, SIGCONT);
+    stats_target_resumed();
+
+    if (max_stop_ms > 0 && (err == ETIMEDOUT || err == -ETIMEDOUT))
+        error("Attaching %d took longer than --max-stop=%ldms, while %s; %s",
+              pid, max_stop_ms, step, moved_session ?
+              "undid what we could, but it stays in its new session" :
+              "put it back as it was");
+
+    /* Only now that it's running again, see how the fds went. */
+    if (err == 0 && calls && sctty >= 0) {
+        for (i = 0; i < n_fds; i++) {
+            if (remote_syscall_failed(&calls[sctty + 1 + i]))
+                error("Problem moving child fd number %d to new tty: %s",
+                      child_tty_fds[i], strerror(-(long)calls[sctty + 1 + i].result));
+        }
+    }
+    free(calls);
+    free(undo.saved);
+    free(child_tty_fds);
+out_close_stat:
 #ifdef __linux__
     close(statfd);
 #endif
@@ -383,14 +899,39 @@ out_cont:
     return err < 0 ? -err : err;
 }
 
+int attach_child(pid_t pid, const char *pty, int force_stdio) {
+    struct proc_table procs = {};
+    int err;
+
+    stats_begin(pid);
+    if ((err = proc_table_track_session(&procs, pid)) == 0)
+        err = do_attach_child(pid, pty, force_stdio, &procs);
+    forget_proc_files();
+    proc_table_free(&procs);
+    stats_report(err);
+    return err;
+}
+
+int attach_child_procs(pid_t pid, const char *pty, int force_stdio,
+                       struct proc_table *procs) {
+    int err;
+
+    stats_begin(pid);
+    if ((err = proc_table_update_for(procs, pid)) == 0)
+        err = do_attach_child(pid, pty, force_stdio, procs);
+    forget_proc_files();
+    stats_report(err);
+    return err;
+}
+
 int setup_steal_socket(struct steal_pty_state *steal) {
     strcpy(steal->tmpdir, "/tmp/reptyr.XXXXXX");
     if (mkdtemp(steal->tmpdir) == NULL)
         return errno;
 
     steal->addr_un.sun_family = AF_UNIX;
-    if (snprintf(steal->addr_un.sun_path, sizeof(steal->addr_un.sun_path),
-                 "%s/reptyr.sock", steal->tmpdir) >= sizeof(steal->addr_un.sun_path)) {
+    if ((size_t)snprintf(steal->addr_un.sun_path, sizeof(steal->addr_un.sun_path),
+                         "%s/reptyr.sock", steal->tmpdir) >= sizeof(steal->addr_un.sun_path)) {
         error("tmpdir path too long!");
         return ENAMETOOLONG;
     }
@@ -498,20 +1039,49 @@ int steal_child_pty(struct steal_pty_state *steal) {
 
 // Attach to the session leader of the stolen session, and block
 // SIGHUP so that if and when the terminal emulator tries to HUP it,
-// it doesn't die.
-int steal_block_hup(struct steal_pty_state *steal) {
+// it doesn't die. If `block` is 0, put back the action we replaced.
+static int steal_leader_hup(struct steal_pty_state *steal, int block) {
     struct ptrace_child leader;
     child_addr_t scratch = 0;
+    size_t len = 2 * sizeof(struct sigaction);
     int err = 0;
 
-    if ((err = grab_pid(steal->target_stat.sid, &leader, &scratch)))
+    if ((err = grab_pid(steal->target_stat.sid, &leader, &scratch, len)))
         return err;
 
-    err = ignore_hup(&leader, scratch);
-
+    stats_enter(stats_ignore_hup);
+    if (block)
+        err = ignore_hup(&leader, scratch, &steal->leader_hup);
+    else
+        err = restore_hup(&leader, scratch, &steal->leader_hup);
+    if (err == -1 && leader.error)
+        err = leader.error;
+    else
+        err = -err;
+    stats_leave(stats_ignore_hup);
+
+    stats_enter(stats_detach);
+    release_scratch(&leader, scratch, len);
     ptrace_restore_regs(&leader);
     ptrace_detach_child(&leader);
+    stats_leave(stats_detach);
+
+    return err;
+}
+
+int steal_block_hup(struct steal_pty_state *steal) {
+    int err;
 
+    if ((err = steal_leader_hup(steal, 1)) == 0)
+        steal->leader_hup_saved = 1;
+    return err;
+}
+
+int steal_restore_hup(struct steal_pty_state *steal) {
+    int err;
+
+    if ((err = steal_leader_hup(steal, 0)) == 0)
+        steal->leader_hup_saved = 0;
     return err;
 }
 
@@ -522,24 +1092,39 @@ int steal_cleanup_child(struct steal_pty_state *steal) {
         return steal->child.error;
     }
 
-    int nullfd = do_syscall(&steal->child, open, steal->child_scratch, O_RDWR, 0, 0, 0, 0);
+    int nullfd = do_open(&steal->child, steal->child_scratch, O_RDWR, 0);
     if (nullfd < 0) {
         return steal->child.error;
     }
 
-    int i;
+    struct remote_syscall *calls;
+    int i, n = 0;
+    long page_size = sysconf(_SC_PAGE_SIZE);
+
+    calls = xreallocarray(NULL, steal->master_fds.n + 2, sizeof *calls);
+    if (!calls) {
+        do_syscall(&steal->child, close, nullfd, 0, 0, 0, 0, 0);
+        return ENOMEM;
+    }
     for (i = 0; i < steal->master_fds.n; ++i) {
-        do_syscall(&steal->child, dup2, nullfd, steal->master_fds.fds[i], 0, 0, 0, 0);
+        calls[n++] = remote_dup2_init(&steal->child, 0,
+                                      nullfd, steal->master_fds.fds[i]);
     }
+    calls[n++] = remote_syscall_init(&steal->child, close, 0, nullfd, 0, 0, 0, 0, 0);
+    if (steal->child_fd > 0)
+        calls[n++] = remote_syscall_init(&steal->child, close, 0, steal->child_fd, 0, 0, 0, 0, 0);
 
-    do_syscall(&steal->child, close, nullfd, 0, 0, 0, 0, 0);
-    do_syscall(&steal->child, close, steal->child_fd, 0, 0, 0, 0, 0);
+    ptrace_remote_syscalls(&steal->child, steal->child_scratch + page_size / 2,
+                           page_size / 2, calls, n);
+    free(calls);
 
     steal->child_fd = 0;
 
+    stats_enter(stats_detach);
     ptrace_restore_regs(&steal->child);
 
     ptrace_detach_child(&steal->child);
+    stats_leave(stats_detach);
     ptrace_wait(&steal->child);
     return 0;
 }
@@ -547,21 +1132,43 @@ int steal_cleanup_child(struct steal_pty_state *steal) {
 int steal_pty(pid_t pid, int *pty) {
     int err = 0;
     struct steal_pty_state steal = {};
+    struct plan plan;
     long page_size = sysconf(_SC_PAGE_SIZE);
 
-    if ((err = preflight_check(pid)))
+    stats_begin(pid);
+    if (plan_cache_lookup(pid, &plan) == 0 && !plan.err)
+        debug("Found a plan for pid %d", pid);
+    else if ((err = preflight_check(pid)))
+        goto out;
+
+    if ((err = proc_table_refresh(&steal.procs)))
         goto out;
 
     if ((err = get_terminal_state(&steal, pid)))
         goto out;
 
-    if ((err = setup_steal_socket(&steal)))
+    /*
+     * The session leader has to be ignoring SIGHUP by the time the
+     * emulator lets go of the pty, but nothing else about it depends on
+     * the emulator. So we deal with it before the emulator stops, and
+     * keep it out of the window in which every other terminal the
+     * emulator runs is frozen; we undo it if the steal then fails.
+     */
+    if ((err = steal_block_hup(&steal)))
         goto out;
 
-    debug("Listening on socket: %s", steal.addr_un.sun_path);
     debug("Attaching terminal emulator pid=%d", steal.emulator_pid);
 
-    if ((err = grab_pid(steal.emulator_pid, &steal.child, &steal.child_scratch)))
+    /*
+     * --max-stop covers the emulator up to the point where we have the
+     * pty. Until then all we've changed in it is the socket, which the
+     * error path closes.
+     */
+    stats_target_stopped();
+    if (max_stop_ms > 0)
+        ptrace_deadline_ns = now_ns() + max_stop_ms * 1000000ULL;
+    if ((err = grab_pid(steal.emulator_pid, &steal.child, &steal.child_scratch,
+                        page_size)))
         goto out;
 
     debug("Attached to terminal emulator (pid %d)",
@@ -572,21 +1179,35 @@ int steal_pty(pid_t pid, int *pty) {
         goto out;
     }
 
-    if ((err = setup_steal_socket_child(&steal)))
-        goto out;
+    if ((err = steal_master_fd(&steal)) == 0) {
+        debug("Took tty fd %d directly", steal.ptyfd);
+    } else {
+        debug("Unable to take the fd directly (%s), passing it over a socket",
+              strerror(err));
 
-    if ((err = steal_child_pty(&steal)))
-        goto out;
+        if ((err = setup_steal_socket(&steal)))
+            goto out;
 
-    if ((err = steal_block_hup(&steal)))
-        goto out;
+        debug("Listening on socket: %s", steal.addr_un.sun_path);
+
+        if ((err = setup_steal_socket_child(&steal)))
+            goto out;
 
+        if ((err = steal_child_pty(&steal)))
+            goto out;
+    }
+
+    ptrace_deadline_ns = 0;
     if ((err = steal_cleanup_child(&steal)))
         goto out;
 
     goto out_no_child;
 
 out:
+    ptrace_deadline_ns = 0;
+    if (max_stop_ms > 0 && err == ETIMEDOUT)
+        error("Stealing from terminal emulator %d took longer than --max-stop=%ldms; "
+              "leaving it as it was", (int)steal.emulator_pid, max_stop_ms);
     if (steal.ptyfd) {
         close(steal.ptyfd);
         steal.ptyfd = 0;
@@ -596,14 +1217,21 @@ out:
         do_syscall(&steal.child, close, steal.child_fd, 0, 0, 0, 0, 0);
 
     if (steal.child_scratch > 0)
-        do_unmap(&steal.child, steal.child_scratch, page_size);
+        release_scratch(&steal.child, steal.child_scratch, page_size);
 
     if (steal.child.state != ptrace_detached) {
+        stats_enter(stats_detach);
         ptrace_restore_regs(&steal.child);
         ptrace_detach_child(&steal.child);
+        stats_leave(stats_detach);
     }
 
+    if (steal.leader_hup_saved && steal_restore_hup(&steal))
+        error("Unable to restore SIGHUP in session leader %d",
+              (int)steal.target_stat.sid);
+
 out_no_child:
+    stats_target_resumed();
 
     if (steal.sockfd > 0) {
         close(steal.sockfd);
@@ -618,6 +1246,8 @@ out_no_child:
         *pty = steal.ptyfd;
 
     free(steal.master_fds.fds);
+    proc_table_free(&steal.procs);
 
+    stats_report(err);
     return err;
 }
@@ -0,0 +1,590 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include "reptyr.h"
+#include "daemon.h"
+#include "reactor.h"
+#include "scrollback.h"
+
+/* What the daemon knows about each pty it holds. */
+struct daemon_pty {
+    pid_t pid;
+    int fd;
+    int open;
+};
+
+/*
+ * The daemon itself. Output that arrives while nobody is attached goes
+ * into the scrollback, which keeps the last DAEMON_SCROLLBACK bytes;
+ * `unseen` is where the output the next client hasn't seen starts.
+ */
+struct daemon {
+    struct reactor reactor;
+    int listen_fd;
+    int client;
+    struct daemon_pty ptys[DAEMON_MAX_TARGETS];
+    int nptys;
+    struct scrollback scrollback;
+    unsigned long long unseen;
+};
+
+static int daemon_default_path(struct sockaddr_un *addr, pid_t pid) {
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    int n;
+
+    if (dir && *dir)
+        n = snprintf(addr->sun_path, sizeof addr->sun_path,
+                     "%s/reptyr-%d.sock", dir, (int)pid);
+    else
+        n = snprintf(addr->sun_path, sizeof addr->sun_path,
+                     "/tmp/reptyr-%d-%d.sock", (int)getuid(), (int)pid);
+    return n < sizeof addr->sun_path ? 0 : ENAMETOOLONG;
+}
+
+/* A bare number means the default socket for that pid. */
+static int daemon_addr(struct sockaddr_un *addr, const char *path, pid_t pid) {
+    char *end;
+    long v;
+
+    memset(addr, 0, sizeof *addr);
+    addr->sun_family = AF_UNIX;
+    if (!path)
+        return daemon_default_path(addr, pid);
+    v = strtol(path, &end, 10);
+    if (end != path && !*end && v > 0)
+        return daemon_default_path(addr, (pid_t)v);
+    if (strlen(path) >= sizeof addr->sun_path)
+        return ENAMETOOLONG;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/*
+ * Bind where we were told to. A socket nobody answers on is left over
+ * from a daemon that died, so it's fair game; a live one isn't.
+ */
+static int daemon_bind(const struct sockaddr_un *addr) {
+    struct stat st;
+    mode_t mask;
+    int fd, err = 0, probe;
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    mask = umask(077);
+    if (bind(fd, (const struct sockaddr *)addr, sizeof *addr) < 0) {
+        err = errno;
+        if (err == EADDRINUSE && (probe = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0) {
+            /*
+             * A plain file refuses connections too; only a socket of ours
+             * that nobody is listening on counts as stale.
+             */
+            if (connect(probe, (const struct sockaddr *)addr, sizeof *addr) < 0 &&
+                errno == ECONNREFUSED &&
+                lstat(addr->sun_path, &st) == 0 &&
+                S_ISSOCK(st.st_mode) && st.st_uid == geteuid()) {
+                debug("Removing stale socket %s", addr->sun_path);
+                unlink(addr->sun_path);
+                err = bind(fd, (const struct sockaddr *)addr, sizeof *addr) < 0 ? errno : 0;
+            }
+            close(probe);
+        }
+    }
+    umask(mask);
+    if (!err && listen(fd, 4) < 0)
+        err = errno;
+    if (err) {
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+int daemon_listen(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (strlen(path) >= sizeof addr.sun_path) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    return daemon_bind(&addr);
+}
+
+int daemon_connect(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd, err;
+
+    if (strlen(path) >= sizeof addr.sun_path) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+int daemon_peer_allowed(int fd) {
+    uid_t uid;
+#ifdef __linux__
+    struct ucred cred;
+    socklen_t len = sizeof cred;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+        return 0;
+    uid = cred.uid;
+#else
+    gid_t gid;
+
+    if (getpeereid(fd, &uid, &gid) < 0)
+        return 0;
+#endif
+    return uid == 0 || uid == getuid();
+}
+
+int daemon_send_fds(int sock, const void *buf, size_t len,
+                    const int *fds, int nfds) {
+    struct {
+        struct cmsghdr align;
+        unsigned char buf[CMSG_SPACE(DAEMON_MAX_TARGETS * sizeof(int))];
+    } control;
+    struct msghdr msg = {};
+    struct iovec iov = { (void *)buf, len };
+    struct cmsghdr *cm;
+    ssize_t n;
+
+    if (nfds > DAEMON_MAX_TARGETS) {
+        errno = E2BIG;
+        return -1;
+    }
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (nfds) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
+    }
+    do {
+        n = sendmsg(sock, &msg, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+        return -1;
+    if (n != len) {
+        errno = EPIPE;
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t daemon_recv_fds(int sock, void *buf, size_t len,
+                        int *fds, int max, int *nfds) {
+    struct {
+        struct cmsghdr align;
+        unsigned char buf[CMSG_SPACE(DAEMON_MAX_TARGETS * sizeof(int))];
+    } control;
+    struct msghdr msg = {};
+    struct iovec iov = { buf, len };
+    struct cmsghdr *cm;
+    int got[DAEMON_MAX_TARGETS];
+    int i, n = 0;
+    ssize_t r;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof control.buf;
+    do {
+        r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (r < 0 && errno == EINTR);
+    *nfds = 0;
+    if (r < 0)
+        return -1;
+    for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+            continue;
+        n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(got, CMSG_DATA(cm), n * sizeof(int));
+    }
+    /* Whatever doesn't fit is no use to the caller. */
+    for (i = max; i < n; i++)
+        close(got[i]);
+    *nfds = n < max ? n : max;
+    memcpy(fds, got, *nfds * sizeof(int));
+    if (r == 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+    return r;
+}
+
+/* Read whatever a pty has for us, and let go of it once it's gone. */
+static void daemon_drain(struct daemon *d, struct daemon_pty *p) {
+    char buf[4096];
+    ssize_t n;
+
+    while ((n = read(p->fd, buf, sizeof buf)) > 0)
+        scrollback_append(&d->scrollback, buf, n);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    debug("pty for pid %d closed", (int)p->pid);
+    p->open = 0;
+    reactor_forget(&d->reactor, p->fd);
+    close(p->fd);
+}
+
+static void daemon_refuse(int fd, int err) {
+    struct daemon_hello hello = {};
+
+    hello.magic = DAEMON_MAGIC;
+    hello.error = err;
+    if (write(fd, &hello, sizeof hello) < 0)
+        debug("Unable to turn a client away: %m");
+    close(fd);
+}
+
+/*
+ * Give a new client the ptys, and the output it missed straight out of
+ * the scrollback. What it has been sent counts as seen: the next client
+ * only needs what arrives after this one leaves.
+ */
+static int daemon_hand_over(struct daemon *d, int fd) {
+    struct daemon_hello hello = {};
+    int fds[DAEMON_MAX_TARGETS];
+    unsigned long long cursor = d->unseen;
+    int i, n = 0;
+
+    for (i = 0; i < d->nptys; i++) {
+        if (!d->ptys[i].open)
+            continue;
+        hello.pids[n] = d->ptys[i].pid;
+        fds[n++] = d->ptys[i].fd;
+    }
+    hello.magic = DAEMON_MAGIC;
+    hello.ntargets = n;
+    scrollback_catch_up(&d->scrollback, &cursor);
+    hello.scrollback = d->scrollback.head - cursor;
+
+    if (daemon_send_fds(fd, &hello, sizeof hello, fds, n) < 0)
+        return -1;
+
+    while (cursor < d->scrollback.head)
+        if (scrollback_write(&d->scrollback, fd, &cursor) < 0 && errno != EINTR)
+            return -1;
+    d->unseen = cursor;
+    return 0;
+}
+
+static void daemon_accept(struct daemon *d) {
+    int fd = accept(d->listen_fd, NULL, NULL);
+
+    if (fd < 0)
+        return;
+    if (!daemon_peer_allowed(fd)) {
+        daemon_refuse(fd, EPERM);
+        return;
+    }
+    if (d->client >= 0) {
+        daemon_refuse(fd, EBUSY);
+        return;
+    }
+    if (daemon_hand_over(d, fd) < 0) {
+        close(fd);
+        return;
+    }
+    d->client = fd;
+}
+
+/* The client never says anything; we only care about it going away. */
+static void daemon_client_ready(struct daemon *d) {
+    char c;
+    ssize_t n = read(d->client, &c, 1);
+
+    if (n > 0 || (n < 0 && (errno == EAGAIN || errno == EINTR)))
+        return;
+    reactor_forget(&d->reactor, d->client);
+    close(d->client);
+    d->client = -1;
+}
+
+static int daemon_run(struct daemon *d) {
+    struct reactor_event ev[16];
+    int i, j, n, live;
+
+    if (reactor_init(&d->reactor) < 0)
+        return errno;
+    while (1) {
+        live = 0;
+        for (i = 0; i < d->nptys; i++)
+            live |= d->ptys[i].open;
+        if (!live && d->client < 0)
+            break;
+
+        reactor_watch(&d->reactor, d->listen_fd, REACTOR_READ);
+        if (d->client >= 0)
+            reactor_watch(&d->reactor, d->client, REACTOR_READ);
+        for (i = 0; i < d->nptys; i++)
+            if (d->ptys[i].open)
+                reactor_watch(&d->reactor, d->ptys[i].fd,
+                              d->client < 0 ? REACTOR_READ : 0);
+
+        n = reactor_wait(&d->reactor, ev, sizeof ev / sizeof *ev, -1);
+        if (n < 0)
+            break;
+        for (j = 0; j < n; j++) {
+            if (ev[j].fd == d->listen_fd) {
+                daemon_accept(d);
+                continue;
+            }
+            if (d->client >= 0 && ev[j].fd == d->client) {
+                daemon_client_ready(d);
+                continue;
+            }
+            for (i = 0; i < d->nptys; i++) {
+                if (!d->ptys[i].open || d->ptys[i].fd != ev[j].fd)
+                    continue;
+                if (d->client < 0)
+                    daemon_drain(d, &d->ptys[i]);
+            }
+        }
+    }
+    reactor_close(&d->reactor);
+    return 0;
+}
+
+int daemon_detach(struct proxy_session *s, const char *path) {
+    struct daemon *d;
+    struct sockaddr_un addr;
+    pid_t pid;
+    int ready[2];
+    int i, fd, err;
+    char c;
+
+    if (s->ntargets > DAEMON_MAX_TARGETS)
+        return E2BIG;
+    if ((err = daemon_addr(&addr, path, s->targets[0].pid ?: getpid())))
+        return err;
+    if (!(d = calloc(1, sizeof *d)))
+        return ENOMEM;
+    if (scrollback_init(&d->scrollback, DAEMON_SCROLLBACK) < 0) {
+        free(d);
+        return ENOMEM;
+    }
+    if ((d->listen_fd = daemon_bind(&addr)) < 0) {
+        err = errno;
+        error("Unable to listen on %s: %m", addr.sun_path);
+        scrollback_free(&d->scrollback);
+        free(d);
+        return err;
+    }
+    d->client = -1;
+    for (i = 0; i < s->ntargets; i++) {
+        d->ptys[i].pid = s->targets[i].pid;
+        d->ptys[i].fd = s->targets[i].pty;
+        d->ptys[i].open = 1;
+    }
+    d->nptys = s->ntargets;
+
+    if (pipe(ready) < 0) {
+        err = errno;
+        goto out;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    if ((pid = fork()) < 0) {
+        err = errno;
+        close(ready[0]);
+        close(ready[1]);
+        goto out;
+    }
+    if (pid) {
+        /*
+         * Until it has its own session, the daemon goes down with our
+         * terminal, so don't let that go until it's safe.
+         */
+        close(ready[1]);
+        while (read(ready[0], &c, 1) < 0 && errno == EINTR)
+            ;
+        close(ready[0]);
+        fprintf(stderr, "Detached; reattach with: reptyr -r %s\n", addr.sun_path);
+        for (i = 0; i < s->ntargets; i++)
+            close(s->targets[i].pty);
+        close(d->listen_fd);
+        scrollback_free(&d->scrollback);
+        free(d);
+        return 0;
+    }
+
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    setsid();
+    close(ready[0]);
+    close(ready[1]);
+    if (chdir("/") < 0)
+        debug("chdir /: %m");
+    if ((fd = open("/dev/null", O_RDWR)) >= 0) {
+        dup2(fd, 0);
+        dup2(fd, 1);
+        dup2(fd, 2);
+        if (fd > 2)
+            close(fd);
+    }
+    for (i = 0; i < d->nptys; i++)
+        fcntl(d->ptys[i].fd, F_SETFL, fcntl(d->ptys[i].fd, F_GETFL) | O_NONBLOCK);
+
+    daemon_run(d);
+    unlink(addr.sun_path);
+    _exit(0);
+
+out:
+    unlink(addr.sun_path);
+    close(d->listen_fd);
+    scrollback_free(&d->scrollback);
+    free(d);
+    return err;
+}
+
+int daemon_read_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    ssize_t n;
+
+    while (len) {
+        n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            errno = n ? errno : ECONNRESET;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int daemon_reattach(struct proxy_session *s, const char *path) {
+    struct daemon_hello hello;
+    struct sockaddr_un addr;
+    int fds[DAEMON_MAX_TARGETS];
+    char *buf;
+    int fd, err, i, nfds = 0;
+    ssize_t n;
+    size_t off;
+
+    if ((err = daemon_addr(&addr, path, getpid()))) {
+        errno = err;
+        return -1;
+    }
+    if ((fd = daemon_connect(addr.sun_path)) < 0)
+        return -1;
+
+    if ((n = daemon_recv_fds(fd, &hello, sizeof hello, fds,
+                             DAEMON_MAX_TARGETS, &nfds)) < 0)
+        goto fail;
+    if (n < sizeof hello &&
+        daemon_read_all(fd, (char *)&hello + n, sizeof hello - n) < 0)
+        goto fail_fds;
+    if (hello.magic != DAEMON_MAGIC) {
+        errno = EPROTO;
+        goto fail_fds;
+    }
+    if (hello.error) {
+        errno = hello.error;
+        goto fail_fds;
+    }
+    if (hello.ntargets != nfds || !nfds) {
+        errno = nfds ? EPROTO : ENOENT;
+        goto fail_fds;
+    }
+
+    /*
+     * Collect the scrollback before showing any of it, so the replay
+     * reaches the terminal in one write. The terminal isn't raw yet,
+     * so it goes straight to stdout.
+     */
+    if (hello.scrollback > DAEMON_SCROLLBACK) {
+        errno = EPROTO;
+        goto fail_fds;
+    }
+    if (hello.scrollback) {
+        if (!(buf = malloc(hello.scrollback)))
+            goto fail_fds;
+        if (daemon_read_all(fd, buf, hello.scrollback) < 0) {
+            free(buf);
+            goto fail_fds;
+        }
+        for (off = 0; off < hello.scrollback; off += n) {
+            n = write(1, buf + off, hello.scrollback - off);
+            if (n < 0 && errno == EINTR)
+                n = 0;
+            else if (n < 0) {
+                debug("Unable to replay the scrollback: %m");
+                break;
+            }
+        }
+        free(buf);
+    }
+
+    for (i = 0; i < nfds; i++) {
+        if (proxy_add_target(s, hello.pids[i], fds[i]) < 0) {
+            errno = ENOMEM;
+            goto fail_fds;
+        }
+        fds[i] = -1;
+    }
+    return fd;
+
+fail_fds:
+    err = errno;
+    for (i = 0; i < nfds; i++)
+        if (fds[i] >= 0)
+            close(fds[i]);
+    errno = err;
+fail:
+    err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stdint.h>
+#include "proxy.h"
+
+/*
+ * Detached mode. The process that attached hands its pty masters to a
+ * small daemon, which holds them (so the targets never see a hangup),
+ * keeps the most recent output around, and gives the masters to whoever
+ * connects to its socket later on. The client then runs the proxy on
+ * them itself; no new ptrace attach is needed. While a client has them,
+ * the daemon keeps its hands off the masters, and once the client's
+ * connection goes away it goes back to collecting output.
+ */
+
+#define DAEMON_MAGIC 0x72707479     /* "rpty" */
+#define DAEMON_MAX_TARGETS 64
+#define DAEMON_SCROLLBACK 65536
+
+/*
+ * What the daemon sends a client, with the masters attached as
+ * SCM_RIGHTS. `scrollback` bytes of recent output follow it.
+ */
+struct daemon_hello {
+    uint32_t magic;
+    int32_t error;
+    uint32_t ntargets;
+    uint32_t scrollback;
+    int32_t pids[DAEMON_MAX_TARGETS];
+};
+
+/*
+ * Hand the session's ptys to a new daemon listening on `path` (or the
+ * default for the first target, if NULL), and tell the user how to get
+ * them back. Returns 0 once the daemon is up, or an errno value.
+ */
+int daemon_detach(struct proxy_session *s, const char *path);
+/*
+ * Fetch the ptys from the daemon on `path` (or, if it's a number, the
+ * default socket for that pid) into s, and copy its
+ * scrollback to stdout. Returns the connection, which has to stay open
+ * for as long as we're using them, or -1 with errno set.
+ */
+int daemon_reattach(struct proxy_session *s, const char *path);
+
+/*
+ * The socket plumbing, which --share uses too. daemon_listen() only
+ * ever lets the current user in (and replaces a stale socket);
+ * daemon_peer_allowed() is the check to make on each connection.
+ */
+int daemon_listen(const char *path);
+int daemon_connect(const char *path);
+int daemon_peer_allowed(int fd);
+/*
+ * Send buf with up to DAEMON_MAX_TARGETS fds attached, and receive such
+ * a message: at most `max` of the fds are kept, and *nfds says how many.
+ * daemon_recv_fds returns how much of buf it filled, which may be short.
+ */
+int daemon_send_fds(int sock, const void *buf, size_t len,
+                    const int *fds, int nfds);
+ssize_t daemon_recv_fds(int sock, void *buf, size_t len,
+                        int *fds, int max, int *nfds);
+int daemon_read_all(int fd, void *buf, size_t len);
+
+#endif
@@ -0,0 +1,343 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include "reptyr.h"
+#include "plan.h"
+#include "platform/platform.h"
+
+const char *plan_cache_path;
+
+/*
+ * For the estimate of how long a target is stopped: a resume-and-wait
+ * of a tracee costs about PLAN_ROUND_TRIP_US, and this is how many
+ * each part of an attach takes. --stats shows the real numbers.
+ */
+#define PLAN_ROUND_TRIP_US 100
+#define PLAN_ATTACH_TRIPS 8
+#define PLAN_SETSID_TRIPS 6
+#define PLAN_STEAL_TRIPS 6
+
+static void plan_copy_fds(struct plan *p, const int *fds, int n) {
+    if (n > PLAN_MAX_FDS)
+        n = PLAN_MAX_FDS;
+    memcpy(p->fds, fds, n * sizeof *fds);
+    p->nfds = n;
+}
+
+static unsigned long plan_freeze_trips(int nthreads) {
+    return freeze_threads && nthreads > 1 ? nthreads - 1 : 0;
+}
+
+static int plan_for_attach(struct plan *p, struct proc_table *procs) {
+    static const int stdio_fds[] = { 0, 1, 2 };
+    struct ptrace_child child = { .pid = p->pid };
+    struct proc_entry *e;
+    struct termios tio;
+    unsigned long trips;
+    int *fds, n, statfd = -1;
+#ifdef __linux__
+    char stat_path[PATH_MAX];
+#endif
+
+    if (get_process_tty_termios(p->pid, &tio) == ENOTTY) {
+        p->strategy = plan_stdio;
+        plan_copy_fds(p, stdio_fds, 3);
+    } else {
+        p->strategy = plan_plain;
+#ifdef __linux__
+        snprintf(stat_path, sizeof stat_path, "/proc/%d/stat", p->pid);
+        if ((statfd = open(stat_path, O_RDONLY)) < 0)
+            return assert_nonzero(errno);
+#endif
+        fds = get_child_tty_fds(&child, statfd, &n);
+#ifdef __linux__
+        close(statfd);
+#endif
+        if (!fds)
+            return child.error;
+        plan_copy_fds(p, fds, n);
+        free(fds);
+    }
+
+    trips = PLAN_ATTACH_TRIPS + plan_freeze_trips(p->nthreads);
+    e = proc_table_find(procs, p->pid);
+    if (e && e->sid != p->pid)
+        trips += PLAN_SETSID_TRIPS;
+    p->stop_us = trips * PLAN_ROUND_TRIP_US;
+    return 0;
+}
+
+static int plan_for_steal(struct plan *p, struct proc_table *procs) {
+    struct steal_pty_state steal = { .procs = *procs };
+    struct proc_info info;
+    int err;
+
+    p->strategy = plan_steal;
+    if ((err = get_terminal_state(&steal, p->pid)))
+        return err;
+    p->emulator = steal.emulator_pid;
+    if ((err = check_ptrace_access(steal.emulator_pid)) ||
+        (err = check_ptrace_access(steal.target_stat.sid)))
+        return err;
+    if ((err = get_proc_info(steal.emulator_pid, &info)))
+        return err;
+
+    /* Not attached, so it can only go by what /proc says. */
+    steal.child.pid = steal.emulator_pid;
+    err = find_master_fd(&steal);
+    if (!err)
+        plan_copy_fds(p, steal.master_fds.fds, steal.master_fds.n);
+    free(steal.master_fds.fds);
+
+    p->stop_us = (PLAN_STEAL_TRIPS + plan_freeze_trips(info.nthreads)) *
+        PLAN_ROUND_TRIP_US;
+    return err;
+}
+
+int plan_target(pid_t pid, struct plan *p) {
+    struct proc_table procs = {};
+    struct proc_info info;
+    int err;
+
+    memset(p, 0, sizeof *p);
+    p->pid = pid;
+    p->when = time(NULL);
+    p->tstp_stops = 1;
+
+    if ((err = get_proc_info(pid, &info)))
+        goto out;
+    p->starttime = info.starttime;
+    p->nthreads = info.nthreads;
+    if ((err = check_ptrace_access(pid)))
+        goto out;
+    if ((err = proc_table_refresh(&procs)))
+        goto out;
+    p->tstp_stops = tstp_will_stop(&procs, pid, &info);
+
+    /* Anything else in its process group is what -T is for. */
+    if (check_pgroup(&procs, pid) == 0)
+        err = plan_for_attach(p, &procs);
+    else
+        err = plan_for_steal(p, &procs);
+
+out:
+    forget_proc_files();
+    proc_table_free(&procs);
+    p->err = err;
+    return err;
+}
+
+void plan_print(const struct plan *p) {
+    int i;
+
+    if (p->err) {
+        printf("pid %d: can't attach: %s\n", (int)p->pid, strerror(p->err));
+        return;
+    }
+    switch (p->strategy) {
+    case plan_plain:
+        printf("pid %d: attach\n", (int)p->pid);
+        break;
+    case plan_stdio:
+        printf("pid %d: attach with -s; it isn't on a terminal\n", (int)p->pid);
+        break;
+    case plan_steal:
+        printf("pid %d: attach with -T, through terminal emulator %d\n",
+               (int)p->pid, (int)p->emulator);
+        break;
+    }
+    printf("    %s:", p->strategy == plan_steal ? "emulator fds" : "fds");
+    for (i = 0; i < p->nfds; i++)
+        printf(" %d", p->fds[i]);
+    printf("\n    %s stopped for about %.1fms\n",
+           p->strategy == plan_steal ? "emulator" : "target",
+           p->stop_us / 1000.0);
+    if (!p->tstp_stops && p->strategy != plan_steal)
+        printf("    SIGTSTP won't stop it, so its shell won't see it go\n");
+}
+
+static int plan_default_path(char *buf, size_t len) {
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    int n;
+
+    if (dir && *dir)
+        n = snprintf(buf, len, "%s/reptyr-plan", dir);
+    else
+        n = snprintf(buf, len, "/tmp/reptyr-%d-plan", (int)getuid());
+    return n < len ? 0 : ENAMETOOLONG;
+}
+
+static const char *plan_path(char *buf, size_t len) {
+    if (plan_cache_path)
+        return plan_cache_path;
+    return plan_default_path(buf, len) ? NULL : buf;
+}
+
+/*
+ * The cache may well be in /tmp, so only believe one that's ours and
+ * that nobody else could have written to.
+ */
+static FILE *plan_cache_open(const char *path) {
+    struct stat st;
+    FILE *f;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+        st.st_uid != geteuid() || (st.st_mode & 022)) {
+        close(fd);
+        return NULL;
+    }
+    if ((f = fdopen(fd, "r")) == NULL)
+        close(fd);
+    return f;
+}
+
+/*
+ * One plan per line:
+ *   pid starttime when err strategy tstp_stops nthreads emulator stop_us fds
+ * where fds is a comma-separated list, or "-".
+ */
+static int plan_parse(const char *line, struct plan *p) {
+    char fds[PLAN_MAX_FDS * 12], *f, *save;
+    long when;
+    int pid, emulator, strategy;
+
+    memset(p, 0, sizeof *p);
+    if (sscanf(line, "%d %llu %ld %d %d %d %d %d %lu %767s",
+               &pid, &p->starttime, &when, &p->err, &strategy,
+               &p->tstp_stops, &p->nthreads, &emulator, &p->stop_us,
+               fds) != 10)
+        return -1;
+    if (strategy < plan_plain || strategy > plan_steal)
+        return -1;
+    p->pid = pid;
+    p->when = when;
+    p->strategy = strategy;
+    p->emulator = emulator;
+    if (strcmp(fds, "-")) {
+        for (f = strtok_r(fds, ",", &save); f && p->nfds < PLAN_MAX_FDS;
+             f = strtok_r(NULL, ",", &save))
+            p->fds[p->nfds++] = atoi(f);
+    }
+    return 0;
+}
+
+static void plan_write(FILE *f, const struct plan *p) {
+    int i;
+
+    fprintf(f, "%d %llu %ld %d %d %d %d %d %lu ", (int)p->pid, p->starttime,
+            (long)p->when, p->err, (int)p->strategy, p->tstp_stops, p->nthreads,
+            (int)p->emulator, p->stop_us);
+    if (!p->nfds)
+        fprintf(f, "-");
+    for (i = 0; i < p->nfds; i++)
+        fprintf(f, "%s%d", i ? "," : "", p->fds[i]);
+    fprintf(f, "\n");
+}
+
+static int plan_fresh(const struct plan *p, time_t now) {
+    return p->when <= now && now - p->when <= PLAN_CACHE_MAX_AGE;
+}
+
+int plan_cache_lookup(pid_t pid, struct plan *p) {
+    char buf[PATH_MAX], line[1024];
+    struct proc_info info;
+    const char *path;
+    time_t now = time(NULL);
+    int found = -1;
+    FILE *f;
+
+    if ((path = plan_path(buf, sizeof buf)) == NULL)
+        return -1;
+    if ((f = plan_cache_open(path)) == NULL)
+        return -1;
+    while (found < 0 && fgets(line, sizeof line, f)) {
+        if (plan_parse(line, p) == 0 && p->pid == pid && plan_fresh(p, now))
+            found = 0;
+    }
+    fclose(f);
+    if (found < 0)
+        return -1;
+    /* The same pid, but is it the same process? */
+    if (get_proc_info(pid, &info) || info.starttime != p->starttime)
+        return -1;
+    return 0;
+}
+
+int plan_cache_store(const struct plan *plans, int n) {
+    char buf[PATH_MAX], tmp[PATH_MAX + 8], line[1024];
+    struct plan old;
+    const char *path;
+    time_t now = time(NULL);
+    FILE *in, *out;
+    int fd, i, err = 0;
+
+    if ((path = plan_path(buf, sizeof buf)) == NULL)
+        return ENAMETOOLONG;
+    if (snprintf(tmp, sizeof tmp, "%s.XXXXXX", path) >= sizeof tmp)
+        return ENAMETOOLONG;
+    if ((fd = mkstemp(tmp)) < 0)
+        return errno;
+    if ((out = fdopen(fd, "w")) == NULL) {
+        err = errno;
+        close(fd);
+        unlink(tmp);
+        return err;
+    }
+
+    /* Keep whatever's still fresh, and not about to be replaced. */
+    if ((in = plan_cache_open(path)) != NULL) {
+        while (fgets(line, sizeof line, in)) {
+            if (plan_parse(line, &old) || !plan_fresh(&old, now))
+                continue;
+            for (i = 0; i < n && plans[i].pid != old.pid; i++)
+                ;
+            if (i == n)
+                plan_write(out, &old);
+        }
+        fclose(in);
+    }
+    for (i = 0; i < n; i++)
+        plan_write(out, &plans[i]);
+
+    if (fflush(out) || ferror(out))
+        err = assert_nonzero(errno);
+    if (fclose(out) && !err)
+        err = assert_nonzero(errno);
+    if (!err && rename(tmp, path) < 0)
+        err = errno;
+    if (err)
+        unlink(tmp);
+    return err;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * --plan works out what attaching each pid would take, without stopping
+ * anything, and remembers what it found in a small cache file. Entries
+ * are keyed by pid and start time, so a reused pid never matches, and
+ * go stale after PLAN_CACHE_MAX_AGE seconds. An attach that finds its
+ * target in the cache skips the checks --plan already made.
+ */
+
+#define PLAN_CACHE_MAX_AGE 600
+#define PLAN_MAX_FDS 64
+
+enum plan_strategy {
+    plan_plain = 0,     /* reptyr PID */
+    plan_stdio,         /* reptyr -s PID */
+    plan_steal,         /* reptyr -T PID */
+};
+
+struct plan {
+    pid_t pid;
+    unsigned long long starttime;
+    time_t when;
+    /* Why it can't be attached, or 0. */
+    int err;
+    enum plan_strategy strategy;
+    /* Whether SIGTSTP will stop it, or we'd only wait for it in vain. */
+    int tstp_stops;
+    int nthreads;
+    /* The fds that get moved: the target's, or the emulator's with -T. */
+    int fds[PLAN_MAX_FDS];
+    int nfds;
+    pid_t emulator;
+    /* Roughly how long it'll be stopped for (the emulator, with -T). */
+    unsigned long stop_us;
+};
+
+/* Set by --plan-cache; NULL means the default. */
+extern const char *plan_cache_path;
+
+/* Work out how pid would be attached. Returns 0, or an errno value. */
+int plan_target(pid_t pid, struct plan *p);
+void plan_print(const struct plan *p);
+/* Add plans to the cache, replacing what it had for the same targets. */
+int plan_cache_store(const struct plan *plans, int n);
+/*
+ * Find a fresh plan for pid in the cache. Returns 0 and fills in *p,
+ * or -1 if there isn't one.
+ */
+int plan_cache_lookup(pid_t pid, struct plan *p);
+
+#endif
@@ -35,6 +35,7 @@ static struct ptrace_personality arch_personality[2] = {
         offsetof(struct reg, r_r8),
         offsetof(struct reg, r_r9),
         offsetof(struct reg, r_rip),
+        offsetof(struct reg, r_rsp),
     },
     {
         offsetof(struct reg, r_rax),
@@ -45,6 +46,7 @@ static struct ptrace_personality arch_personality[2] = {
         offsetof(struct reg, r_rdi),
         offsetof(struct reg, r_rbp),
         offsetof(struct reg, r_rip),
+        offsetof(struct reg, r_rsp),
     },
 };
 
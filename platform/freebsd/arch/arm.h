@@ -32,6 +32,7 @@ static struct ptrace_personality arch_personality[1] = {
         offsetof(struct user, regs.uregs[4]),
         offsetof(struct user, regs.uregs[5]),
         offsetof(struct user, regs.ARM_pc),
+        offsetof(struct user, regs.ARM_sp),
     }
 };
 
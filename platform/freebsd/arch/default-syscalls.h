@@ -16,6 +16,7 @@
     SC(setsid),
     SC(setpgid),
     SC(fork),
+    .nr_clone = -1,
     SC(wait4),
 #ifdef SYS_signal
     SC(signal),
@@ -24,9 +25,12 @@
 #endif
     .nr_rt_sigaction = SYS_sigaction,
     SC(open),
+    SC(openat),
     SC(close),
     SC(ioctl),
     SC(dup2),
+    .nr_dup3 = -1,
+    SC(fcntl),
 #ifdef SYS_socketcall
     SC(socketcall),
 #else
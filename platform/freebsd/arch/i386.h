@@ -31,6 +31,7 @@ static struct ptrace_personality arch_personality[1] = {
         offsetof(struct reg, r_edi),
         offsetof(struct reg, r_ebp),
         offsetof(struct reg, r_eip),
+        offsetof(struct reg, r_esp),
     }
 };
 
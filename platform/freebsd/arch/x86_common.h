@@ -42,21 +42,22 @@ static inline void arch_fixup_regs(struct ptrace_child *child) {
 }
 
 static inline unsigned long arch_get_register(struct ptrace_child *child, unsigned long oft){
-	int ret;
 	struct reg regs;
 
-	ret = ptrace_command(child, PT_GETREGS, &regs);
+	/* On failure, child->error says so. */
+	if (ptrace_command(child, PT_GETREGS, &regs) < 0)
+		return 0;
 
 	return *ptr(&regs,oft);
 }
 
 static inline void arch_set_register(struct ptrace_child *child, unsigned long oft, unsigned long val){
-	int ret;
 	struct reg regs;
 
-	ret = ptrace_command(child, PT_GETREGS, &regs);
+	if (ptrace_command(child, PT_GETREGS, &regs) < 0)
+		return;
 	*ptr(&regs,oft)=val;
-	ret = ptrace_command(child, PT_SETREGS, &regs);
+	ptrace_command(child, PT_SETREGS, &regs);
 }
 
 static inline int arch_save_syscall(struct ptrace_child *child) {
@@ -30,18 +30,119 @@
 void check_ptrace_scope(void) {
 }
 
-int check_pgroup(pid_t target) {
+int proc_table_refresh(struct proc_table *pt) {
     struct procstat *procstat;
     struct kinfo_proc *kp;
-    pid_t pg;
-    unsigned int cnt;
+    struct proc_entry e;
+    unsigned int cnt, i;
+    int err = 0;
+
+    pt->n = 0;
+    procstat = procstat_open_sysctl();
+    if (procstat == NULL)
+        return assert_nonzero(errno);
+    kp = procstat_getprocs(procstat, KERN_PROC_PROC, 0, &cnt);
+    if (kp == NULL) {
+        procstat_close(procstat);
+        return ESRCH;
+    }
+
+    for (i = 0; i < cnt; i++) {
+        e = (struct proc_entry){
+            .pid = kp[i].ki_pid,
+            .ppid = kp[i].ki_ppid,
+            .pgid = kp[i].ki_pgid,
+            .sid = kp[i].ki_sid,
+            .uid = kp[i].ki_uid,
+            .ctty = kp[i].ki_tdev,
+            .state = kp[i].ki_stat == SSTOP ? 'T' : 'R',
+        };
+        if (proc_table_append(pt, &e) < 0) {
+            err = assert_nonzero(errno);
+            break;
+        }
+    }
+    procstat_freeprocs(procstat, kp);
+    procstat_close(procstat);
+    proc_table_sort(pt);
+    return err;
+}
 
-    pg = getpgid(target);
+/* No incremental tracking here; every update is a fresh snapshot. */
+int proc_table_track_session(struct proc_table *pt, pid_t target) {
+    return proc_table_refresh(pt);
+}
+
+int proc_table_track_all(struct proc_table *pt) {
+    return proc_table_refresh(pt);
+}
+
+int proc_table_update(struct proc_table *pt) {
+    return proc_table_refresh(pt);
+}
+
+int proc_table_update_for(struct proc_table *pt, pid_t target) {
+    return proc_table_refresh(pt);
+}
+
+int get_proc_info(pid_t pid, struct proc_info *out) {
+    struct procstat *procstat;
+    struct kinfo_proc *kp;
+    unsigned int cnt;
 
     procstat = procstat_open_sysctl();
-    kp = procstat_getprocs(procstat, KERN_PROC_PGRP, pg, &cnt);
+    if (procstat == NULL)
+        return assert_nonzero(errno);
+    kp = procstat_getprocs(procstat, KERN_PROC_PID, pid, &cnt);
+    if (kp == NULL || cnt < 1) {
+        procstat_close(procstat);
+        return ESRCH;
+    }
+    out->starttime = kp->ki_start.tv_sec * 1000000ULL + kp->ki_start.tv_usec;
+    out->nthreads = kp->ki_numthreads;
+    out->tstp_ignored = sigismember(&kp->ki_sigignore, SIGTSTP) ||
+                        sigismember(&kp->ki_sigmask, SIGTSTP);
+    out->tstp_caught = sigismember(&kp->ki_sigcatch, SIGTSTP);
     procstat_freeprocs(procstat, kp);
     procstat_close(procstat);
+    return 0;
+}
+
+/* Only an approximation of p_candebug(): same uid, or root. */
+int check_ptrace_access(pid_t pid) {
+    struct procstat *procstat;
+    struct kinfo_proc *kp;
+    unsigned int cnt;
+    int err = 0;
+
+    if (geteuid() == 0)
+        return 0;
+    procstat = procstat_open_sysctl();
+    if (procstat == NULL)
+        return assert_nonzero(errno);
+    kp = procstat_getprocs(procstat, KERN_PROC_PID, pid, &cnt);
+    if (kp == NULL || cnt < 1)
+        err = ESRCH;
+    else if (kp->ki_uid != geteuid())
+        err = EPERM;
+    if (kp)
+        procstat_freeprocs(procstat, kp);
+    procstat_close(procstat);
+    return err;
+}
+
+int check_pgroup(struct proc_table *pt, pid_t target) {
+    struct proc_entry *e;
+    pid_t pg;
+    int i, cnt = 0;
+
+    if ((e = proc_table_find(pt, target)) == NULL)
+        return ESRCH;
+    pg = e->pgid;
+
+    for (i = 0; i < pt->n; i++)
+        if (pt->procs[i].pgid == pg)
+            cnt++;
 
     if (cnt > 1) {
         error("Process %d shares a process group with %d other processes. Unable to attach.\n", target, cnt - 1);
@@ -76,38 +177,74 @@ int check_proc_stopped(pid_t pid, int fd) {
     return 0;
 }
 
-struct filestat_list* get_procfiles(pid_t pid, struct kinfo_proc **kp, struct procstat **procstat, unsigned int *cnt) {
+/*
+ * procstat hands out a process's files all at once, copying the whole
+ * table out of the kernel to do it. One attach asks about its target's
+ * files several times before the stop (for termios and for the tty
+ * fds), so it takes a snapshot once and reads from that until
+ * forget_proc_files().
+ */
+static struct {
+    pid_t pid;
+    struct procstat *procstat;
+    struct kinfo_proc *kp;
+    struct filestat_list *files;
+} snapshot;
+
+void forget_proc_files(void) {
+    if (snapshot.files)
+        procstat_freefiles(snapshot.procstat, snapshot.files);
+    if (snapshot.kp)
+        procstat_freeprocs(snapshot.procstat, snapshot.kp);
+    if (snapshot.procstat)
+        procstat_close(snapshot.procstat);
+    memset(&snapshot, 0, sizeof snapshot);
+}
+
+static int get_procfiles(pid_t pid) {
     int mflg = 0; // include mmapped files
-    (*procstat) = procstat_open_sysctl();
-    (*kp) = procstat_getprocs(*procstat, KERN_PROC_PID, pid, cnt);
-    if ((*kp) == NULL || *cnt < 1)
-        return NULL;
+    unsigned int cnt;
 
-    return procstat_getfiles(*procstat, *kp, mflg);
+    if (snapshot.files && snapshot.pid == pid)
+        return 0;
+    forget_proc_files();
+    if ((snapshot.procstat = procstat_open_sysctl()) == NULL)
+        return assert_nonzero(errno);
+    snapshot.kp = procstat_getprocs(snapshot.procstat, KERN_PROC_PID, pid, &cnt);
+    if (snapshot.kp == NULL || cnt < 1) {
+        forget_proc_files();
+        return ESRCH;
+    }
+    snapshot.files = procstat_getfiles(snapshot.procstat, snapshot.kp, mflg);
+    if (snapshot.files == NULL) {
+        forget_proc_files();
+        return ESRCH;
+    }
+    snapshot.pid = pid;
+    return 0;
 }
 
 int *get_child_tty_fds(struct ptrace_child *child, int statfd, int *count) {
     struct filestat *fst;
-    struct filestat_list *head;
-    struct procstat *procstat;
-    struct kinfo_proc *kp;
-    unsigned int cnt;
     struct fd_array fds = {};
     struct vnstat vn;
     int er;
     char errbuf[_POSIX2_LINE_MAX];
 
-    head = get_procfiles(child->pid, &kp, &procstat, &cnt);
+    if ((er = get_procfiles(child->pid))) {
+        child->error = er;
+        return NULL;
+    }
 
-    STAILQ_FOREACH(fst, head, next) {
+    STAILQ_FOREACH(fst, snapshot.files, next) {
         if (fst->fs_type == PS_FST_TYPE_VNODE) {
-            er = procstat_get_vnode_info(procstat, fst, &vn, errbuf);
+            er = procstat_get_vnode_info(snapshot.procstat, fst, &vn, errbuf);
             if (er != 0) {
                 error("%s", errbuf);
                 goto out;
             }
 
-            if (vn.vn_dev == kp->ki_tdev) {
+            if (vn.vn_dev == snapshot.kp->ki_tdev) {
                 if (fd_array_push(&fds, fst->fs_fd) != 0) {
                     error("Unable to allocate memory for fd array.");
                     goto out;
@@ -117,14 +254,22 @@ int *get_child_tty_fds(struct ptrace_child *child, int statfd, int *count) {
     }
 
 out:
-    procstat_freefiles(procstat, head);
-    procstat_freeprocs(procstat, kp);
-    procstat_close(procstat);
     *count = fds.n;
     debug("Found %d tty fds in child %d.", fds.n, child->pid);
     return fds.fds;
 }
 
+/*
+ * procstat has no cheaper way to look at a few fds than all of them,
+ * and the snapshot from before the stop may have moved on since.
+ */
+int *recheck_child_tty_fds(struct ptrace_child *child, int statfd,
+                           int *fds, int *count) {
+    free(fds);
+    forget_proc_files();
+    return get_child_tty_fds(child, statfd, count);
+}
+
 // Find the PID of the terminal emulator for `target's terminal.
 //
 // We assume that the terminal emulator is the parent of the session
@@ -132,51 +277,77 @@ out:
 // construct situations where it is false. We should fail safe later
 // on if this turns out to be wrong, however.
 int find_terminal_emulator(struct steal_pty_state *steal) {
-    struct procstat *procstat;
-    struct kinfo_proc *kp;
-    unsigned int cnt;
-
-    procstat = procstat_open_sysctl();
-    kp = procstat_getprocs(procstat, KERN_PROC_PID, steal->target_stat.sid, &cnt);
-
-    if (kp && cnt > 0)
-        steal->emulator_pid = kp->ki_ppid;
+    struct proc_entry *leader;
 
-    procstat_freeprocs(procstat, kp);
-    procstat_close(procstat);
+    leader = proc_table_find(&steal->procs, steal->target_stat.sid);
+    if (leader)
+        steal->emulator_pid = leader->ppid;
 
     return 0;
 }
 
 int get_terminal_state(struct steal_pty_state *steal, pid_t target) {
-    struct procstat *procstat;
-    struct kinfo_proc *kp;
-    unsigned int cnt;
-    int err = 0;
+    struct proc_entry *e, *emulator;
+    int err;
 
-    procstat = procstat_open_sysctl();
-    kp = procstat_getprocs(procstat, KERN_PROC_PID, target, &cnt);
-    if (kp == NULL || cnt < 1)
-        goto done;
+    if ((e = proc_table_find(&steal->procs, target)) == NULL)
+        return 0;
 
-    if (kp->ki_tdev == NODEV) {
+    if (e->ctty == NODEV) {
         error("Child is not connected to a pseudo-TTY. Unable to steal TTY.");
-        err = EINVAL;
-        goto done;
+        return EINVAL;
     }
+    steal->target_stat.pid = e->pid;
+    steal->target_stat.ppid = e->ppid;
+    steal->target_stat.pgid = e->pgid;
+    steal->target_stat.sid = e->sid;
+    steal->target_stat.ctty = e->ctty;
+    steal->target_stat.state = e->state;
 
     if ((err = find_terminal_emulator(steal)))
         return err;
 
-done:
-    procstat_freeprocs(procstat, kp);
-    procstat_close(procstat);
-    return err;
+    if ((emulator = proc_table_find(&steal->procs, steal->emulator_pid)))
+        steal->emulator_uid = emulator->uid;
+
+    return 0;
 }
 
+/*
+ * The master side of a pty shows up among the emulator's files as a
+ * PTS file, and procstat tells us which slave it goes with.
+ */
 int find_master_fd(struct steal_pty_state *steal) {
-    error("How do I find master in FreeBSD? FIXME.");
-    return EINVAL;
+    struct filestat *fst;
+    struct ptsstat pts;
+    char errbuf[_POSIX2_LINE_MAX];
+    int err;
+
+    if ((err = get_procfiles(steal->emulator_pid)))
+        return err;
+
+    STAILQ_FOREACH(fst, snapshot.files, next) {
+        if (fst->fs_type != PS_FST_TYPE_PTS || fst->fs_fd < 0)
+            continue;
+        if (procstat_get_pts_info(snapshot.procstat, fst, &pts, errbuf) != 0)
+            continue;
+        if (pts.dev != steal->target_stat.ctty)
+            continue;
+        debug("found an fd for the master: %d", fst->fs_fd);
+        if (fd_array_push(&steal->master_fds, fst->fs_fd) != 0) {
+            error("unable to allocate memory for fd array!");
+            err = ENOMEM;
+            break;
+        }
+    }
+    forget_proc_files();
+    if (!err && steal->master_fds.n == 0)
+        err = ESRCH;
+    return err;
+}
+
+int steal_master_fd(struct steal_pty_state *steal) {
+    return ENOSYS;
 }
 
 int get_pt() {
@@ -184,17 +355,15 @@ int get_pt() {
 }
 
 int get_process_tty_termios(pid_t pid, struct termios *tio) {
-    int err = EINVAL;
-    struct kinfo_proc *kp;
-    unsigned int cnt;
-    struct filestat_list *head;
+    int err;
     struct filestat *fst;
-    struct procstat *procstat;
     int fd = -1;
 
-    head = get_procfiles(pid, &kp, &procstat, &cnt);
+    if ((err = get_procfiles(pid)))
+        return err;
 
-    STAILQ_FOREACH(fst, head, next) {
+    err = EINVAL;
+    STAILQ_FOREACH(fst, snapshot.files, next) {
         if (fst->fs_type == PS_FST_TYPE_VNODE) {
             if (fst->fs_path) {
                 fd = open(fst->fs_path, O_RDONLY);
@@ -204,42 +373,16 @@ int get_process_tty_termios(pid_t pid, struct termios *tio) {
                     }
                     else {
                         close(fd);
-                        err = 0;
-                        goto done;
+                        return 0;
                     }
                 }
                 close(fd);
             }
         }
     }
-
-done:
-    procstat_freefiles(procstat, head);
-    procstat_freeprocs(procstat, kp);
-    procstat_close(procstat);
     return err;
 }
 
-void move_process_group(struct ptrace_child *child, pid_t from, pid_t to) {
-    struct procstat *procstat;
-    struct kinfo_proc *kp;
-    unsigned int cnt;
-    int i;
-    int err;
-
-    procstat = procstat_open_sysctl();
-    kp = procstat_getprocs(procstat, KERN_PROC_PGRP, from, &cnt);
-
-    for (i = 0; i < cnt; i++) {
-        debug("Change pgid for pid %d to %d", kp[i].ki_pid, to);
-        err = do_syscall(child, setpgid, kp[i].ki_pid, to, 0, 0, 0, 0);
-        if (err < 0)
-            error(" failed: %s", strerror(-err));
-    }
-    procstat_freeprocs(procstat, kp);
-    procstat_close(procstat);
-}
-
 void copy_user(struct ptrace_child *d, struct ptrace_child *s) {
     memcpy(&d->regs, &s->regs, sizeof(s->regs));
 }
@@ -26,6 +26,7 @@
 #ifdef __FreeBSD__
 
 #include <stdlib.h>
+#include <errno.h>
 #include <kvm.h>
 #include <sys/param.h>
 #include <sys/sysctl.h>
@@ -35,10 +36,14 @@
 #include <limits.h>
 #include <fcntl.h>
 #include <termios.h>
+#include <signal.h>
+#include <sys/socket.h>
 #include <sys/un.h>
 #include <stdio.h>
 #include <string.h>
 
+#define syscall_nr(child, name) (ptrace_syscall_numbers((child))->nr_##name)
+
 #define do_socketcall(child, scratch, name, a0, a1, a2, a3, a4)         \
     ({                                                                  \
         int __ret=-1;                                                   \
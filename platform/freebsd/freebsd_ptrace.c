@@ -34,22 +34,56 @@
 #include <assert.h>
 #include <stddef.h>
 #include <signal.h>
+#include <time.h>
 
 #include "../../ptrace.h"
 
 #include "../platform.h"
 
-#define min(x, y) ({				\
-	typeof(x) _min1 = (x);			\
-	typeof(y) _min2 = (y);			\
-	_min1 < _min2 ? _min1 : _min2; })
-
 static int __ptrace_command(struct ptrace_child *child, int req,
                             void *, int);
 
 #define ptrace_command(cld, req, ...) _ptrace_command(cld, req, ## __VA_ARGS__, 0, 0)
 #define _ptrace_command(cld, req, addr, data, ...) __ptrace_command((cld), (req), (void*)(addr), (int)(data))
 
+struct ptrace_stats ptrace_stats;
+
+static void count_request(int req) {
+    enum ptrace_stat s;
+
+    switch (req) {
+    case PT_READ_D:   s = ptrace_stat_peekdata; break;
+    case PT_WRITE_D:  s = ptrace_stat_pokedata; break;
+    case PT_GETREGS:  s = ptrace_stat_getregs; break;
+    case PT_SETREGS:  s = ptrace_stat_setregs; break;
+    case PT_TO_SCE:
+    case PT_TO_SCX:
+    case PT_SYSCALL:  s = ptrace_stat_syscall; break;
+    case PT_CONTINUE: s = ptrace_stat_cont; break;
+    case PT_ATTACH:   s = ptrace_stat_attach; break;
+    case PT_DETACH:   s = ptrace_stat_detach; break;
+    case PT_IO:       return;   /* ptrace_io counts it by direction */
+    default:          s = ptrace_stat_other; break;
+    }
+    ptrace_stats.requests[s]++;
+}
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+unsigned long long ptrace_deadline_ns;
+
+int ptrace_past_deadline(struct ptrace_child *child) {
+    if (!ptrace_deadline_ns || now_ns() < ptrace_deadline_ns)
+        return 0;
+    child->error = ETIMEDOUT;
+    return 1;
+}
+
 
 struct ptrace_personality {
     size_t syscall_rv;
@@ -60,6 +94,7 @@ struct ptrace_personality {
     size_t syscall_arg4;
     size_t syscall_arg5;
     size_t reg_ip;
+    size_t reg_sp;
 };
 
 
@@ -93,6 +128,10 @@ struct syscall_numbers *ptrace_syscall_numbers(struct ptrace_child *child) {
     return &arch_syscall_numbers[child->personality];
 }
 
+child_addr_t ptrace_stack_pointer(struct ptrace_child *child) {
+    return *(unsigned long*)((void*)&child->regs + personality(child)->reg_sp);
+}
+
 int ptrace_attach_child(struct ptrace_child *child, pid_t pid) {
     memset(child, 0, sizeof(*child));
     child->pid = pid;
@@ -125,6 +164,17 @@ detach:
     return -1;
 }
 
+int ptrace_freeze_threads(struct ptrace_child *child) {
+    /* PT_ATTACH already stops every thread in the process. */
+    return 0;
+}
+
+int ptrace_signal_stop(pid_t pid, int sig, long timeout_ms) {
+    /* Callers fall back to polling the process state. */
+    errno = ENOSYS;
+    return -1;
+}
+
 int ptrace_detach_child(struct ptrace_child *child) {
     if (ptrace_command(child, PT_DETACH, (caddr_t)1, 0) < 0)
         return -1;
@@ -134,6 +184,7 @@ int ptrace_detach_child(struct ptrace_child *child) {
 
 int ptrace_wait(struct ptrace_child *child) {
     struct ptrace_lwpinfo lwpinfo;
+    ptrace_stats.requests[ptrace_stat_wait]++;
     if (waitpid(child->pid, &child->status, 0) < 0) {
         child->error = errno;
         return -1;
@@ -160,6 +211,8 @@ int ptrace_advance_to_state(struct ptrace_child *child,
                             enum child_state desired) {
     int err;
     while (child->state != desired) {
+        if (ptrace_past_deadline(child))
+            return -1;
         switch (desired) {
         case ptrace_after_syscall:
             if (WIFSTOPPED(child->status) && WSTOPSIG(child->status) == SIGSEGV) {
@@ -215,87 +268,130 @@ int ptrace_restore_regs(struct ptrace_child *child) {
     return arch_restore_syscall(child);
 }
 
+#define reg(regs, off) (*(unsigned long*)((void*)(regs) + (off)))
+
+/*
+ * Load sysno and its arguments in one PT_GETREGS and PT_SETREGS, rather
+ * than a pair of them for every register.
+ */
+static int set_syscall_regs(struct ptrace_child *child, unsigned long sysno,
+                            const unsigned long args[6]) {
+    struct ptrace_personality *p = personality(child);
+    struct reg regs;
+
+    if (ptrace_command(child, PT_GETREGS, &regs) < 0)
+        return -1;
+    reg(&regs, p->syscall_rv) = sysno;
+    reg(&regs, p->syscall_arg0) = args[0];
+    reg(&regs, p->syscall_arg1) = args[1];
+    reg(&regs, p->syscall_arg2) = args[2];
+    reg(&regs, p->syscall_arg3) = args[3];
+    reg(&regs, p->syscall_arg4) = args[4];
+    reg(&regs, p->syscall_arg5) = args[5];
+    return ptrace_command(child, PT_SETREGS, &regs);
+}
+
+/*
+ * Fetch the result and, in the same pass, point the child back at the
+ * syscall instruction for the next one.
+ */
+static int get_syscall_result(struct ptrace_child *child, unsigned long *rv) {
+    struct ptrace_personality *p = personality(child);
+    struct reg regs;
+
+    if (ptrace_command(child, PT_GETREGS, &regs) < 0)
+        return -1;
+    *rv = reg(&regs, p->syscall_rv);
+    reg(&regs, p->reg_ip) = reg(&child->regs, p->reg_ip);
+    return ptrace_command(child, PT_SETREGS, &regs);
+}
+
+#undef reg
+
 unsigned long ptrace_remote_syscall(struct ptrace_child *child,
                                     unsigned long sysno,
                                     unsigned long p0, unsigned long p1,
                                     unsigned long p2, unsigned long p3,
                                     unsigned long p4, unsigned long p5) {
+    unsigned long long start = now_ns();
+    const unsigned long args[6] = { p0, p1, p2, p3, p4, p5 };
     unsigned long rv;
+
+    ptrace_stats.remote_syscalls++;
+    ptrace_stats.remote_batches++;
     if (ptrace_advance_to_state(child, ptrace_at_syscall) < 0)
         return -1;
-#define setreg(r, v) arch_set_register(child,personality(child)->r,v)
-
-    //if (arch_set_syscall(child, sysno) < 0)
-    //return -1;
-
-    setreg(syscall_rv, sysno);
-
-    setreg(syscall_arg0, p0);
-    setreg(syscall_arg1, p1);
-    setreg(syscall_arg2, p2);
-    setreg(syscall_arg3, p3);
-    setreg(syscall_arg4, p4);
-    setreg(syscall_arg5, p5);
-
+    if (set_syscall_regs(child, sysno, args) < 0)
+        return -1;
     if (ptrace_advance_to_state(child, ptrace_after_syscall) < 0)
         return -1;
-
-    rv = arch_get_register(child, personality(child)->syscall_rv);
-    if (child->error)
+    if (get_syscall_result(child, &rv) < 0)
         return -1;
-
-    setreg(reg_ip, *(unsigned long*)((void*)&child->regs +
-                                     personality(child)->reg_ip));
-
-#undef setreg
-
+    ptrace_stats.remote_ns += now_ns() - start;
     return rv;
 }
 
-int ptrace_memcpy_to_child(struct ptrace_child *child, child_addr_t dst, const void *src, size_t n) {
-    int scratch;
-
-    while (n >= sizeof(int)) {
-        if (ptrace_command(child, PT_WRITE_D, dst, *((int*)src)) < 0)
+int ptrace_remote_syscalls(struct ptrace_child *child,
+                           child_addr_t scratch, size_t len,
+                           struct remote_syscall *calls, int n) {
+    int i;
+
+    for (i = 0; i < n; i++)
+        calls[i].result = REMOTE_SYSCALL_PENDING;
+    for (i = 0; i < n; i++) {
+        unsigned long *a = calls[i].args;
+
+        child->error = 0;
+        calls[i].result = ptrace_remote_syscall(child, calls[i].sysno,
+                                                a[0], a[1], a[2],
+                                                a[3], a[4], a[5]);
+        if (calls[i].result == (unsigned long)-1 && child->error) {
+            calls[i].result = REMOTE_SYSCALL_PENDING;
             return -1;
-        dst += sizeof(int);
-        src += sizeof(int);
-        n -= sizeof(int);
+        }
+        if ((calls[i].flags & REMOTE_SYSCALL_ABORT_ON_ERROR)
+            && remote_syscall_failed(&calls[i]))
+            return i + 1;
     }
+    return n;
+}
 
-    if (n) {
-        scratch = ptrace_command(child, PT_READ_D, dst);
-        if (child->error)
-            return -1;
-        memcpy(&scratch, src, n);
-        if (ptrace_command(child, PT_WRITE_D, dst, scratch) < 0)
-            return -1;
+/*
+ * Move n bytes in one PT_IO. It only comes up short at the end of a
+ * mapping, and going on from there would only fail.
+ */
+static int ptrace_io(struct ptrace_child *child, int op,
+                     child_addr_t addr, void *buf, size_t n) {
+    struct ptrace_io_desc piod = {
+        .piod_op = op,
+        .piod_offs = (void*)addr,
+        .piod_addr = buf,
+        .piod_len = n,
+    };
+
+    ptrace_stats.requests[op == PIOD_READ_D ? ptrace_stat_bulk_read
+                                            : ptrace_stat_bulk_write]++;
+    if (ptrace_command(child, PT_IO, &piod) < 0)
+        return -1;
+    if (piod.piod_len != n) {
+        child->error = EFAULT;
+        return -1;
     }
-
     return 0;
 }
 
+int ptrace_memcpy_to_child(struct ptrace_child *child, child_addr_t dst, const void *src, size_t n) {
+    return ptrace_io(child, PIOD_WRITE_D, dst, (void*)src, n);
+}
+
 int ptrace_memcpy_from_child(struct ptrace_child *child, void *dst, child_addr_t src, size_t n) {
-    int scratch;
-
-    while (n) {
-        scratch = ptrace_command(child, PT_READ_D, src);
-        if (child->error) return -1;
-        memcpy(dst, &scratch, min(n, sizeof(int)));
-
-        dst += sizeof(int);
-        src += sizeof(int);
-        if (n >= sizeof(int))
-            n -= sizeof(int);
-        else
-            n = 0;
-    }
-    return 0;
+    return ptrace_io(child, PIOD_READ_D, src, dst, n);
 }
 
 static int __ptrace_command(struct ptrace_child *child, int req,
                             void *addr, int data) {
     long rv;
+    count_request(req);
     errno = 0;
     rv = ptrace(req, child->pid, addr, data);
     child->error = errno;
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef NT_ARM_SYSTEM_CALL
+#define NT_ARM_SYSTEM_CALL 0x404
+#endif
+
+static struct ptrace_personality arch_personality[1] = {
+    {
+        offsetof(struct user, regs.regs[0]),
+        offsetof(struct user, regs.regs[0]),
+        offsetof(struct user, regs.regs[1]),
+        offsetof(struct user, regs.regs[2]),
+        offsetof(struct user, regs.regs[3]),
+        offsetof(struct user, regs.regs[4]),
+        offsetof(struct user, regs.regs[5]),
+        offsetof(struct user, regs.pc),
+        offsetof(struct user, regs.sp),
+    }
+};
+
+/*
+ * At a syscall stop the kernel reports x7 as 0 or 1, for entry or
+ * exit, and puts the real value back itself when the child resumes,
+ * so whatever we save and restore there is harmless.
+ */
+static inline void arch_fixup_regs(struct ptrace_child *child) {
+    child->user.regs.pc -= 4;
+}
+
+/*
+ * Once the syscall has been entered, the kernel has already taken its
+ * number out of x8; changing it takes the NT_ARM_SYSTEM_CALL regset.
+ * We set x8 too, so the number survives the syscall being restarted.
+ */
+static inline int arch_set_syscall(struct ptrace_child *child,
+                                   unsigned long sysno) {
+    int nr = sysno;
+    struct iovec iov = { &nr, sizeof nr };
+
+    return ptrace_command(child, PTRACE_SETREGSET, NT_ARM_SYSTEM_CALL, &iov);
+}
+
+static inline int arch_stage_syscall(struct ptrace_child *child,
+                                     struct user *user,
+                                     unsigned long sysno) {
+    user->regs.regs[8] = sysno;
+    return arch_set_syscall(child, sysno);
+}
+
+static inline int arch_save_syscall(struct ptrace_child *child) {
+    child->saved_syscall = child->user.regs.regs[8];
+    return 0;
+}
+
+static inline int arch_restore_syscall(struct ptrace_child *child) {
+    return arch_set_syscall(child, child->saved_syscall);
+}
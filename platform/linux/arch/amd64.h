@@ -33,6 +33,7 @@ static struct ptrace_personality arch_personality[2] = {
         offsetof(struct user, regs.r8),
         offsetof(struct user, regs.r9),
         offsetof(struct user, regs.rip),
+        offsetof(struct user, regs.rsp),
     },
     {
         offsetof(struct user, regs.rax),
@@ -43,6 +44,7 @@ static struct ptrace_personality arch_personality[2] = {
         offsetof(struct user, regs.rdi),
         offsetof(struct user, regs.rbp),
         offsetof(struct user, regs.rip),
+        offsetof(struct user, regs.rsp),
     },
 };
 
@@ -58,31 +60,8 @@ struct x86_personality x86_personality[2] = {
 };
 
 struct syscall_numbers arch_syscall_numbers[2] = {
-#include "default-syscalls.h"
-    {
-        /*
-         * These don't seem to be available in any convenient header. We could
-         * include unistd_32.h, but those definitions would conflict with the
-         * standard ones. So, let's just hardcode the values for now. Probably
-         * we should generate this from unistd_32.h during the build process or
-         * something.
-         */
-        .nr_mmap    = 90,
-        .nr_mmap2   = 192,
-        .nr_munmap  = 91,
-        .nr_getsid  = 147,
-        .nr_setsid  = 66,
-        .nr_setpgid = 57,
-        .nr_fork    = 2,
-        .nr_wait4   = 114,
-        .nr_signal  = 48,
-        .nr_rt_sigaction = 174,
-        .nr_open    = 5,
-        .nr_close   = 6,
-        .nr_ioctl   = 54,
-        .nr_dup2    = 63,
-        .nr_socketcall = 102,
-    }
+    NATIVE_SYSCALL_NUMBERS,
+    COMPAT_SYSCALL_NUMBERS,
 };
 
 int arch_get_personality(struct ptrace_child *child) {
@@ -96,3 +75,56 @@ int arch_get_personality(struct ptrace_child *child) {
         child->personality = 1;
     return 0;
 }
+
+#define ARCH_HAVE_SYSCALL_TRAMPOLINE
+
+/*
+ * Runs the table of struct remote_syscall at %rbx, %r12 entries long,
+ * storing each return value back into the table. Stops early if an
+ * entry with REMOTE_SYSCALL_ABORT_ON_ERROR fails, and traps when done.
+ *
+ *  0: test   %r12,%r12
+ *     je     done
+ *     mov    (%rbx),%rax
+ *     mov    0x8(%rbx),%rdi
+ *     mov    0x10(%rbx),%rsi
+ *     mov    0x18(%rbx),%rdx
+ *     mov    0x20(%rbx),%r10
+ *     mov    0x28(%rbx),%r8
+ *     mov    0x30(%rbx),%r9
+ *     syscall
+ *     mov    %rax,0x38(%rbx)
+ *     add    $0x48,%rbx
+ *     dec    %r12
+ *     testb  $0x1,-0x8(%rbx)
+ *     je     0b
+ *     cmp    $-4095,%rax
+ *     jb     0b
+ * done:
+ *     int3
+ */
+static const unsigned char arch_syscall_trampoline[] = {
+    0x4d, 0x85, 0xe4, 0x74, 0x36, 0x48, 0x8b, 0x03,
+    0x48, 0x8b, 0x7b, 0x08, 0x48, 0x8b, 0x73, 0x10,
+    0x48, 0x8b, 0x53, 0x18, 0x4c, 0x8b, 0x53, 0x20,
+    0x4c, 0x8b, 0x43, 0x28, 0x4c, 0x8b, 0x4b, 0x30,
+    0x0f, 0x05, 0x48, 0x89, 0x43, 0x38, 0x48, 0x83,
+    0xc3, 0x48, 0x49, 0xff, 0xcc, 0xf6, 0x43, 0xf8,
+    0x01, 0x74, 0xcd, 0x48, 0x3d, 0x01, 0xf0, 0xff,
+    0xff, 0x72, 0xc5, 0xcc,
+};
+
+static inline int arch_trampoline_usable(struct ptrace_child *child) {
+    /* The table layout assumes 64-bit longs in the child. */
+    return child->personality == 0;
+}
+
+static inline void arch_setup_trampoline(struct user *user, child_addr_t code,
+                                         child_addr_t table, unsigned long n) {
+    user->regs.rip = code;
+    user->regs.rbx = table;
+    user->regs.r12 = n;
+    user->regs.rax = 0;
+    /* Skip the syscall we're stopped at, and don't let it restart. */
+    user->regs.orig_rax = -1;
+}
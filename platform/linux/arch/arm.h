@@ -29,6 +29,7 @@ static struct ptrace_personality arch_personality[1] = {
         offsetof(struct user, regs.uregs[4]),
         offsetof(struct user, regs.uregs[5]),
         offsetof(struct user, regs.ARM_pc),
+        offsetof(struct user, regs.ARM_sp),
     }
 };
 
@@ -41,6 +42,16 @@ static inline int arch_set_syscall(struct ptrace_child *child,
     return ptrace_command(child, PTRACE_SET_SYSCALL, 0, sysno);
 }
 
+/*
+ * The syscall number lives outside of pt_regs on ARM, so it has to be
+ * set separately from the rest of the register file.
+ */
+static inline int arch_stage_syscall(struct ptrace_child *child,
+                                     struct user *user,
+                                     unsigned long sysno) {
+    return arch_set_syscall(child, sysno);
+}
+
 static inline int arch_save_syscall(struct ptrace_child *child) {
     unsigned long swi;
     swi = ptrace_command(child, PTRACE_PEEKTEXT, child->user.regs.ARM_pc);
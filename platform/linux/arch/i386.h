@@ -31,6 +31,7 @@ static struct ptrace_personality arch_personality[1] = {
         offsetof(struct user, regs.edi),
         offsetof(struct user, regs.ebp),
         offsetof(struct user, regs.eip),
+        offsetof(struct user, regs.esp),
     }
 };
 
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef PTRACE_GET_SYSCALL_INFO
+#define PTRACE_GET_SYSCALL_INFO 0x420e
+#endif
+
+#define RISCV_SYSCALL_INFO_ENTRY 1
+
+/* The start of the kernel's struct ptrace_syscall_info. */
+struct riscv_syscall_info {
+    unsigned char op;
+    unsigned char pad[3];
+    unsigned int arch;
+    unsigned long long instruction_pointer;
+    unsigned long long stack_pointer;
+    struct {
+        unsigned long long nr;
+        unsigned long long args[6];
+    } entry;
+};
+
+static struct ptrace_personality arch_personality[1] = {
+    {
+        offsetof(struct user, regs.a0),
+        offsetof(struct user, regs.a0),
+        offsetof(struct user, regs.a1),
+        offsetof(struct user, regs.a2),
+        offsetof(struct user, regs.a3),
+        offsetof(struct user, regs.a4),
+        offsetof(struct user, regs.a5),
+        offsetof(struct user, regs.pc),
+        offsetof(struct user, regs.sp),
+    }
+};
+
+static inline void arch_fixup_regs(struct ptrace_child *child) {
+    child->user.regs.pc -= 4;
+}
+
+/*
+ * By the syscall-entry stop, the kernel has moved the first argument
+ * out of a0, which it has overwritten with -ENOSYS, into an orig_a0
+ * that isn't in the regset. Changing the syscall there is easy, since
+ * the kernel rereads a7, but changing its first argument isn't, so
+ * remote syscalls are staged from the exit stop instead, and we go
+ * to PTRACE_GET_SYSCALL_INFO for the a0 the target really had.
+ */
+#define ARCH_STAGE_AFTER_SYSCALL
+
+static inline int arch_skip_syscall(struct ptrace_child *child) {
+    struct user user;
+
+    memcpy(&user, &child->user, sizeof user);
+    user.regs.a7 = -1;
+    return ptrace_set_regs(child, &user);
+}
+
+static inline int arch_stage_syscall(struct ptrace_child *child,
+                                     struct user *user,
+                                     unsigned long sysno) {
+    user->regs.a7 = sysno;
+    return 0;
+}
+
+static inline int arch_save_syscall(struct ptrace_child *child) {
+    struct riscv_syscall_info info;
+
+    if (ptrace_command(child, PTRACE_GET_SYSCALL_INFO,
+                       sizeof info, &info) < 0)
+        return -1;
+    if (info.op != RISCV_SYSCALL_INFO_ENTRY) {
+        child->error = EINVAL;
+        return -1;
+    }
+    child->user.regs.a0 = info.entry.args[0];
+    child->saved_syscall = info.entry.nr;
+    return 0;
+}
+
+static inline int arch_restore_syscall(struct ptrace_child *child) {
+    return 0;
+}
@@ -40,11 +40,11 @@ static inline void arch_fixup_regs(struct ptrace_child *child) {
     *ptr(user, x86pers->ax) = *ptr(user, x86pers->orig_ax);
 }
 
-static inline int arch_set_syscall(struct ptrace_child *child,
-                                   unsigned long sysno) {
-    return ptrace_command(child, PTRACE_POKEUSER,
-                          x86_pers(child)->orig_ax,
-                          sysno);
+static inline int arch_stage_syscall(struct ptrace_child *child,
+                                     struct user *user,
+                                     unsigned long sysno) {
+    *ptr(user, x86_pers(child)->orig_ax) = sysno;
+    return 0;
 }
 
 static inline int arch_save_syscall(struct ptrace_child *child) {
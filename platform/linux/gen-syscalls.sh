@@ -0,0 +1,62 @@
+#!/bin/sh
+# Usage: gen-syscalls.sh PREFIX HEADER LIST
+#
+# Writes a header to stdout with PREFIX_nr_NAME for every syscall in
+# LIST, as numbered by the kernel header HEADER (run through $CC), and
+# PREFIX_SYSCALL_NUMBERS, an initializer for struct syscall_numbers.
+# Syscalls the ABI doesn't have come out as -1. The numbers are copied
+# out as constant expressions, so the result can be used without
+# including HEADER, which may well clash with the native headers.
+set -e
+
+prefix=$1
+header=$2
+list=$3
+: "${CC:=cc}"
+
+defs=$(echo "#include <$header>" | $CC -E -dM -x c -)
+
+echo "/* Generated from <$header> by gen-syscalls.sh; do not edit. */"
+echo "$defs" | awk -v prefix="$prefix" -v header="$header" -v list="$list" '
+    $1 == "#define" && $2 ~ /^__NR_/ {
+        v = $0
+        sub(/^[ \t]*#define[ \t]+[A-Za-z0-9_]+[ \t]+/, "", v)
+        nr[substr($2, 6)] = v
+    }
+    # Numbers like (__NR_SYSCALL_BASE + 5) refer to other __NR_ macros.
+    function expand(v,    rounds, name) {
+        for (rounds = 0; rounds < 8 && match(v, /__NR_[A-Za-z0-9_]+/); rounds++) {
+            name = substr(v, RSTART + 5, RLENGTH - 5)
+            if (!(name in nr))
+                return ""
+            v = substr(v, 1, RSTART - 1) "(" nr[name] ")" substr(v, RSTART + RLENGTH)
+        }
+        return v ~ /^[-+() \t0-9xXa-fA-F]+$/ ? v : ""
+    }
+    END {
+        n = 0
+        while ((getline line < list) > 0) {
+            sub(/#.*/, "", line)
+            gsub(/[ \t]/, "", line)
+            if (line == "")
+                continue
+            optional = sub(/\?$/, "", line)
+            if (!(line in nr) && !optional) {
+                printf "%s: <%s> has no __NR_%s\n", list, header, line > "/dev/stderr"
+                failed = 1
+            }
+            num = "(-1)"
+            if (line in nr && (num = expand(nr[line])) == "") {
+                printf "%s: cannot make sense of __NR_%s\n", header, line > "/dev/stderr"
+                failed = 1
+            }
+            printf "#define %s_nr_%s %s\n", prefix, line, num
+            names[n++] = line
+        }
+        if (failed)
+            exit 1
+        printf "\n#define %s_SYSCALL_NUMBERS { \\\n", toupper(prefix)
+        for (i = 0; i < n; i++)
+            printf "    .nr_%s = %s_nr_%s, \\\n", names[i], prefix, names[i]
+        printf "}\n"
+    }'
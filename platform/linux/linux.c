@@ -27,6 +27,9 @@
 #include "../../reptyr.h"
 #include "../../ptrace.h"
 #include <stdint.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
 
 int parse_proc_stat(int statfd, struct proc_stat *out) {
     char buf[1024];
@@ -67,46 +70,344 @@ int read_proc_stat(pid_t pid, struct proc_stat *out) {
     return err;
 }
 
-int read_uid(pid_t pid, uid_t *out) {
-    char stat_path[PATH_MAX];
-    char buf[1024];
-    int statfd;
-    int err = 0;
-    int n;
-    char *p = buf;
+int proc_table_refresh(struct proc_table *pt) {
+    DIR *dir;
+    struct dirent *d;
+    struct proc_stat st;
+    struct proc_entry e;
+    struct stat sb;
+    char path[64];
+    pid_t pid;
+    char *p;
+    int fd, err = 0;
 
-    snprintf(stat_path, sizeof stat_path, "/proc/%d/status", pid);
-    statfd = open(stat_path, O_RDONLY);
-    if (statfd < 0) {
-        error("Unable to open %s: %s", stat_path, strerror(errno));
-        return -statfd;
+    pt->n = 0;
+    if ((dir = opendir("/proc/")) == NULL)
+        return assert_nonzero(errno);
+
+    while ((d = readdir(dir)) != NULL) {
+        if (d->d_name[0] == '.') continue;
+        pid = strtol(d->d_name, &p, 10);
+        if (*p) continue;
+
+        snprintf(path, sizeof path, "%d/stat", (int)pid);
+        fd = openat(dirfd(dir), path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;   /* it exited while we were looking */
+        /* /proc/<pid> and everything in it belongs to the process' euid. */
+        if (parse_proc_stat(fd, &st) == 0 && fstat(fd, &sb) == 0) {
+            e = (struct proc_entry){
+                .pid = pid,
+                .ppid = st.ppid,
+                .pgid = st.pgid,
+                .sid = st.sid,
+                .uid = sb.st_uid,
+                .ctty = st.ctty,
+                .state = st.state,
+            };
+            if (proc_table_append(pt, &e) < 0) {
+                err = assert_nonzero(errno);
+                close(fd);
+                break;
+            }
+        }
+        close(fd);
+    }
+    closedir(dir);
+    proc_table_sort(pt);
+    debug("Process table snapshot: %d processes", pt->n);
+    return err;
+}
+
+/*
+ * Subscribe to the proc connector's fork/exit/setsid events. This
+ * needs CAP_NET_ADMIN; the kernel tells us whether we had it in an ack
+ * that's queued by the time send() returns.
+ */
+static int proc_events_listen(void) {
+    struct sockaddr_nl sa = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = CN_IDX_PROC,
+    };
+    struct __attribute__((aligned(NLMSG_ALIGNTO))) {
+        struct nlmsghdr nl;
+        struct __attribute__((packed)) {
+            struct cn_msg cn;
+            enum proc_cn_mcast_op op;
+        };
+    } req = {};
+    char buf[4096] __attribute__((aligned(NLMSG_ALIGNTO)));
+    struct nlmsghdr *nlh;
+    struct cn_msg *cn;
+    struct proc_event *ev;
+    ssize_t n;
+    int fd, err;
+
+    fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+    if (fd < 0)
+        return -errno;
+    if (bind(fd, (struct sockaddr *)&sa, sizeof sa) < 0)
+        goto fail;
+
+    req.nl.nlmsg_len = sizeof req;
+    req.nl.nlmsg_type = NLMSG_DONE;
+    req.nl.nlmsg_pid = getpid();
+    req.cn.id.idx = CN_IDX_PROC;
+    req.cn.id.val = CN_VAL_PROC;
+    req.cn.len = sizeof req.op;
+    req.op = PROC_CN_MCAST_LISTEN;
+    if (send(fd, &req, sizeof req, 0) < 0)
+        goto fail;
+
+    while ((n = recv(fd, buf, sizeof buf, 0)) > 0) {
+        for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, n); nlh = NLMSG_NEXT(nlh, n)) {
+            cn = NLMSG_DATA(nlh);
+            ev = (struct proc_event *)cn->data;
+            if (ev->what != PROC_EVENT_NONE)
+                continue;
+            if (ev->event_data.ack.err) {
+                errno = ev->event_data.ack.err;
+                goto fail;
+            }
+            return fd;
+        }
     }
+    return fd;
+
+fail:
+    err = errno;
+    close(fd);
+    return -err;
+}
+
+static struct proc_entry *proc_table_scan(struct proc_table *pt, pid_t pid) {
+    int i;
+    for (i = 0; i < pt->n; i++)
+        if (pt->procs[i].pid == pid)
+            return &pt->procs[i];
+    return NULL;
+}
+
+/*
+ * Drop whatever has exited (pid 0) or left the session we follow; a
+ * track_sid of 0 means we follow everyone.
+ */
+static void proc_table_prune(struct proc_table *pt) {
+    int i, out = 0;
+    for (i = 0; i < pt->n; i++)
+        if (pt->procs[i].pid > 0 &&
+            (!pt->track_sid || pt->procs[i].sid == pt->track_sid))
+            pt->procs[out++] = pt->procs[i];
+    pt->n = out;
+}
 
-    if ((n = read(statfd, buf, sizeof(buf))) < 0) {
-        err = assert_nonzero(errno);
-        goto out;
+static void proc_table_apply(struct proc_table *pt, struct proc_event *ev) {
+    struct proc_entry *e, child;
+
+    switch (ev->what) {
+    case PROC_EVENT_FORK:
+        if (ev->event_data.fork.child_pid != ev->event_data.fork.child_tgid)
+            return;     /* a new thread */
+        if (!(e = proc_table_scan(pt, ev->event_data.fork.parent_tgid)))
+            return;
+        if (proc_table_scan(pt, ev->event_data.fork.child_tgid))
+            return;     /* the snapshot already saw it */
+        child = *e;
+        child.pid = ev->event_data.fork.child_tgid;
+        child.ppid = e->pid;
+        child.state = 'R';
+        if (proc_table_append(pt, &child) < 0)
+            pt->tracking = 0;
+        break;
+    case PROC_EVENT_EXIT:
+        if (ev->event_data.exit.process_pid != ev->event_data.exit.process_tgid)
+            return;
+        if ((e = proc_table_scan(pt, ev->event_data.exit.process_tgid)))
+            e->pid = 0;
+        break;
+    case PROC_EVENT_SID:
+        if ((e = proc_table_scan(pt, ev->event_data.sid.process_tgid)))
+            e->sid = e->pgid = e->pid;
+        break;
+    default:
+        break;
     }
-    while (p < buf + n) {
-        if (strncmp(p, "Uid:\t", strlen("Uid:\t")) == 0)
-            break;
-        p = memchr(p, '\n', buf+n-p);
-        if (p == NULL)
-            break;
-        p++;
-        continue;
+}
+
+/* Follow target's session, or with a target of 0, every process. */
+static int proc_table_track(struct proc_table *pt, pid_t target) {
+    struct proc_entry *e = NULL;
+    int fd, err;
+
+    /* Listen first, so nothing can slip in between the scan and us. */
+    fd = proc_events_listen();
+    if ((err = proc_table_refresh(pt))) {
+        if (fd >= 0)
+            close(fd);
+        return err;
     }
-    if (p == NULL || p >= buf + n) {
-        debug("Unable to parse emulator uid: no Uid line found");
-        *out = -1;
-        goto out;
+    if (fd < 0) {
+        debug("Not tracking processes incrementally: %s", strerror(-fd));
+        return 0;
     }
-    if(sscanf(p, "Uid:\t%d", out) < 0) {
-        debug("Unable to parse emulator uid: unparseable Uid line");
+    if (target && (e = proc_table_find(pt, target)) == NULL) {
+        close(fd);
+        return 0;
     }
+    pt->tracking = 1;
+    pt->track_fd = fd;
+    pt->track_sid = e ? e->sid : 0;
+    proc_table_prune(pt);
+    if (pt->track_sid)
+        debug("Tracking session %d: %d processes", (int)pt->track_sid, pt->n);
+    else
+        debug("Tracking all %d processes", pt->n);
+    return 0;
+}
 
- out:
-    close(statfd);
-    return err;
+int proc_table_track_session(struct proc_table *pt, pid_t target) {
+    return proc_table_track(pt, target);
+}
+
+int proc_table_track_all(struct proc_table *pt) {
+    return proc_table_track(pt, 0);
+}
+
+/*
+ * There's no event for setpgid(), so ask. Nobody outside a session can
+ * share a group with anyone in it, so sid's members are all we need;
+ * that's cheap, where asking about everyone on a big host is not.
+ */
+static void proc_table_reread_pgids(struct proc_table *pt, pid_t sid) {
+    pid_t pg;
+    int i;
+
+    for (i = 0; i < pt->n; i++) {
+        if (pt->procs[i].pid <= 0 || pt->procs[i].sid != sid)
+            continue;
+        pg = getpgid(pt->procs[i].pid);
+        if (pg < 0)
+            pt->procs[i].pid = 0;
+        else
+            pt->procs[i].pgid = pg;
+    }
+}
+
+int proc_table_update(struct proc_table *pt) {
+    char buf[16384] __attribute__((aligned(NLMSG_ALIGNTO)));
+    struct nlmsghdr *nlh;
+    struct cn_msg *cn;
+    ssize_t n;
+    int err;
+
+    if (!pt->tracking)
+        return proc_table_refresh(pt);
+
+    while ((n = recv(pt->track_fd, buf, sizeof buf, 0)) > 0) {
+        for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, n); nlh = NLMSG_NEXT(nlh, n)) {
+            if (nlh->nlmsg_type != NLMSG_DONE)
+                continue;
+            cn = NLMSG_DATA(nlh);
+            if (cn->id.idx != CN_IDX_PROC || cn->id.val != CN_VAL_PROC)
+                continue;
+            proc_table_apply(pt, (struct proc_event *)cn->data);
+        }
+    }
+    if (n < 0 && errno != EAGAIN)
+        pt->tracking = 0;
+
+    if (!pt->tracking) {
+        /* Most likely ENOBUFS: we fell behind and lost events. */
+        debug("Lost track of processes (%s), rescanning", strerror(errno));
+        close(pt->track_fd);
+        pt->track_fd = proc_events_listen();
+        if ((err = proc_table_refresh(pt))) {
+            if (pt->track_fd >= 0)
+                close(pt->track_fd);
+            return err;
+        }
+        pt->tracking = pt->track_fd >= 0;
+        if (pt->tracking)
+            proc_table_prune(pt);
+        return 0;
+    }
+
+    if (pt->track_sid)
+        proc_table_reread_pgids(pt, pt->track_sid);
+    proc_table_prune(pt);
+    proc_table_sort(pt);
+    if (pt->track_sid)
+        debug("Session %d now has %d processes", (int)pt->track_sid, pt->n);
+    else
+        debug("Now tracking %d processes", pt->n);
+    return 0;
+}
+
+int proc_table_update_for(struct proc_table *pt, pid_t target) {
+    struct proc_entry *e;
+    int err;
+
+    if ((err = proc_table_update(pt)))
+        return err;
+    if (!pt->tracking || pt->track_sid)
+        return 0;
+    if ((e = proc_table_find(pt, target)) == NULL)
+        return 0;
+    proc_table_reread_pgids(pt, e->sid);
+    proc_table_prune(pt);
+    return 0;
+}
+
+int get_proc_info(pid_t pid, struct proc_info *out) {
+    char path[64], buf[1024], *p;
+    unsigned long long blk = 0, ign = 0, cgt = 0, tstp;
+    FILE *f;
+    int fd, n;
+
+    snprintf(path, sizeof path, "/proc/%d/stat", pid);
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return assert_nonzero(errno);
+    n = read(fd, buf, sizeof buf - 1);
+    close(fd);
+    if (n < 0)
+        return assert_nonzero(errno);
+    buf[n] = '\0';
+    /* comm can have anything in it, including a ')'. */
+    if ((p = strrchr(buf, ')')) == NULL)
+        return EINVAL;
+    if (sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u"
+               " %*u %*u %*d %*d %*d %*d %d %*d %llu",
+               &out->nthreads, &out->starttime) != 2)
+        return EINVAL;
+
+    snprintf(path, sizeof path, "/proc/%d/status", pid);
+    if ((f = fopen(path, "r")) == NULL)
+        return assert_nonzero(errno);
+    while (fgets(buf, sizeof buf, f)) {
+        sscanf(buf, "SigBlk: %llx", &blk);
+        sscanf(buf, "SigIgn: %llx", &ign);
+        sscanf(buf, "SigCgt: %llx", &cgt);
+    }
+    fclose(f);
+    tstp = 1ULL << (SIGTSTP - 1);
+    out->tstp_ignored = !!((blk | ign) & tstp);
+    out->tstp_caught = !!(cgt & tstp);
+    return 0;
+}
+
+/*
+ * Opening /proc/PID/mem takes the same permission check, Yama's
+ * included, as attaching with ptrace does.
+ */
+int check_ptrace_access(pid_t pid) {
+    char path[64];
+    int fd;
+
+    snprintf(path, sizeof path, "/proc/%d/mem", pid);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return errno == EACCES ? EPERM : assert_nonzero(errno);
+    close(fd);
+    return 0;
 }
 
 // Find the PID of the terminal emulator for `target's terminal.
@@ -119,12 +420,13 @@ int find_terminal_emulator(struct steal_pty_state *steal) {
     debug("session leader of pid %d = %d",
           (int)steal->target_stat.pid,
           (int)steal->target_stat.sid);
-    struct proc_stat leader_st;
-    int err;
-    if ((err = read_proc_stat(steal->target_stat.sid, &leader_st)))
-        return err;
-    debug("found terminal emulator process: %d", (int) leader_st.ppid);
-    steal->emulator_pid = leader_st.ppid;
+    struct proc_entry *leader = proc_table_find(&steal->procs, steal->target_stat.sid);
+    if (!leader) {
+        error("Unable to find session leader %d", (int)steal->target_stat.sid);
+        return ESRCH;
+    }
+    debug("found terminal emulator process: %d", (int) leader->ppid);
+    steal->emulator_pid = leader->ppid;
     return 0;
 }
 
@@ -147,32 +449,24 @@ void check_ptrace_scope(void) {
     fprintf(stderr, "For more information, see /etc/sysctl.d/10-ptrace.conf\n");
 }
 
-int check_pgroup(pid_t target) {
+int check_pgroup(struct proc_table *pt, pid_t target) {
+    struct proc_entry *e;
     pid_t pg;
-    DIR *dir;
-    struct dirent *d;
-    pid_t pid;
-    char *p;
-    int err = 0;
+    int i;
     struct proc_stat pid_stat;
 
     debug("Checking for problematic process group members...");
 
-    pg = getpgid(target);
-    if (pg < 0) {
+    if ((e = proc_table_find(pt, target)) == NULL) {
         error("Unable to get pgid for pid %d", (int)target);
-        return errno;
+        return ESRCH;
     }
+    pg = e->pgid;
 
-    if ((dir = opendir("/proc/")) == NULL)
-        return assert_nonzero(errno);
-
-    while ((d = readdir(dir)) != NULL) {
-        if (d->d_name[0] == '.') continue;
-        pid = strtol(d->d_name, &p, 10);
-        if (*p) continue;
-        if (pid == target) continue;
-        if (getpgid(pid) == pg) {
+    for (i = 0; i < pt->n; i++) {
+        e = &pt->procs[i];
+        if (e->pid == target) continue;
+        if (e->pgid == pg) {
             /*
              * We are actually being somewhat overly-conservative here
              * -- if pid is a child of target, and has not yet called
@@ -180,19 +474,16 @@ int check_pgroup(pid_t target) {
              * is a fairly rare case, and annoying to check for, so
              * for now let's just bail out.
              */
-            if ((err = read_proc_stat(pid, &pid_stat))) {
+            if (read_proc_stat(e->pid, &pid_stat)) {
                 memcpy(pid_stat.comm, "???", 4);
             }
             error("Process %d (%.*s) shares %d's process group. Unable to attach.\n"
                   "(This most commonly means that %d has sub-processes).",
-                  (int)pid, TASK_COMM_LENGTH, pid_stat.comm, (int)target, (int)target);
-            err = EINVAL;
-            goto out;
+                  (int)e->pid, TASK_COMM_LENGTH, pid_stat.comm, (int)target, (int)target);
+            return EINVAL;
         }
     }
-out:
-    closedir(dir);
-    return err;
+    return 0;
 }
 
 int check_proc_stopped(pid_t pid, int fd) {
@@ -207,24 +498,92 @@ int check_proc_stopped(pid_t pid, int fd) {
     return 0;
 }
 
-int *get_child_tty_fds(struct ptrace_child *child, int statfd, int *count) {
-    struct proc_stat child_status;
-    struct stat tty_st, console_st, st;
-    char buf[PATH_MAX];
-    struct fd_array fds = {};
+/*
+ * Walk a process' fd table. Everything is looked up relative to the
+ * /proc/<pid>/fd and /proc/<pid>/fdinfo directory fds, so we don't
+ * build and resolve a full path for every fd.
+ */
+struct fd_scan {
     DIR *dir;
+    int infofd;
+};
+
+static int fd_scan_open(struct fd_scan *sc, pid_t pid) {
+    char buf[64];
+
+    snprintf(buf, sizeof buf, "/proc/%d/fd/", pid);
+    if ((sc->dir = opendir(buf)) == NULL)
+        return errno;
+    snprintf(buf, sizeof buf, "/proc/%d/fdinfo/", pid);
+    sc->infofd = open(buf, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return 0;
+}
+
+/* Returns the next fd and what it refers to, or -1 at the end. */
+static int fd_scan_next(struct fd_scan *sc, struct stat *st) {
     struct dirent *d;
+    char *end;
+    long fd;
 
-    debug("Looking up fds for tty in child.");
-    if ((child->error = parse_proc_stat(statfd, &child_status)))
-        return NULL;
+    while ((d = readdir(sc->dir)) != NULL) {
+        if (d->d_name[0] == '.') continue;
+        fd = strtol(d->d_name, &end, 10);
+        if (*end) continue;
+        if (fstatat(dirfd(sc->dir), d->d_name, st, 0) < 0)
+            continue;
+        return fd;
+    }
+    return -1;
+}
+
+/*
+ * The pty number behind a ptmx fd, from the "tty-index" line that
+ * newer kernels put in its fdinfo. Returns -1 if there isn't one.
+ */
+static int fd_scan_tty_index(struct fd_scan *sc, int fd) {
+    char name[16], buf[1024];
+    char *p;
+    int f, n, index = -1;
+
+    if (sc->infofd < 0)
+        return -1;
+    snprintf(name, sizeof name, "%d", fd);
+    if ((f = openat(sc->infofd, name, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    n = read(f, buf, sizeof buf - 1);
+    close(f);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+    for (p = buf; p; p = strchr(p, '\n')) {
+        if (*p == '\n')
+            p++;
+        if (sscanf(p, "tty-index:\t%d", &index) == 1)
+            break;
+    }
+    return index;
+}
+
+static void fd_scan_close(struct fd_scan *sc) {
+    closedir(sc->dir);
+    if (sc->infofd >= 0)
+        close(sc->infofd);
+}
+
+/* The devices that count as the child's tty: its ctty, and its aliases. */
+static int child_tty_devs(int statfd, dev_t devs[3]) {
+    struct proc_stat child_status;
+    struct stat tty_st, console_st;
+    int err;
+
+    if ((err = parse_proc_stat(statfd, &child_status)))
+        return err;
 
     debug("Resolved child tty: %x", (unsigned)child_status.ctty);
 
     if (stat("/dev/tty", &tty_st) < 0) {
-        child->error = assert_nonzero(errno);
         error("Unable to stat /dev/tty");
-        return NULL;
+        return assert_nonzero(errno);
     }
 
     if (stat("/dev/console", &console_st) < 0) {
@@ -233,21 +592,33 @@ int *get_child_tty_fds(struct ptrace_child *child, int statfd, int *count) {
             .st_rdev = -1,
         };
     }
+    devs[0] = child_status.ctty;
+    devs[1] = tty_st.st_rdev;
+    devs[2] = console_st.st_rdev;
+    return 0;
+}
+
+static int is_tty_dev(const dev_t devs[3], dev_t dev) {
+    return dev == devs[0] || dev == devs[1] || dev == devs[2];
+}
+
+int *get_child_tty_fds(struct ptrace_child *child, int statfd, int *count) {
+    struct stat st;
+    struct fd_array fds = {};
+    struct fd_scan scan;
+    dev_t devs[3];
+    int fd;
 
-    snprintf(buf, sizeof buf, "/proc/%d/fd/", child->pid);
-    if ((dir = opendir(buf)) == NULL)
+    debug("Looking up fds for tty in child.");
+    if ((child->error = child_tty_devs(statfd, devs)))
         return NULL;
-    while ((d = readdir(dir)) != NULL) {
-        if (d->d_name[0] == '.') continue;
-        snprintf(buf, sizeof buf, "/proc/%d/fd/%s", child->pid, d->d_name);
-        if (stat(buf, &st) < 0)
-            continue;
 
-        if (st.st_rdev == child_status.ctty
-            || st.st_rdev == tty_st.st_rdev
-            || st.st_rdev == console_st.st_rdev) {
-            debug("Found an alias for the tty: %s", d->d_name);
-            if (fd_array_push(&fds, atoi(d->d_name)) != 0) {
+    if ((child->error = fd_scan_open(&scan, child->pid)))
+        return NULL;
+    while ((fd = fd_scan_next(&scan, &st)) >= 0) {
+        if (is_tty_dev(devs, st.st_rdev)) {
+            debug("Found an alias for the tty: %d", fd);
+            if (fd_array_push(&fds, fd) != 0) {
                 child->error = assert_nonzero(errno);
                 error("Unable to allocate memory for fd array.");
                 goto out;
@@ -256,11 +627,44 @@ int *get_child_tty_fds(struct ptrace_child *child, int statfd, int *count) {
     }
  out:
     *count = fds.n;
-    closedir(dir);
+    fd_scan_close(&scan);
     return fds.fds;
 }
 
+/*
+ * Rather than scan the whole fd table again, look at just the fds we
+ * found, and drop any the child closed or reused in the meantime. A
+ * tty fd it opened in that window is missed, just as one opened after
+ * the attach would be.
+ */
+int *recheck_child_tty_fds(struct ptrace_child *child, int statfd,
+                           int *fds, int *count) {
+    char path[64];
+    struct stat st;
+    dev_t devs[3];
+    int i, n = 0;
+
+    if ((child->error = child_tty_devs(statfd, devs))) {
+        free(fds);
+        return NULL;
+    }
+    for (i = 0; i < *count; i++) {
+        snprintf(path, sizeof path, "/proc/%d/fd/%d", child->pid, fds[i]);
+        if (stat(path, &st) == 0 && is_tty_dev(devs, st.st_rdev))
+            fds[n++] = fds[i];
+        else
+            debug("fd %d is no longer the tty", fds[i]);
+    }
+    *count = n;
+    return fds;
+}
+
+/* /proc is read an fd at a time, so there's nothing kept to forget. */
+void forget_proc_files(void) {
+}
+
 int get_terminal_state(struct steal_pty_state *steal, pid_t target) {
+    struct proc_entry *emulator;
     int err;
 
     if ((err = read_proc_stat(target, &steal->target_stat)))
@@ -274,8 +678,11 @@ int get_terminal_state(struct steal_pty_state *steal, pid_t target) {
     if ((err = find_terminal_emulator(steal)))
         return err;
 
-    if ((err = read_uid(steal->emulator_pid, &steal->emulator_uid)))
-        return err;
+    if ((emulator = proc_table_find(&steal->procs, steal->emulator_pid)) == NULL) {
+        error("Unable to find terminal emulator %d", (int)steal->emulator_pid);
+        return ESRCH;
+    }
+    steal->emulator_uid = emulator->uid;
 
     return 0;
 }
@@ -288,53 +695,55 @@ int get_terminal_state(struct steal_pty_state *steal, pid_t target) {
 
 // Find the fd(s) in the terminal emulator process that corresponds to
 // the master side of the target's pty. Store the result in
-// steal->master_fds.
+// steal->master_fds. If we aren't attached to the emulator (for
+// --plan), we can only go by what its fdinfo says.
 int find_master_fd(struct steal_pty_state *steal) {
-    DIR *dir;
-    struct dirent *d;
+    struct fd_scan scan;
     struct stat st;
+    int fd, ptn;
     int err;
-    char buf[PATH_MAX];
-
-    snprintf(buf, sizeof buf, "/proc/%d/fd/", steal->child.pid);
-    if ((dir = opendir(buf)) == NULL)
-        return errno;
-    while ((d = readdir(dir)) != NULL) {
-        if (d->d_name[0] == '.') continue;
-        snprintf(buf, sizeof buf, "/proc/%d/fd/%s", steal->child.pid, d->d_name);
-        if (stat(buf, &st) < 0)
-            continue;
 
-        debug("Checking fd: %s: st_dev=%x", d->d_name, (int)st.st_rdev);
+    if ((err = fd_scan_open(&scan, steal->child.pid)))
+        return err;
+    while ((fd = fd_scan_next(&scan, &st)) >= 0) {
+        debug("Checking fd: %d: st_dev=%x", fd, (int)st.st_rdev);
 
         if (st.st_rdev != PTMX_DEVICE)
             continue;
 
-        debug("found a ptmx fd: %s", d->d_name);
-        err = do_syscall(&steal->child, ioctl,
-                         atoi(d->d_name),
-                         TIOCGPTN,
-                         steal->child_scratch,
-                         0, 0, 0);
-        if (err < 0) {
-            debug(" error doing TIOCGPTN: %s", strerror(-err));
-            continue;
-        }
-        int ptn;
-        err = ptrace_memcpy_from_child(&steal->child, &ptn,
-                                       steal->child_scratch, sizeof(ptn));
-        if (err < 0) {
-            debug(" error getting ptn: %s", strerror(steal->child.error));
+        debug("found a ptmx fd: %d", fd);
+        ptn = fd_scan_tty_index(&scan, fd);
+        if (ptn < 0 && steal->child.state == ptrace_detached) {
+            debug(" no tty-index for fd %d", fd);
             continue;
+        } else if (ptn < 0) {
+            /* Older kernels don't say; ask the emulator instead. */
+            err = do_syscall(&steal->child, ioctl,
+                             fd,
+                             TIOCGPTN,
+                             steal->child_scratch,
+                             0, 0, 0);
+            if (err < 0) {
+                debug(" error doing TIOCGPTN: %s", strerror(-err));
+                continue;
+            }
+            err = ptrace_memcpy_from_child(&steal->child, &ptn,
+                                           steal->child_scratch, sizeof(ptn));
+            if (err < 0) {
+                debug(" error getting ptn: %s", strerror(steal->child.error));
+                continue;
+            }
         }
         if (ptn == (int)minor(steal->target_stat.ctty)) {
-            debug("found a master fd: %d", atoi(d->d_name));
-            if (fd_array_push(&steal->master_fds, atoi(d->d_name)) != 0) {
+            debug("found a master fd: %d", fd);
+            if (fd_array_push(&steal->master_fds, fd) != 0) {
                 error("unable to allocate memory for fd array!");
+                fd_scan_close(&scan);
                 return ENOMEM;
             }
         }
     }
+    fd_scan_close(&scan);
 
     if (steal->master_fds.n == 0) {
         return ESRCH;
@@ -342,6 +751,30 @@ int find_master_fd(struct steal_pty_state *steal) {
     return 0;
 }
 
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+#ifndef __NR_pidfd_getfd
+#define __NR_pidfd_getfd 438
+#endif
+
+// pidfd_getfd(2), Linux 5.6 and later. It needs the same permission
+// as ptrace, which we already have.
+int steal_master_fd(struct steal_pty_state *steal) {
+    int pidfd, fd, err;
+
+    pidfd = syscall(__NR_pidfd_open, steal->child.pid, 0);
+    if (pidfd < 0)
+        return errno;
+    fd = syscall(__NR_pidfd_getfd, pidfd, steal->master_fds.fds[0], 0);
+    err = errno;
+    close(pidfd);
+    if (fd < 0)
+        return err;
+    steal->ptyfd = fd;
+    return 0;
+}
+
 /* Homebrew posix_openpt() */
 int get_pt() {
     return open("/dev/ptmx", O_RDWR | O_NOCTTY);
@@ -377,30 +810,6 @@ retry:
     return err;
 }
 
-void move_process_group(struct ptrace_child *child, pid_t from, pid_t to) {
-    DIR *dir;
-    struct dirent *d;
-    pid_t pid;
-    char *p;
-    int err;
-
-    if ((dir = opendir("/proc/")) == NULL)
-        return;
-
-    while ((d = readdir(dir)) != NULL) {
-        if (d->d_name[0] == '.') continue;
-        pid = strtol(d->d_name, &p, 10);
-        if (*p) continue;
-        if (getpgid(pid) == from) {
-            debug("Change pgid for pid %d", pid);
-            err = do_syscall(child, setpgid, pid, to, 0, 0, 0, 0);
-            if (err < 0)
-                error(" failed: %s", strerror(-err));
-        }
-    }
-    closedir(dir);
-}
-
 void copy_user(struct ptrace_child *d, struct ptrace_child *s) {
     memcpy(&d->user, &s->user, sizeof(s->user));
 }
@@ -52,6 +52,7 @@
 #include <assert.h>
 #include <stddef.h>
 #include <termios.h>
+#include <signal.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <sys/ioctl.h>
@@ -66,16 +67,33 @@ unsigned long ptrace_socketcall(struct ptrace_child *child,
                                 unsigned long p4);
 
 
+/*
+ * Generated by the build from syscalls.list: native_nr_NAME and, on
+ * amd64, compat_nr_NAME for i386 processes. Both are constants, so
+ * there's no table to look in, and with only one personality not even
+ * a branch; a syscall that isn't in the list fails to build.
+ */
+#include "syscalls-native.h"
+#ifdef __amd64__
+#include "syscalls-compat.h"
+#define syscall_nr(child, name)                                         \
+    (__builtin_expect((child)->personality == 0, 1) ?                   \
+     native_nr_##name : compat_nr_##name)
+#else
+#define syscall_nr(child, name) native_nr_##name
+#endif
+
 #define socketcall_socket SYS_SOCKET
 #define socketcall_connect SYS_CONNECT
 #define socketcall_sendmsg SYS_SENDMSG
 
 // Define lowercased versions of the socketcall numbers, so that we
-// can assemble them with ## in the macro below
+// can assemble them with ## in the macro below. Where socketcall
+// exists we use it, since older kernels lack the separate syscalls.
 #define do_socketcall(child, scratch, name, a0, a1, a2, a3, a4)          \
     ({                                                                  \
         int __ret;                                                      \
-        if (ptrace_syscall_numbers((child))->nr_##name) {               \
+        if (syscall_nr((child), socketcall) < 0) {                      \
             __ret = do_syscall((child), name, a0, a1, a2, a3, a4, 0);   \
         } else {                                                        \
             __ret = ptrace_socketcall((child), (scratch),               \
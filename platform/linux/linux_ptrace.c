@@ -24,6 +24,12 @@
 
 #include "../../ptrace.h"
 #include "../platform.h"
+#include <sys/uio.h>
+#ifdef PTRACE_REGS_VIA_REGSET
+#include <elf.h>
+#endif
+#include <signal.h>
+#include <time.h>
 
 /*
  * RHEL 5's kernel supports these flags, but their libc doesn't ship a ptrace.h
@@ -42,6 +48,26 @@
 #define PTRACE_EVENT_FORK 1
 #endif
 
+#ifndef PTRACE_SEIZE
+#define PTRACE_SEIZE 0x4206
+#endif
+
+#ifndef PTRACE_INTERRUPT
+#define PTRACE_INTERRUPT 0x4207
+#endif
+
+#ifndef PTRACE_EVENT_STOP
+#define PTRACE_EVENT_STOP 128
+#endif
+
+#ifndef PTRACE_GETREGSET
+#define PTRACE_GETREGSET 0x4204
+#endif
+
+#ifndef PTRACE_SETREGSET
+#define PTRACE_SETREGSET 0x4205
+#endif
+
 #define min(x, y) ({				\
 	typeof(x) _min1 = (x);			\
 	typeof(y) _min2 = (y);			\
@@ -58,6 +84,59 @@ static long __ptrace_command(struct ptrace_child *child, enum __ptrace_request r
 #define ptrace_command(cld, req, ...) _ptrace_command(cld, req, ## __VA_ARGS__, NULL, NULL)
 #define _ptrace_command(cld, req, addr, data, ...) __ptrace_command((cld), (req), (void*)(addr), (void*)(data))
 
+struct ptrace_stats ptrace_stats;
+
+static void count_request(long req) {
+    enum ptrace_stat s;
+
+    switch (req) {
+    case PTRACE_PEEKDATA: s = ptrace_stat_peekdata; break;
+    case PTRACE_POKEDATA: s = ptrace_stat_pokedata; break;
+    case PTRACE_PEEKUSER: s = ptrace_stat_peekuser; break;
+    case PTRACE_POKEUSER: s = ptrace_stat_pokeuser; break;
+#ifdef PTRACE_REGS_VIA_REGSET
+    case PTRACE_GETREGSET: s = ptrace_stat_getregs; break;
+    case PTRACE_SETREGSET: s = ptrace_stat_setregs; break;
+#else
+    case PTRACE_GETREGS:  s = ptrace_stat_getregs; break;
+    case PTRACE_SETREGS:  s = ptrace_stat_setregs; break;
+#endif
+    case PTRACE_SYSCALL:  s = ptrace_stat_syscall; break;
+    case PTRACE_CONT:     s = ptrace_stat_cont; break;
+    case PTRACE_ATTACH:
+    case PTRACE_SEIZE:
+    case PTRACE_INTERRUPT: s = ptrace_stat_attach; break;
+    case PTRACE_DETACH:   s = ptrace_stat_detach; break;
+    default:              s = ptrace_stat_other; break;
+    }
+    ptrace_stats.requests[s]++;
+}
+
+/* For the places that ptrace a pid we have no ptrace_child for. */
+#define ptrace_pid(req, pid, addr, data) \
+    (count_request(req), ptrace((req), (pid), (addr), (data)))
+
+static pid_t count_waitpid(pid_t pid, int *status, int options) {
+    ptrace_stats.requests[ptrace_stat_wait]++;
+    return waitpid(pid, status, options);
+}
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+unsigned long long ptrace_deadline_ns;
+
+int ptrace_past_deadline(struct ptrace_child *child) {
+    if (!ptrace_deadline_ns || now_ns() < ptrace_deadline_ns)
+        return 0;
+    child->error = ETIMEDOUT;
+    return 1;
+}
+
 
 struct ptrace_personality {
     size_t syscall_rv;
@@ -68,16 +147,55 @@ struct ptrace_personality {
     size_t syscall_arg4;
     size_t syscall_arg5;
     size_t reg_ip;
+    size_t reg_sp;
 };
 
 static struct ptrace_personality *personality(struct ptrace_child *child);
 
+/* Move the child's whole register file in or out in a single request. */
+#ifdef PTRACE_REGS_VIA_REGSET
+static int ptrace_get_regs(struct ptrace_child *child, struct user *user) {
+    struct iovec iov = { &user->regs, sizeof user->regs };
+    return ptrace_command(child, PTRACE_GETREGSET, NT_PRSTATUS, &iov);
+}
+
+static int ptrace_set_regs(struct ptrace_child *child, struct user *user) {
+    struct iovec iov = { &user->regs, sizeof user->regs };
+    return ptrace_command(child, PTRACE_SETREGSET, NT_PRSTATUS, &iov);
+}
+
+/* There's no PTRACE_PEEKUSER here, so fetch the lot. */
+static unsigned long ptrace_get_reg(struct ptrace_child *child, size_t off) {
+    struct user user;
+
+    if (ptrace_get_regs(child, &user) < 0)
+        return -1;
+    return *(unsigned long*)((void*)&user + off);
+}
+#else
+static int ptrace_get_regs(struct ptrace_child *child, struct user *user) {
+    return ptrace_command(child, PTRACE_GETREGS, 0, user);
+}
+
+static int ptrace_set_regs(struct ptrace_child *child, struct user *user) {
+    return ptrace_command(child, PTRACE_SETREGS, 0, user);
+}
+
+static unsigned long ptrace_get_reg(struct ptrace_child *child, size_t off) {
+    return ptrace_command(child, PTRACE_PEEKUSER, off);
+}
+#endif
+
 #if defined(__amd64__)
 #include "arch/amd64.h"
 #elif defined(__i386__)
 #include "arch/i386.h"
 #elif defined(__arm__)
 #include "arch/arm.h"
+#elif defined(__aarch64__)
+#include "arch/aarch64.h"
+#elif defined(__riscv) && __riscv_xlen == 64
+#include "arch/riscv64.h"
 #else
 #error Unsupported architecture.
 #endif
@@ -88,7 +206,7 @@ int arch_get_personality(struct ptrace_child *child) {
 }
 
 struct syscall_numbers arch_syscall_numbers[] = {
-#include "arch/default-syscalls.h"
+    NATIVE_SYSCALL_NUMBERS,
 };
 #endif
 
@@ -100,18 +218,160 @@ struct syscall_numbers *ptrace_syscall_numbers(struct ptrace_child *child) {
     return &arch_syscall_numbers[child->personality];
 }
 
+child_addr_t ptrace_stack_pointer(struct ptrace_child *child) {
+    return *(unsigned long*)((void*)&child->user + personality(child)->reg_sp);
+}
+
+/*
+ * Wait for the PTRACE_EVENT_STOP that PTRACE_INTERRUPT asked `tid` for.
+ * It may hit a signal-delivery-stop first, in which case we hand the
+ * signal back and keep waiting; the interrupt stays pending across
+ * that. Returns 1 once it's stopped, 0 if it exited, and -1 on error.
+ */
+static int wait_interrupt_stop(pid_t tid, int *status) {
+    while (1) {
+        if (count_waitpid(tid, status, __WALL) < 0)
+            return -1;
+        if (!WIFSTOPPED(*status))
+            return 0;
+        if ((*status >> 16) == PTRACE_EVENT_STOP)
+            return 1;
+        if (ptrace_pid(PTRACE_CONT, tid, 0, WSTOPSIG(*status)) < 0)
+            return -1;
+    }
+}
+
+/*
+ * Finish a PTRACE_SEIZE attach. Unlike PTRACE_ATTACH, SEIZE doesn't
+ * send the target a SIGSTOP, so there's nothing to SIGCONT away or
+ * suppress later: we just interrupt it. If it's sitting in the
+ * group-stop our stop_child() left it in, it reports that stop
+ * straight away and we resume it out of it with our first
+ * PTRACE_SYSCALL.
+ */
+static int ptrace_finish_seize(struct ptrace_child *child) {
+    int rv;
+
+    if (ptrace_command(child, PTRACE_INTERRUPT) < 0)
+        goto detach;
+    rv = wait_interrupt_stop(child->pid, &child->status);
+    if (rv <= 0) {
+        child->error = rv < 0 ? errno : ESRCH;
+        goto detach;
+    }
+    child->state = ptrace_stopped;
+
+    if (arch_get_personality(child))
+        goto detach;
+
+    return 0;
+
+detach:
+    /* Don't clobber child->error */
+    ptrace_pid(PTRACE_DETACH, child->pid, 0, 0);
+    return -1;
+}
+
 int ptrace_attach_child(struct ptrace_child *child, pid_t pid) {
     memset(child, 0, sizeof * child);
     child->pid = pid;
+    child->mem_fd = -1;
+    if (ptrace_command(child, PTRACE_SEIZE, 0,
+                       PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEFORK) == 0)
+        return ptrace_finish_seize(child);
+    /* Kernels older than 3.4 don't know PTRACE_SEIZE. */
+    if (child->error != EIO)
+        return -1;
     if (ptrace_command(child, PTRACE_ATTACH) < 0)
         return -1;
 
     return ptrace_finish_attach(child, pid);
 }
 
+static int ptrace_seize_thread(struct ptrace_child *child, pid_t tid) {
+    pid_t *threads;
+    int status, rv;
+
+    if (ptrace_pid(PTRACE_SEIZE, tid, 0, 0) < 0)
+        /* It exited since we listed it. */
+        return errno == ESRCH ? 0 : -1;
+    if (ptrace_pid(PTRACE_INTERRUPT, tid, 0, 0) < 0)
+        goto detach;
+    rv = wait_interrupt_stop(tid, &status);
+    if (rv <= 0)
+        return rv;
+
+    threads = realloc(child->threads, (child->nthreads + 1) * sizeof * threads);
+    if (!threads) {
+        errno = ENOMEM;
+        goto detach;
+    }
+    child->threads = threads;
+    child->threads[child->nthreads++] = tid;
+    return 0;
+
+detach:
+    rv = errno;
+    ptrace_pid(PTRACE_DETACH, tid, 0, 0);
+    errno = rv;
+    return -1;
+}
+
+static int ptrace_has_thread(struct ptrace_child *child, pid_t tid) {
+    int i;
+
+    if (tid == child->pid)
+        return 1;
+    for (i = 0; i < child->nthreads; i++)
+        if (child->threads[i] == tid)
+            return 1;
+    return 0;
+}
+
+/*
+ * Seize and interrupt every other thread of an attached child, so that
+ * nothing races the fd juggling we do through the main one. Threads
+ * already parked in a group-stop report it as soon as they're
+ * interrupted, so this is cheap for a target stop_child() has stopped.
+ * A running thread may spawn another one before we get to it, so we
+ * rescan /proc/<pid>/task until a pass turns up nobody new. Everything
+ * is released again by ptrace_detach_child.
+ */
+int ptrace_freeze_threads(struct ptrace_child *child) {
+    char path[64];
+    struct dirent *d;
+    DIR *dir;
+    pid_t tid;
+    int found;
+
+    snprintf(path, sizeof path, "/proc/%d/task", child->pid);
+    do {
+        if ((dir = opendir(path)) == NULL) {
+            child->error = errno;
+            return -1;
+        }
+        found = 0;
+        while ((d = readdir(dir)) != NULL) {
+            tid = atoi(d->d_name);
+            if (tid <= 0 || ptrace_has_thread(child, tid))
+                continue;
+            if (ptrace_seize_thread(child, tid) < 0) {
+                child->error = errno;
+                closedir(dir);
+                return -1;
+            }
+            found = 1;
+        }
+        closedir(dir);
+    } while (found);
+
+    return 0;
+}
+
 int ptrace_finish_attach(struct ptrace_child *child, pid_t pid) {
     memset(child, 0, sizeof * child);
     child->pid = pid;
+    child->mem_fd = -1;
 
     kill(pid, SIGCONT);
     if (ptrace_wait(child) < 0)
@@ -128,11 +388,127 @@ int ptrace_finish_attach(struct ptrace_child *child, pid_t pid) {
 
 detach:
     /* Don't clobber child->error */
-    ptrace(PTRACE_DETACH, child->pid, 0, 0);
+    ptrace_pid(PTRACE_DETACH, child->pid, 0, 0);
     return -1;
 }
 
+/*
+ * Wait for the next ptrace stop of pid until `deadline`. SIGCHLD must be
+ * blocked. We don't rely on SIGCHLD alone, since it isn't delivered at
+ * all if our parent left it ignored, so we recheck every few ms anyway.
+ */
+static int wait_stop_until(pid_t pid, int *status, struct timespec *deadline) {
+    sigset_t chld;
+    struct timespec now, left;
+    pid_t rv;
+
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    while (1) {
+        rv = count_waitpid(pid, status, __WALL | WNOHANG);
+        if (rv != 0)
+            return rv;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        left.tv_sec = deadline->tv_sec - now.tv_sec;
+        left.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+        if (left.tv_nsec < 0) {
+            left.tv_sec--;
+            left.tv_nsec += 1000000000;
+        }
+        if (left.tv_sec < 0)
+            return 0;
+        if (left.tv_sec > 0 || left.tv_nsec > 10000000) {
+            left.tv_sec = 0;
+            left.tv_nsec = 10000000;
+        }
+        sigtimedwait(&chld, NULL, &left);
+    }
+}
+
+/*
+ * Send `sig` to pid and wait for it to enter a job-control stop,
+ * without making the caller poll /proc. We PTRACE_SEIZE the target
+ * (which neither stops it nor sends it anything), pass the signal
+ * through when it's delivered, and wait for the resulting group-stop
+ * event. The kernel still notifies the real parent about the stop,
+ * and on detach the target stays stopped.
+ *
+ * Returns 1 if it stopped, 0 if it timed out or exited, and -1 (with
+ * errno set) if the target couldn't be seized. In that case no signal
+ * was sent.
+ */
+int ptrace_signal_stop(pid_t pid, int sig, long timeout_ms) {
+    struct timespec deadline;
+    sigset_t chld, old;
+    int status, stopped = 0, err;
+    pid_t rv;
+
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &old);
+
+    if (ptrace_pid(PTRACE_SEIZE, pid, 0, 0) < 0) {
+        err = errno;
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        errno = err;
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    kill(pid, sig);
+    while (1) {
+        rv = wait_stop_until(pid, &status, &deadline);
+        if (rv < 0 || (rv > 0 && !WIFSTOPPED(status)))
+            goto out;
+        if (rv == 0)
+            break;
+        if ((status >> 16) == PTRACE_EVENT_STOP) {
+            stopped = 1;
+            break;
+        }
+        /* A signal-delivery-stop; let it through. */
+        ptrace_pid(PTRACE_CONT, pid, 0, WSTOPSIG(status));
+    }
+
+    if (!stopped) {
+        /*
+         * It's still running, and we can only detach from a stopped
+         * tracee. This doesn't count against the deadline.
+         */
+        ptrace_pid(PTRACE_INTERRUPT, pid, 0, 0);
+        while ((rv = count_waitpid(pid, &status, __WALL)) == pid
+               && WIFSTOPPED(status) && (status >> 16) != PTRACE_EVENT_STOP)
+            ptrace_pid(PTRACE_CONT, pid, 0, WSTOPSIG(status));
+        if (rv != pid || !WIFSTOPPED(status))
+            goto out;
+    }
+    ptrace_pid(PTRACE_DETACH, pid, 0, 0);
+
+out:
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return stopped;
+}
+
 int ptrace_detach_child(struct ptrace_child *child) {
+    int i;
+
+    if (child->mem_fd >= 0) {
+        close(child->mem_fd);
+        child->mem_fd = -1;
+    }
+    for (i = 0; i < child->nthreads; i++)
+        ptrace_pid(PTRACE_DETACH, child->threads[i], 0, 0);
+    free(child->threads);
+    child->threads = NULL;
+    child->nthreads = 0;
     if (ptrace_command(child, PTRACE_DETACH, 0, 0) < 0)
         return -1;
     child->state = ptrace_detached;
@@ -140,7 +516,7 @@ int ptrace_detach_child(struct ptrace_child *child) {
 }
 
 int ptrace_wait(struct ptrace_child *child) {
-    if (waitpid(child->pid, &child->status, 0) < 0) {
+    if (count_waitpid(child->pid, &child->status, 0) < 0) {
         child->error = errno;
         return -1;
     }
@@ -152,7 +528,7 @@ int ptrace_wait(struct ptrace_child *child) {
             child->state = (child->state == ptrace_at_syscall) ?
                            ptrace_after_syscall : ptrace_at_syscall;
         } else {
-            if (sig == SIGTRAP && (((child->status >> 8) & PTRACE_EVENT_FORK) == PTRACE_EVENT_FORK))
+            if (sig == SIGTRAP && (child->status >> 16) == PTRACE_EVENT_FORK)
                 ptrace_command(child, PTRACE_GETEVENTMSG, 0, &child->forked_pid);
             if (child->state != ptrace_at_syscall)
                 child->state = ptrace_stopped;
@@ -168,6 +544,8 @@ int ptrace_advance_to_state(struct ptrace_child *child,
                             enum child_state desired) {
     int err;
     while (child->state != desired) {
+        if (ptrace_past_deadline(child))
+            return -1;
         switch (desired) {
         case ptrace_after_syscall:
         case ptrace_at_syscall:
@@ -200,7 +578,7 @@ int ptrace_advance_to_state(struct ptrace_child *child,
 int ptrace_save_regs(struct ptrace_child *child) {
     if (ptrace_advance_to_state(child, ptrace_at_syscall) < 0)
         return -1;
-    if (ptrace_command(child, PTRACE_GETREGS, 0, &child->user) < 0)
+    if (ptrace_get_regs(child, &child->user) < 0)
         return -1;
     arch_fixup_regs(child);
     if (arch_save_syscall(child) < 0)
@@ -210,56 +588,350 @@ int ptrace_save_regs(struct ptrace_child *child) {
 
 int ptrace_restore_regs(struct ptrace_child *child) {
     int err;
-    err = ptrace_command(child, PTRACE_SETREGS, 0, &child->user);
+    err = ptrace_set_regs(child, &child->user);
     if (err < 0)
         return err;
     return arch_restore_syscall(child);
 }
 
+static inline void stage_reg(struct user *user, size_t off, unsigned long v) {
+    *(unsigned long*)((void*)user + off) = v;
+}
+
+/*
+ * Rather than poking the syscall number and each argument into the
+ * child individually, we build the whole register file here, starting
+ * from the registers we saved on attach, and commit it with a single
+ * PTRACE_SETREGS (or PTRACE_SETREGSET). Since that also puts the
+ * instruction pointer back at the saved syscall instruction, there's
+ * nothing to fix up once the syscall returns.
+ *
+ * Some architectures read the first argument from a register we can't
+ * reach once the syscall has been entered. Those define
+ * ARCH_STAGE_AFTER_SYSCALL, and we commit the registers at the
+ * syscall-exit stop instead, and let the child run the syscall
+ * instruction from the top.
+ */
 unsigned long ptrace_remote_syscall(struct ptrace_child *child,
                                     unsigned long sysno,
                                     unsigned long p0, unsigned long p1,
                                     unsigned long p2, unsigned long p3,
                                     unsigned long p4, unsigned long p5) {
+    struct ptrace_personality *pers = personality(child);
+    unsigned long long start = now_ns();
+    struct user user;
     unsigned long rv;
+
+    ptrace_stats.remote_syscalls++;
+    ptrace_stats.remote_batches++;
+#ifdef ARCH_STAGE_AFTER_SYSCALL
+    if (child->state == ptrace_at_syscall && arch_skip_syscall(child) < 0)
+        return -1;
+    if (ptrace_advance_to_state(child, ptrace_after_syscall) < 0)
+        return -1;
+#else
     if (ptrace_advance_to_state(child, ptrace_at_syscall) < 0)
         return -1;
+#endif
 
-#define setreg(r, v) do {                                               \
-        if (ptrace_command(child, PTRACE_POKEUSER,                      \
-                           personality(child)->r,                       \
-                           (v)) < 0)                                    \
-            return -1;                                                  \
-    } while (0)
-
-    if (arch_set_syscall(child, sysno) < 0)
+    memcpy(&user, &child->user, sizeof user);
+    if (arch_stage_syscall(child, &user, sysno) < 0)
+        return -1;
+    stage_reg(&user, pers->syscall_arg0, p0);
+    stage_reg(&user, pers->syscall_arg1, p1);
+    stage_reg(&user, pers->syscall_arg2, p2);
+    stage_reg(&user, pers->syscall_arg3, p3);
+    stage_reg(&user, pers->syscall_arg4, p4);
+    stage_reg(&user, pers->syscall_arg5, p5);
+
+    if (ptrace_set_regs(child, &user) < 0)
         return -1;
-    setreg(syscall_arg0, p0);
-    setreg(syscall_arg1, p1);
-    setreg(syscall_arg2, p2);
-    setreg(syscall_arg3, p3);
-    setreg(syscall_arg4, p4);
-    setreg(syscall_arg5, p5);
 
+#ifdef ARCH_STAGE_AFTER_SYSCALL
+    if (ptrace_advance_to_state(child, ptrace_at_syscall) < 0)
+        return -1;
+#endif
     if (ptrace_advance_to_state(child, ptrace_after_syscall) < 0)
         return -1;
 
-    rv = ptrace_command(child, PTRACE_PEEKUSER,
-                        personality(child)->syscall_rv);
+    rv = ptrace_get_reg(child, pers->syscall_rv);
+    ptrace_stats.remote_ns += now_ns() - start;
     if (child->error)
         return -1;
 
-    setreg(reg_ip, *(unsigned long*)((void*)&child->user +
-                                     personality(child)->reg_ip));
+    return rv;
+}
 
-#undef setreg
+static int remote_syscalls_sequential(struct ptrace_child *child,
+                                      struct remote_syscall *calls, int n) {
+    int i, j;
 
-    return rv;
+    for (i = 0; i < n; i++) {
+        unsigned long *a = calls[i].args;
+
+        child->error = 0;
+        calls[i].result = ptrace_remote_syscall(child, calls[i].sysno,
+                                                a[0], a[1], a[2],
+                                                a[3], a[4], a[5]);
+        if (calls[i].result == (unsigned long)-1 && child->error) {
+            for (j = i; j < n; j++)
+                calls[j].result = REMOTE_SYSCALL_PENDING;
+            return -1;
+        }
+        if ((calls[i].flags & REMOTE_SYSCALL_ABORT_ON_ERROR)
+            && remote_syscall_failed(&calls[i]))
+            return i + 1;
+    }
+    return n;
+}
+
+#ifdef ARCH_HAVE_SYSCALL_TRAMPOLINE
+/*
+ * Copy the trampoline and the syscall table into the child in one go,
+ * point the child at it, and let it run until it traps. The table comes
+ * back with every result filled in, so a whole batch costs a couple of
+ * stops instead of two per syscall.
+ *
+ * Returns the number of calls that ran. If the trampoline faults (most
+ * likely because the scratch memory isn't executable), we put the child
+ * back where it was and report however many calls had completed.
+ */
+#define TRAMPOLINE_TABLE_OFFSET \
+    ((sizeof(arch_syscall_trampoline) + 15) & ~15)
+#define TRAMPOLINE_MAX_CALLS 32
+
+static int remote_syscalls_trampoline(struct ptrace_child *child,
+                                      child_addr_t scratch,
+                                      struct remote_syscall *calls, int n) {
+    unsigned char buf[TRAMPOLINE_TABLE_OFFSET +
+                      TRAMPOLINE_MAX_CALLS * sizeof(struct remote_syscall)];
+    child_addr_t table = scratch + TRAMPOLINE_TABLE_OFFSET;
+    unsigned long long start = now_ns();
+    size_t table_len;
+    struct user user;
+    int i, sig, faulted = 0;
+
+    if (n > TRAMPOLINE_MAX_CALLS)
+        n = TRAMPOLINE_MAX_CALLS;
+    table_len = n * sizeof(*calls);
+
+    for (i = 0; i < n; i++)
+        calls[i].result = REMOTE_SYSCALL_PENDING;
+    memset(buf, 0, TRAMPOLINE_TABLE_OFFSET);
+    memcpy(buf, arch_syscall_trampoline, sizeof(arch_syscall_trampoline));
+    memcpy(buf + TRAMPOLINE_TABLE_OFFSET, calls, table_len);
+    if (ptrace_memcpy_to_child(child, scratch, buf,
+                               TRAMPOLINE_TABLE_OFFSET + table_len) < 0)
+        return -1;
+
+    memcpy(&user, &child->user, sizeof user);
+    arch_setup_trampoline(&user, scratch, table, n);
+    if (ptrace_set_regs(child, &user) < 0)
+        return -1;
+
+    child->state = ptrace_running;
+    if (ptrace_command(child, PTRACE_CONT, 0, 0) < 0)
+        return -1;
+    while (1) {
+        if (ptrace_wait(child) < 0)
+            return -1;
+        if (child->state == ptrace_exited) {
+            child->error = ESRCH;
+            return -1;
+        }
+        sig = WSTOPSIG(child->status);
+        if (sig == SIGTRAP)
+            break;
+        if (sig == SIGSEGV || sig == SIGBUS || sig == SIGILL) {
+            faulted = 1;
+            break;
+        }
+        /* Swallow anything else, as ptrace_advance_to_state does. */
+        if (ptrace_command(child, PTRACE_CONT, 0, 0) < 0)
+            return -1;
+    }
+
+    if (ptrace_memcpy_from_child(child, calls, table, table_len) < 0)
+        return -1;
+
+    /*
+     * Leave the child at its original syscall instruction; the next
+     * ptrace_remote_syscall or ptrace_restore_regs picks up from there.
+     */
+    if (ptrace_set_regs(child, &child->user) < 0)
+        return -1;
+
+    if (faulted) {
+        child->no_trampoline = 1;
+        /* The fault was ours, not the child's. */
+        child->status = W_STOPCODE(SIGTRAP);
+    }
+
+    for (i = 0; i < n && calls[i].result != REMOTE_SYSCALL_PENDING; i++)
+        ;
+    ptrace_stats.remote_syscalls += i;
+    ptrace_stats.remote_batches++;
+    ptrace_stats.remote_ns += now_ns() - start;
+    return i;
+}
+#endif
+
+int ptrace_remote_syscalls(struct ptrace_child *child,
+                           child_addr_t scratch, size_t len,
+                           struct remote_syscall *calls, int n) {
+    int done = 0, rv, i;
+
+    for (i = 0; i < n; i++)
+        calls[i].result = REMOTE_SYSCALL_PENDING;
+    while (done < n) {
+#ifdef ARCH_HAVE_SYSCALL_TRAMPOLINE
+        if (!child->no_trampoline && arch_trampoline_usable(child)
+            && len >= TRAMPOLINE_TABLE_OFFSET + sizeof(*calls)) {
+            int cap = (len - TRAMPOLINE_TABLE_OFFSET) / sizeof(*calls);
+            /*
+             * Any syscall or signal stop will do; there's no need to
+             * burn a round-trip getting to a syscall entry first.
+             */
+            if (child->state != ptrace_at_syscall
+                && child->state != ptrace_after_syscall
+                && child->state != ptrace_stopped
+                && ptrace_advance_to_state(child, ptrace_at_syscall) < 0)
+                return -1;
+            rv = remote_syscalls_trampoline(child, scratch, calls + done,
+                                            min(n - done, cap));
+        } else
+#endif
+            rv = remote_syscalls_sequential(child, calls + done, n - done);
+        if (rv < 0)
+            return -1;
+        done += rv;
+        if (rv > 0 && (calls[done - 1].flags & REMOTE_SYSCALL_ABORT_ON_ERROR)
+            && remote_syscall_failed(&calls[done - 1]))
+            break;
+    }
+    return done;
+}
+
+/*
+ * PTRACE_{PEEK,POKE}DATA move a single word per syscall, which adds
+ * up quickly for sockaddrs and msghdrs. Prefer process_vm_{read,write}v,
+ * then /proc/PID/mem, and only fall back to word-at-a-time copies if
+ * neither works. The probe result is cached in child->mem_method, so a
+ * kernel without the bulk interfaces costs us one failed attempt per
+ * attach rather than one per copy.
+ */
+enum {
+    mem_method_unknown = 0,
+    mem_method_vm,
+    mem_method_proc,
+    mem_method_ptrace,
+};
+
+static int memcpy_vm(struct ptrace_child *child, child_addr_t addr,
+                     void *buf, size_t n, int write) {
+#ifdef __NR_process_vm_readv
+    struct iovec local, remote;
+    long rv;
+
+    while (n) {
+        local.iov_base = buf;
+        local.iov_len = n;
+        remote.iov_base = (void*)addr;
+        remote.iov_len = n;
+        ptrace_stats.requests[write ? ptrace_stat_bulk_write
+                              : ptrace_stat_bulk_read]++;
+        rv = syscall(write ? __NR_process_vm_writev : __NR_process_vm_readv,
+                     child->pid, &local, 1, &remote, 1, 0);
+        if (rv < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (rv == 0) {
+            errno = EFAULT;
+            return -1;
+        }
+        buf += rv;
+        addr += rv;
+        n -= rv;
+    }
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int memcpy_proc(struct ptrace_child *child, child_addr_t addr,
+                       void *buf, size_t n, int write) {
+    char path[PATH_MAX];
+    ssize_t rv;
+
+    if (child->mem_fd < 0) {
+        snprintf(path, sizeof path, "/proc/%d/mem", child->pid);
+        child->mem_fd = open(path, O_RDWR | O_CLOEXEC);
+        if (child->mem_fd < 0) {
+            child->mem_method = mem_method_ptrace;
+            return -1;
+        }
+    }
+
+    while (n) {
+        ptrace_stats.requests[write ? ptrace_stat_bulk_write
+                              : ptrace_stat_bulk_read]++;
+        if (write)
+            rv = pwrite64(child->mem_fd, buf, n, (off64_t)addr);
+        else
+            rv = pread64(child->mem_fd, buf, n, (off64_t)addr);
+        if (rv < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (rv == 0)
+            return -1;
+        buf += rv;
+        addr += rv;
+        n -= rv;
+    }
+    return 0;
+}
+
+/*
+ * Returns 0 if the whole buffer was transferred, or -1 if the caller
+ * should fall back to PTRACE_{PEEK,POKE}DATA.
+ */
+static int ptrace_memcpy_bulk(struct ptrace_child *child, child_addr_t addr,
+                              void *buf, size_t n, int write) {
+    switch (child->mem_method) {
+    case mem_method_unknown:
+    case mem_method_vm:
+        if (memcpy_vm(child, addr, buf, n, write) == 0) {
+            child->mem_method = mem_method_vm;
+            return 0;
+        }
+        /*
+         * EFAULT just means this particular range isn't accessible
+         * (e.g. it's read-only, which the ptrace path can override),
+         * so only give up on the syscall if it's missing or denied.
+         */
+        if (errno != ENOSYS && errno != EPERM)
+            return -1;
+        child->mem_method = mem_method_proc;
+        /* fallthrough */
+    case mem_method_proc:
+        return memcpy_proc(child, addr, buf, n, write);
+    default:
+        return -1;
+    }
 }
 
 int ptrace_memcpy_to_child(struct ptrace_child *child, child_addr_t dst, const void *src, size_t n) {
     unsigned long scratch;
 
+    if (ptrace_memcpy_bulk(child, dst, (void*)src, n, 1) == 0)
+        return 0;
+
     while (n >= sizeof(unsigned long)) {
         if (ptrace_command(child, PTRACE_POKEDATA, dst, *((unsigned long*)src)) < 0)
             return -1;
@@ -283,6 +955,9 @@ int ptrace_memcpy_to_child(struct ptrace_child *child, child_addr_t dst, const v
 int ptrace_memcpy_from_child(struct ptrace_child *child, void *dst, child_addr_t src, size_t n) {
     unsigned long scratch;
 
+    if (ptrace_memcpy_bulk(child, src, dst, n, 0) == 0)
+        return 0;
+
     while (n) {
         scratch = ptrace_command(child, PTRACE_PEEKDATA, src);
         if (child->error) return -1;
@@ -306,6 +981,7 @@ static long __ptrace_command(struct ptrace_child *child, enum __ptrace_request r
                              void *addr, void *data) {
 #endif
     long rv;
+    count_request(req);
     errno = 0;
     rv = ptrace(req, child->pid, addr, data);
     child->error = errno;
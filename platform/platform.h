@@ -38,10 +38,46 @@ struct fd_array {
 };
 int fd_array_push(struct fd_array *fda, int fd);
 
+/*
+ * Each platform's syscall_nr(child, name) gives the number of syscall
+ * `name` in the child's personality.
+ */
 #define do_syscall(child, name, a0, a1, a2, a3, a4, a5) \
-    ptrace_remote_syscall((child), ptrace_syscall_numbers((child))->nr_##name, \
+    ptrace_remote_syscall((child), syscall_nr((child), name),          \
                           a0, a1, a2, a3, a4, a5)
 
+#define remote_syscall_init(child, name, fl, a0, a1, a2, a3, a4, a5)  \
+    ((struct remote_syscall){                                           \
+        .sysno = syscall_nr((child), name),                             \
+        .args = { a0, a1, a2, a3, a4, a5 },                             \
+        .flags = (fl),                                                  \
+    })
+
+/*
+ * Not every ABI has fork, open and dup2; the generic one that aarch64
+ * and riscv64 use only has clone, openat and dup3. These use whichever
+ * the child's personality has.
+ */
+#define do_fork(child)                                                  \
+    (syscall_nr((child), fork) >= 0 ?                                   \
+     do_syscall((child), fork, 0, 0, 0, 0, 0, 0) :                      \
+     do_syscall((child), clone, SIGCHLD, 0, 0, 0, 0, 0))
+
+#define do_open(child, path, flags, mode)                               \
+    (syscall_nr((child), open) >= 0 ?                                   \
+     do_syscall((child), open, path, flags, mode, 0, 0, 0) :            \
+     do_syscall((child), openat, AT_FDCWD, path, flags, mode, 0, 0))
+
+#define remote_open_init(child, fl, path, flags, mode)                  \
+    (syscall_nr((child), open) >= 0 ?                                   \
+     remote_syscall_init(child, open, fl, path, flags, mode, 0, 0, 0) : \
+     remote_syscall_init(child, openat, fl, AT_FDCWD, path, flags, mode, 0, 0))
+
+#define remote_dup2_init(child, fl, oldfd, newfd)                       \
+    (syscall_nr((child), dup2) >= 0 ?                                   \
+     remote_syscall_init(child, dup2, fl, oldfd, newfd, 0, 0, 0, 0) :   \
+     remote_syscall_init(child, dup3, fl, oldfd, newfd, 0, 0, 0, 0))
+
 #define TASK_COMM_LENGTH 16
 struct proc_stat {
     pid_t pid;
@@ -51,8 +87,68 @@ struct proc_stat {
     dev_t ctty;
 };
 
+/* The rest of what --plan wants to know, none of which needs a stop. */
+struct proc_info {
+    /* Tells a pid apart from its earlier and later owners. */
+    unsigned long long starttime;
+    int nthreads;
+    int tstp_ignored;   /* ignored or blocked */
+    int tstp_caught;
+};
+
+int get_proc_info(pid_t pid, struct proc_info *out);
+/* Whether we'd be let ptrace pid, found out without attaching. */
+int check_ptrace_access(pid_t pid);
+
+/*
+ * A snapshot of the process table, taken in one pass and kept sorted
+ * by pid. Everything we need to know about other processes while
+ * attaching comes from here; the snapshot is only refreshed at the
+ * points where we expect it to have gone stale.
+ */
+struct proc_entry {
+    pid_t pid, ppid, pgid, sid;
+    uid_t uid;
+    dev_t ctty;
+    char state;
+};
+
+struct proc_table {
+    struct proc_entry *procs;
+    int n;
+    int allocated;
+
+    /* Set while following one session's membership incrementally. */
+    int tracking;
+    int track_fd;
+    pid_t track_sid;
+};
+
+int proc_table_refresh(struct proc_table *pt);
+/*
+ * Take a snapshot, then try to follow target's session from here on
+ * rather than rescanning; the table then only holds that session.
+ * Tracking is best-effort, and an error only means the snapshot failed.
+ */
+int proc_table_track_session(struct proc_table *pt, pid_t target);
+/* The same, but following every process; for --agent, which stays up. */
+int proc_table_track_all(struct proc_table *pt);
+/*
+ * Bring the table up to date, by rescanning if we aren't tracking.
+ * Following everyone, that's only as far as the kernel tells us, which
+ * leaves out process groups; proc_table_update_for also gets target's
+ * session's groups right, for an attach to it.
+ */
+int proc_table_update(struct proc_table *pt);
+int proc_table_update_for(struct proc_table *pt, pid_t target);
+int proc_table_append(struct proc_table *pt, const struct proc_entry *e);
+void proc_table_sort(struct proc_table *pt);
+struct proc_entry *proc_table_find(struct proc_table *pt, pid_t pid);
+void proc_table_free(struct proc_table *pt);
+
 struct steal_pty_state {
     struct proc_stat target_stat;
+    struct proc_table procs;
 
     pid_t emulator_pid;
     uid_t emulator_uid;
@@ -70,18 +166,47 @@ struct steal_pty_state {
     child_addr_t child_scratch;
     int child_fd;
 
+    /* The session leader's SIGHUP action, once we've replaced it. */
+    struct sigaction leader_hup;
+    int leader_hup_saved;
+
     int ptyfd;
 };
 
 void check_ptrace_scope(void);
-int check_pgroup(pid_t target);
+int check_pgroup(struct proc_table *pt, pid_t target);
+/*
+ * Whether SIGTSTP will actually stop pid, given the snapshot pt of its
+ * session and info from get_proc_info.
+ */
+int tstp_will_stop(struct proc_table *pt, pid_t pid,
+                   const struct proc_info *info);
 int check_proc_stopped(pid_t pid, int fd);
 int *get_child_tty_fds(struct ptrace_child *child, int statfd, int *count);
+/*
+ * Bring a list from get_child_tty_fds, taken while the child was still
+ * running, up to date now that it's stopped. Consumes fds and returns
+ * the list to use instead, or NULL with child->error set.
+ */
+int *recheck_child_tty_fds(struct ptrace_child *child, int statfd,
+                           int *fds, int *count);
+/*
+ * Where reading a process's files is one expensive pass, the calls
+ * above may share it; this drops it once the caller is done with the
+ * target.
+ */
+void forget_proc_files(void);
 int get_terminal_state(struct steal_pty_state *steal, pid_t target);
 int find_master_fd(struct steal_pty_state *steal);
+/*
+ * Copy the emulator's master fd straight into steal->ptyfd, without
+ * its help. Returns an errno if the kernel can't do that.
+ */
+int steal_master_fd(struct steal_pty_state *steal);
 int get_pt(void);
 int get_process_tty_termios(pid_t pid, struct termios *tio);
-void move_process_group(struct ptrace_child *child, pid_t from, pid_t to);
+void move_process_group(struct ptrace_child *child, struct proc_table *pt,
+                        pid_t from, pid_t to);
 void copy_user(struct ptrace_child *d, struct ptrace_child *s);
 
 #endif
@@ -0,0 +1,895 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+
+#include "reptyr.h"
+#include "proxy.h"
+#include "reactor.h"
+#include "daemon.h"
+#include "reallocarray.h"
+
+/* How much each direction will queue up by default */
+#define PROXY_CHUNK 65536
+/* How much coalesced output is worth a write, by default */
+#define PROXY_COALESCE_SIZE 16384
+/* Output this soon after a keystroke is taken to be its echo. */
+#define PROXY_ECHO_MS 50
+
+size_t proxy_buffer_size = PROXY_CHUNK;
+int proxy_drop_output = 0;
+long proxy_coalesce_ms = 0;
+size_t proxy_coalesce_size = PROXY_COALESCE_SIZE;
+
+void resize_pty(int pty) {
+    struct winsize sz;
+    if (ioctl(0, TIOCGWINSZ, &sz) < 0) {
+        // provide fake size to workaround some problems
+        struct winsize defaultsize = {30, 80, 640, 480};
+        if (ioctl(pty, TIOCSWINSZ, &defaultsize) < 0) {
+            fprintf(stderr, "Cannot set terminal size\n");
+        }
+        return;
+    }
+    ioctl(pty, TIOCSWINSZ, &sz);
+}
+
+static int proxy_dir_init(struct proxy_dir *d, const char *name, int in, int out,
+                          size_t capacity, struct recorder *rec,
+                          struct scrollback *fanout) {
+    memset(d, 0, sizeof *d);
+    d->name = name;
+    d->in = in;
+    d->out = out;
+    d->in_open = d->out_open = 1;
+    d->pipe[0] = d->pipe[1] = -1;
+    d->capacity = capacity;
+    d->rec = rec;
+    d->fanout = fanout;
+
+#ifdef SPLICE_F_MOVE
+    /*
+     * A direction with no `in` is fed by proxy_enqueue() instead, and a
+     * recorded or shared one has to see what it moves.
+     */
+    if (in >= 0 && !rec && !fanout && pipe2(d->pipe, O_CLOEXEC | O_NONBLOCK) == 0) {
+        d->mode = proxy_splice;
+#ifdef F_SETPIPE_SZ
+        /*
+         * The pipe has to be able to hold the whole queue. Unprivileged
+         * users can't grow it past /proc/sys/fs/pipe-max-size; settle
+         * for what we've got then.
+         */
+        if (d->capacity > PROXY_CHUNK &&
+            fcntl(d->pipe[1], F_SETPIPE_SZ, (int)d->capacity) < 0) {
+            int size = fcntl(d->pipe[1], F_GETPIPE_SZ);
+            if (size > 0 && (size_t)size < d->capacity) {
+                debug("%s: limiting buffer to %d bytes", name, size);
+                d->capacity = size;
+            }
+        }
+#endif
+        return 0;
+    }
+#endif
+    d->mode = proxy_buffered;
+    d->buf = malloc(d->capacity);
+    return d->buf ? 0 : -1;
+}
+
+static void proxy_dir_close(struct proxy_dir *d) {
+    if (d->pipe[0] >= 0) {
+        close(d->pipe[0]);
+        close(d->pipe[1]);
+        d->pipe[0] = d->pipe[1] = -1;
+    }
+    free(d->buf);
+    d->buf = NULL;
+}
+
+/*
+ * Not every kernel can splice to or from a tty. If it turns out that
+ * this one can't, we switch the direction over to the ring buffer for
+ * good, taking along anything already sitting in the pipe.
+ */
+static int proxy_fallback(struct proxy_dir *d) {
+    ssize_t n;
+    size_t have = 0;
+
+    debug("splice unavailable for %s (%s), using read/write",
+          d->name, strerror(errno));
+    d->buf = malloc(d->capacity);
+    if (!d->buf)
+        return -1;
+    while (have < d->queued) {
+        n = read(d->pipe[0], d->buf + have, d->queued - have);
+        if (n <= 0)
+            break;
+        have += n;
+    }
+    close(d->pipe[0]);
+    close(d->pipe[1]);
+    d->pipe[0] = d->pipe[1] = -1;
+    d->head = 0;
+    d->queued = have;
+    d->mode = proxy_buffered;
+    return 0;
+}
+
+/*
+ * Pull whatever `in` has into the queue without blocking. Returns the
+ * number of bytes queued, 0 on EOF, or -1 with errno set (EAGAIN if
+ * there was nothing to read).
+ */
+static ssize_t proxy_fill(struct proxy_dir *d) {
+    size_t tail, len;
+    ssize_t n;
+
+#ifdef SPLICE_F_MOVE
+    if (d->mode == proxy_splice) {
+        n = splice(d->in, NULL, d->pipe[1], NULL, d->capacity - d->queued,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0 && errno == EINVAL) {
+            if (proxy_fallback(d) < 0)
+                return -1;
+            return proxy_fill(d);
+        }
+        if (n > 0)
+            d->queued += n;
+        /* Small reads can use up the pipe's slots before its bytes. */
+        else if (n < 0 && errno == EAGAIN && d->queued)
+            d->full = 1;
+        return n;
+    }
+#endif
+
+    tail = (d->head + d->queued) % d->capacity;
+    len = d->capacity - d->queued;
+    if (len > d->capacity - tail)
+        len = d->capacity - tail;
+    n = read(d->in, d->buf + tail, len);
+    if (n > 0) {
+        if (d->rec)
+            record_output(d->rec, d->buf + tail, n);
+        if (d->fanout)
+            scrollback_append(d->fanout, d->buf + tail, n);
+        d->queued += n;
+    }
+    return n;
+}
+
+static int proxy_batch_bucket(size_t n) {
+    int i;
+    for (i = 0; i < PROXY_BATCH_BUCKETS - 1 && n >= (16UL << (4 * i)); i++)
+        ;
+    return i;
+}
+
+/*
+ * Push as much of the queue into `out` as it will take without
+ * blocking. Returns the number of bytes written or -1 with errno set.
+ */
+static ssize_t proxy_drain(struct proxy_dir *d) {
+    size_t len;
+    ssize_t n;
+
+#ifdef SPLICE_F_MOVE
+    if (d->mode == proxy_splice) {
+        n = splice(d->pipe[0], NULL, d->out, NULL, d->queued,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0 && errno == EINVAL) {
+            if (proxy_fallback(d) < 0)
+                return -1;
+            return proxy_drain(d);
+        }
+    } else
+#endif
+    {
+        len = d->queued;
+        if (len > d->capacity - d->head)
+            len = d->capacity - d->head;
+        n = write(d->out, d->buf + d->head, len);
+        if (n > 0)
+            d->head = (d->head + n) % d->capacity;
+    }
+
+    if (n > 0) {
+        d->full = 0;
+        d->queued -= n;
+        if (!d->queued)
+            d->head = 0;
+        d->bytes += n;
+        d->transfers++;
+        d->batches[proxy_batch_bucket(n)]++;
+    }
+    return n;
+}
+
+static int proxy_has_room(struct proxy_dir *d) {
+    return d->queued < d->capacity && !d->full;
+}
+
+static size_t proxy_enqueue(struct proxy_dir *d, const char *p, size_t len) {
+    size_t tail, n, done = 0;
+
+    while (done < len && d->queued < d->capacity) {
+        tail = (d->head + d->queued) % d->capacity;
+        n = d->capacity - d->queued;
+        if (n > d->capacity - tail)
+            n = d->capacity - tail;
+        if (n > len - done)
+            n = len - done;
+        memcpy(d->buf + tail, p + done, n);
+        d->queued += n;
+        done += n;
+    }
+    return done;
+}
+
+static ssize_t proxy_discard(struct proxy_dir *d) {
+    static char sink[PROXY_CHUNK];
+    ssize_t n = read(d->in, sink, sizeof sink);
+    if (n > 0)
+        d->dropped += n;
+    return n;
+}
+
+static int proxy_would_block(void) {
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+static unsigned long long ts_diff_ns(const struct timespec *a, const struct timespec *b) {
+    return (a->tv_sec - b->tv_sec) * 1000000000ULL + a->tv_nsec - b->tv_nsec;
+}
+
+/*
+ * Whether a hold on d's queue is over: it's been long enough, enough
+ * has piled up, there's no more coming, or someone is typing and
+ * waiting for this.
+ */
+static int proxy_hold_over(struct proxy_dir *d, int echo) {
+    struct timespec now;
+
+    if (echo) {
+        d->echo_flushes++;
+        return 1;
+    }
+    if (d->queued >= d->coalesce_size || !proxy_has_room(d) || !d->in_open)
+        return 1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ts_diff_ns(&now, &d->holding_since) >= d->coalesce_ms * 1000000ULL;
+}
+
+/*
+ * Move data along one direction after the reactor said it might be
+ * possible. EOF or an error on `in` stops reading but lets the queue
+ * drain; an error on `out` means nothing more can go this way. If the
+ * queue is still full afterwards, a dropping direction throws away
+ * whatever else `in` has. `echo` says the user is waiting to see
+ * what comes back, so it shouldn't be held up.
+ */
+static void proxy_step(struct proxy_dir *d, int can_read, int can_write, int echo) {
+    ssize_t n;
+    int was_empty = !d->queued;
+
+    if (can_read && d->in_open && proxy_has_room(d)) {
+        n = proxy_fill(d);
+        if (n == 0 || (n < 0 && !proxy_would_block()))
+            d->in_open = 0;
+        else if (n > 0)
+            can_write = 1;  /* `out` is usually ready; don't wait to find out */
+        /* Only fresh output waits; a backlog already has. */
+        if (n > 0 && was_empty && d->coalesce_ms && !echo) {
+            d->holding = 1;
+            d->holds++;
+            clock_gettime(CLOCK_MONOTONIC, &d->holding_since);
+        }
+    }
+    if (d->holding) {
+        if (!proxy_hold_over(d, echo))
+            return;
+        d->holding = 0;
+        can_write = 1;
+    }
+    if (can_write && d->out_open && d->queued) {
+        n = proxy_drain(d);
+        if (n < 0 && !proxy_would_block())
+            d->out_open = 0;
+    }
+    if (can_read && d->in_open && d->drop && !proxy_has_room(d)) {
+        n = proxy_discard(d);
+        if (n == 0 || (n < 0 && !proxy_would_block()))
+            d->in_open = 0;
+    }
+}
+
+static void proxy_track_stall(struct proxy_dir *d, const struct timespec *now) {
+    int stalled = d->in_open && d->out_open && !d->drop && !proxy_has_room(d);
+
+    if (stalled && !d->stalled)
+        d->stalled_since = *now;
+    else if (!stalled && d->stalled)
+        d->stalled_ns += ts_diff_ns(now, &d->stalled_since);
+    d->stalled = stalled;
+}
+
+static int proxy_interest(struct proxy_dir *d, int fd) {
+    int events = 0;
+    if (fd == d->in && d->in_open && (d->drop || proxy_has_room(d)))
+        events |= REACTOR_READ;
+    if (fd == d->out && d->out_open && d->queued && !d->holding)
+        events |= REACTOR_WRITE;
+    return events;
+}
+
+/* How long until the first hold is up, to wake the loop in time. */
+static int proxy_hold_timeout(struct proxy_session *s, int timeout_ms) {
+    struct proxy_dir *d;
+    struct timespec now;
+    long long left;
+    int i, got_now = 0;
+
+    for (i = 0; i < s->ntargets; i++) {
+        d = &s->targets[i].output;
+        if (!d->holding)
+            continue;
+        if (!got_now) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            got_now = 1;
+        }
+        left = d->coalesce_ms - (long long)(ts_diff_ns(&now, &d->holding_since) / 1000000);
+        if (left < 0)
+            left = 0;
+        if (timeout_ms < 0 || left < timeout_ms)
+            timeout_ms = left;
+    }
+    return timeout_ms;
+}
+
+static int proxy_expect_echo(struct proxy_session *s) {
+    struct timespec now;
+
+    if (!proxy_coalesce_ms || !s->typed)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ts_diff_ns(&now, &s->last_input) < PROXY_ECHO_MS * 1000000ULL;
+}
+
+/*
+ * O_NONBLOCK belongs to the open file, not the fd, so setting it on
+ * the stdin or stdout we inherited would also pull it out from under
+ * our shell or a child started with -l. Where the fd is a tty or a
+ * pipe we reopen it to get a file of our own; anything else (regular
+ * files, which never block anyway, and sockets) is used as it is.
+ */
+static int proxy_open_stdio(int fd, int mode) {
+#ifdef __linux__
+    char path[64];
+    struct stat st;
+    int nfd;
+
+    if (fstat(fd, &st) < 0 || !(isatty(fd) || S_ISFIFO(st.st_mode)))
+        return fd;
+    snprintf(path, sizeof path, "/proc/self/fd/%d", fd);
+    nfd = open(path, mode | O_NONBLOCK | O_CLOEXEC | O_NOCTTY);
+    if (nfd >= 0)
+        return nfd;
+    debug("Unable to reopen fd %d (%m), its writes may block", fd);
+#endif
+    return fd;
+}
+
+static void proxy_reap_children(void) {
+    pid_t pid;
+    int status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        debug("child %d exited with status %x", (int)pid, status);
+}
+
+int proxy_add_target(struct proxy_session *s, pid_t pid, int pty) {
+    struct proxy_target *t;
+
+    t = xreallocarray(s->targets, s->ntargets + 1, sizeof *t);
+    if (!t)
+        return -1;
+    s->targets = t;
+    t = &s->targets[s->ntargets++];
+    memset(t, 0, sizeof *t);
+    t->pid = pid;
+    t->pty = pty;
+    t->pty_flags = -1;
+    return 0;
+}
+
+static int proxy_target_live(struct proxy_target *t) {
+    return t->input.out_open && t->output.out_open
+        && (t->output.in_open || t->output.queued);
+}
+
+/* The terminal is raw while we run, so notices need their own \r. */
+static void proxy_notice(struct proxy_target *t, const char *what) {
+    if (t->pid)
+        fprintf(stderr, "[reptyr: %s pid %d]\r\n", what, (int)t->pid);
+    else
+        fprintf(stderr, "[reptyr: %s %s]\r\n", what, ptsname(t->pty));
+}
+
+static void proxy_switch(struct proxy_session *s, int i) {
+    if (i < 0 || i >= s->ntargets || i == s->active)
+        return;
+    if (!proxy_target_live(&s->targets[i]))
+        return;
+    s->active = i;
+    proxy_notice(&s->targets[i], "input now goes to");
+}
+
+/* Once the active target goes away, hand stdin to the next live one. */
+static void proxy_check_active(struct proxy_session *s) {
+    int i;
+
+    if (proxy_target_live(&s->targets[s->active]))
+        return;
+    for (i = 1; i < s->ntargets; i++) {
+        int next = (s->active + i) % s->ntargets;
+        if (proxy_target_live(&s->targets[next])) {
+            proxy_switch(s, next);
+            return;
+        }
+    }
+}
+
+/*
+ * With several targets, or a session we can detach from, we have to
+ * look at what's typed to spot escapes, so stdin is read here and the
+ * bytes queued on the active target by hand. We only read as much as
+ * the active target has room for; if an escape moves us to a target
+ * with less room, the excess is lost, which for keystrokes is unlikely
+ * to matter.
+ */
+static void proxy_mux_input(struct proxy_session *s, int fd) {
+    struct proxy_dir *d = &s->targets[s->active].input;
+    char buf[PROXY_CHUNK];
+    size_t room = d->capacity - d->queued;
+    ssize_t n, i, start;
+
+    if (room > sizeof buf)
+        room = sizeof buf;
+    n = read(fd, buf, room);
+    if (n == 0 || (n < 0 && !proxy_would_block())) {
+        s->stdin_open = 0;
+        return;
+    }
+
+    for (i = start = 0; i < n; i++) {
+        if (s->escape_pending) {
+            s->escape_pending = 0;
+            start = i + 1;
+            if (buf[i] == PROXY_ESCAPE)
+                start = i;
+            else if (buf[i] >= '1' && buf[i] <= '9')
+                proxy_switch(s, buf[i] - '1');
+            else if (buf[i] == 'n')
+                proxy_switch(s, (s->active + 1) % s->ntargets);
+            else if (buf[i] == 'd' && s->detachable) {
+                s->detached = 1;
+                return;
+            }
+            continue;
+        }
+        if (buf[i] != PROXY_ESCAPE)
+            continue;
+        proxy_enqueue(&s->targets[s->active].input, buf + start, i - start);
+        s->escape_pending = 1;
+        start = i + 1;
+    }
+    if (!s->escape_pending)
+        proxy_enqueue(&s->targets[s->active].input, buf + start, n - start);
+}
+
+static int proxy_watch_fd(struct proxy_session *s, struct reactor *r,
+                          int fd, int stdin_fd) {
+    int i, events = 0;
+    struct proxy_target *t;
+
+    for (i = 0; i < s->ntargets; i++) {
+        t = &s->targets[i];
+        events |= proxy_interest(&t->input, fd) | proxy_interest(&t->output, fd);
+    }
+    if ((s->ntargets > 1 || s->detachable) && fd == stdin_fd && s->stdin_open) {
+        t = &s->targets[s->active];
+        if (proxy_target_live(t) && t->input.queued < t->input.capacity)
+            events |= REACTOR_READ;
+    }
+    return reactor_watch(r, fd, events);
+}
+
+static void proxy_ready(struct reactor_event *ev, int n, int fd,
+                        int *can_read, int *can_write) {
+    int j;
+
+    *can_read = *can_write = 0;
+    for (j = 0; j < n; j++) {
+        if (ev[j].fd != fd)
+            continue;
+        if (ev[j].events & REACTOR_READ)
+            *can_read = 1;
+        if (ev[j].events & REACTOR_WRITE)
+            *can_write = 1;
+    }
+}
+
+int proxy_share(struct proxy_session *s, const char *path) {
+    struct scrollback *sb = malloc(sizeof *sb);
+    int err;
+
+    if (!sb || scrollback_init(sb, PROXY_SCROLLBACK) < 0) {
+        free(sb);
+        errno = ENOMEM;
+        return -1;
+    }
+    if ((s->share_fd = daemon_listen(path)) < 0) {
+        err = errno;
+        scrollback_free(sb);
+        free(sb);
+        errno = err;
+        return -1;
+    }
+    fcntl(s->share_fd, F_SETFL, fcntl(s->share_fd, F_GETFL) | O_NONBLOCK);
+    /* A viewer going away mid-write is its problem, not ours. */
+    signal(SIGPIPE, SIG_IGN);
+    s->share_path = path;
+    s->fanout = sb;
+    return 0;
+}
+
+void proxy_unshare(struct proxy_session *s) {
+    if (!s->fanout)
+        return;
+    unlink(s->share_path);
+    close(s->share_fd);
+    scrollback_free(s->fanout);
+    free(s->fanout);
+    s->fanout = NULL;
+}
+
+/*
+ * Viewers start with the recent output, so they know what they're
+ * looking at.
+ */
+static void proxy_accept_viewer(struct proxy_session *s) {
+    struct proxy_viewer *v;
+    int fd = accept(s->share_fd, NULL, NULL);
+
+    if (fd < 0)
+        return;
+    if (!daemon_peer_allowed(fd)) {
+        close(fd);
+        return;
+    }
+    v = xreallocarray(s->viewers, s->nviewers + 1, sizeof *v);
+    if (!v) {
+        close(fd);
+        return;
+    }
+    s->viewers = v;
+    v = &s->viewers[s->nviewers++];
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    v->fd = fd;
+    v->cursor = scrollback_oldest(s->fanout);
+    v->missed = 0;
+    debug("viewer %d joined", s->nviewers);
+}
+
+static void proxy_drop_viewer(struct proxy_session *s, struct reactor *r, int i) {
+    struct proxy_viewer *v = &s->viewers[i];
+
+    /* Count what it fell behind by even if it never woke up to skip it. */
+    v->missed += scrollback_catch_up(s->fanout, &v->cursor);
+    debug("viewer %d left, %llu bytes missed", i + 1, v->missed);
+    reactor_forget(r, v->fd);
+    close(v->fd);
+    s->viewers[i] = s->viewers[--s->nviewers];
+}
+
+/*
+ * Anything a viewer types is ignored; reading it is only so we notice
+ * when the viewer goes away.
+ */
+static int proxy_serve_viewer(struct proxy_session *s, struct proxy_viewer *v,
+                              int can_read, int can_write) {
+    char buf[256];
+    ssize_t n;
+
+    if (can_read) {
+        n = read(v->fd, buf, sizeof buf);
+        if (n == 0 || (n < 0 && !proxy_would_block()))
+            return -1;
+    }
+    if (can_write) {
+        v->missed += scrollback_catch_up(s->fanout, &v->cursor);
+        if (scrollback_write(s->fanout, v->fd, &v->cursor) < 0 &&
+            !proxy_would_block())
+            return -1;
+    }
+    return 0;
+}
+
+static int proxy_watch_viewers(struct proxy_session *s, struct reactor *r) {
+    struct proxy_viewer *v;
+    int i;
+
+    if (reactor_watch(r, s->share_fd, REACTOR_READ) < 0)
+        return -1;
+    for (i = 0; i < s->nviewers; i++) {
+        v = &s->viewers[i];
+        if (reactor_watch(r, v->fd, REACTOR_READ |
+                          (v->cursor < s->fanout->head ? REACTOR_WRITE : 0)) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void proxy_viewers_ready(struct proxy_session *s, struct reactor *r,
+                                struct reactor_event *ev, int n) {
+    int can_read, can_write, i;
+
+    for (i = 0; i < s->nviewers; i++) {
+        proxy_ready(ev, n, s->viewers[i].fd, &can_read, &can_write);
+        if (proxy_serve_viewer(s, &s->viewers[i], can_read, can_write) < 0)
+            proxy_drop_viewer(s, r, i--);
+    }
+    proxy_ready(ev, n, s->share_fd, &can_read, &can_write);
+    if (can_read)
+        proxy_accept_viewer(s);
+}
+
+void do_proxy(struct proxy_session *s) {
+    struct reactor reactor;
+    struct reactor_event ev[16];
+    struct proxy_target *t;
+    int stdin_fd, stdout_fd;
+    int mux = s->ntargets > 1 || s->detachable;
+    int live, stdout_ok;
+    int can_read, can_write, ignored, typed, echo;
+    struct timespec now;
+    sigset_t sigs;
+    int i, j, n;
+
+    clock_gettime(CLOCK_MONOTONIC, &s->start);
+    s->end = s->start;
+    s->active = 0;
+    s->escape_pending = 0;
+    s->stdin_open = 1;
+    s->detached = 0;
+    s->typed = 0;
+    stdin_fd = proxy_open_stdio(0, O_RDONLY);
+    stdout_fd = proxy_open_stdio(1, O_WRONLY);
+    for (i = 0; i < s->ntargets; i++) {
+        t = &s->targets[i];
+        if (proxy_dir_init(&t->input, "stdin -> pty", mux ? -1 : stdin_fd, t->pty,
+                           proxy_buffer_size, NULL, NULL) < 0 ||
+            proxy_dir_init(&t->output, "pty -> stdout", t->pty, stdout_fd,
+                           proxy_buffer_size, s->rec, s->fanout) < 0) {
+            error("Unable to set up the proxy: %m");
+            goto out_dirs;
+        }
+        /* Never lose keystrokes, or hold them up. */
+        t->output.drop = proxy_drop_output;
+        t->output.coalesce_ms = proxy_coalesce_ms;
+        t->output.coalesce_size = proxy_coalesce_size;
+    }
+    if (reactor_init(&reactor) < 0) {
+        error("Unable to set up the event loop: %m");
+        goto out_dirs;
+    }
+
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGWINCH);
+    sigaddset(&sigs, SIGCHLD);
+    if (reactor_watch_signals(&reactor, &sigs) < 0) {
+        error("Unable to watch for signals: %m");
+        goto out_reactor;
+    }
+    proxy_reap_children();
+
+    /* The pty masters are ours alone. */
+    for (i = 0; i < s->ntargets; i++) {
+        t = &s->targets[i];
+        resize_pty(t->pty);
+        t->pty_flags = fcntl(t->pty, F_GETFL);
+        if (t->pty_flags >= 0)
+            fcntl(t->pty, F_SETFL, t->pty_flags | O_NONBLOCK);
+    }
+    if (s->ntargets > 1)
+        proxy_notice(&s->targets[0], "input now goes to");
+
+    /*
+     * A target is done once its pty has nothing more to say and we've
+     * shown all of it, or once we can't talk to its pty at all. We're
+     * done when every target is, or when stdout goes away. Losing
+     * stdin only stops input.
+     */
+    while (1) {
+        live = 0;
+        stdout_ok = 1;
+        for (i = 0; i < s->ntargets; i++) {
+            live |= proxy_target_live(&s->targets[i]);
+            stdout_ok &= s->targets[i].output.out_open;
+        }
+        if (!live || !stdout_ok || s->detached)
+            break;
+        if (mux)
+            proxy_check_active(s);
+
+        if (proxy_watch_fd(s, &reactor, stdin_fd, stdin_fd) < 0 ||
+            proxy_watch_fd(s, &reactor, stdout_fd, stdin_fd) < 0)
+            goto watch_failed;
+        for (i = 0; i < s->ntargets; i++)
+            if (proxy_watch_fd(s, &reactor, s->targets[i].pty, stdin_fd) < 0)
+                goto watch_failed;
+        if (s->fanout && proxy_watch_viewers(s, &reactor) < 0)
+            goto watch_failed;
+
+        n = reactor_wait(&reactor, ev, sizeof ev / sizeof *ev,
+                         proxy_hold_timeout(s, s->rec ? record_timeout_ms(s->rec) : -1));
+        if (n < 0) {
+            error("Waiting for events: %m");
+            break;
+        }
+
+        for (j = 0; j < n; j++) {
+            if (ev[j].events & REACTOR_SIGNAL) {
+                if (ev[j].signo == SIGWINCH)
+                    for (i = 0; i < s->ntargets; i++)
+                        resize_pty(s->targets[i].pty);
+                else if (ev[j].signo == SIGCHLD)
+                    proxy_reap_children();
+            }
+        }
+
+        /* Keystrokes go first, so output can never get in their way. */
+        typed = 0;
+        if (mux) {
+            proxy_ready(ev, n, stdin_fd, &can_read, &ignored);
+            if (can_read && s->stdin_open) {
+                proxy_mux_input(s, stdin_fd);
+                typed = 1;
+            }
+        }
+        for (i = 0; i < s->ntargets; i++) {
+            t = &s->targets[i];
+            proxy_ready(ev, n, t->input.in, &can_read, &ignored);
+            proxy_ready(ev, n, t->pty, &ignored, &can_write);
+            typed |= can_read;
+            /* Input we queued by hand can go straight out. */
+            proxy_step(&t->input, can_read, can_write || mux, 0);
+        }
+        if (typed && proxy_coalesce_ms) {
+            clock_gettime(CLOCK_MONOTONIC, &s->last_input);
+            s->typed = 1;
+        }
+        echo = proxy_expect_echo(s);
+        proxy_ready(ev, n, stdout_fd, &ignored, &can_write);
+        for (i = 0; i < s->ntargets; i++) {
+            t = &s->targets[i];
+            proxy_ready(ev, n, t->pty, &can_read, &ignored);
+            proxy_step(&t->output, can_read, can_write, echo);
+        }
+        /* Viewers only ever get what's already been read. */
+        if (s->fanout)
+            proxy_viewers_ready(s, &reactor, ev, n);
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (i = 0; i < s->ntargets; i++) {
+            proxy_track_stall(&s->targets[i].input, &now);
+            proxy_track_stall(&s->targets[i].output, &now);
+        }
+        if (s->rec)
+            record_tick(s->rec);
+    }
+    goto out_flags;
+
+watch_failed:
+    error("Unable to watch for events: %m");
+out_flags:
+    for (i = 0; i < s->ntargets; i++) {
+        t = &s->targets[i];
+        if (t->pty_flags >= 0)
+            fcntl(t->pty, F_SETFL, t->pty_flags);
+    }
+out_reactor:
+    /* The last of the output is worth one more try. */
+    while (s->nviewers) {
+        struct proxy_viewer *v = &s->viewers[s->nviewers - 1];
+        scrollback_write(s->fanout, v->fd, &v->cursor);
+        proxy_drop_viewer(s, &reactor, s->nviewers - 1);
+    }
+    reactor_close(&reactor);
+out_dirs:
+    clock_gettime(CLOCK_MONOTONIC, &s->end);
+    for (i = 0; i < s->ntargets; i++) {
+        t = &s->targets[i];
+        t->input.in_open = t->output.in_open = 0;
+        proxy_track_stall(&t->input, &s->end);
+        proxy_track_stall(&t->output, &s->end);
+        proxy_dir_close(&t->input);
+        proxy_dir_close(&t->output);
+    }
+    if (stdin_fd > 2)
+        close(stdin_fd);
+    if (stdout_fd > 2)
+        close(stdout_fd);
+}
+
+static const char *mode_name(enum proxy_mode mode) {
+    switch (mode) {
+    case proxy_splice:
+        return "splice";
+    default:
+        return "read/write";
+    }
+}
+
+void proxy_report(struct proxy_session *s) {
+    double secs = (s->end.tv_sec - s->start.tv_sec)
+        + (s->end.tv_nsec - s->start.tv_nsec) / 1e9;
+    char label[32];
+    int i, k;
+
+    for (i = 0; i < s->ntargets; i++) {
+        struct proxy_target *t = &s->targets[i];
+        struct proxy_dir *dirs[] = { &t->input, &t->output };
+
+        label[0] = '\0';
+        if (s->ntargets > 1)
+            snprintf(label, sizeof label, "pid %d: ", (int)t->pid);
+        for (k = 0; k < 2; k++) {
+            struct proxy_dir *d = dirs[k];
+            debug("%s%s: %llu bytes in %llu transfers (%s), %.1f KiB/s, "
+                  "stalled for %.3fs",
+                  label, d->name, d->bytes, d->transfers, mode_name(d->mode),
+                  secs > 0 ? d->bytes / secs / 1024 : 0.0, d->stalled_ns / 1e9);
+            if (d->drop)
+                debug("%s%s: dropped %llu bytes", label, d->name, d->dropped);
+            if (d->transfers)
+                debug("%s%s: writes of <16: %llu, <256: %llu, <4k: %llu, "
+                      "<64k: %llu, more: %llu", label, d->name,
+                      d->batches[0], d->batches[1], d->batches[2],
+                      d->batches[3], d->batches[4]);
+            if (d->coalesce_ms)
+                debug("%s%s: held output %llu times, %llu cut short by input",
+                      label, d->name, d->holds, d->echo_flushes);
+        }
+    }
+}
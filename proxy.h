@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <sys/types.h>
+#include <time.h>
+
+#include "record.h"
+#include "scrollback.h"
+
+#define PROXY_BATCH_BUCKETS 5
+
+enum proxy_mode {
+    proxy_splice,       /* queue data in a pipe and splice() it along */
+    proxy_buffered,     /* plain read()/write() through a ring buffer */
+};
+
+/*
+ * One direction of the proxy: everything read from `in` is queued and
+ * written to `out` as fast as `out` will take it. Wherever we can, both
+ * fds are non-blocking, so a slow consumer only ever holds up its own
+ * direction.
+ */
+struct proxy_dir {
+    const char *name;
+    int in, out;
+    enum proxy_mode mode;
+    int in_open, out_open;
+
+    /* What's queued lives in pipe for proxy_splice and buf otherwise. */
+    int pipe[2];
+    char *buf;
+    size_t head;
+    size_t queued;
+    size_t capacity;
+    int full;           /* the pipe ran out of slots before capacity */
+    int drop;           /* discard input rather than wait for room */
+    struct recorder *rec;   /* gets a copy of everything read */
+    struct scrollback *fanout;  /* so does this */
+
+    /*
+     * With coalesce_ms set, output that arrives in an empty queue is
+     * held for up to that long, or until coalesce_size bytes have
+     * piled up, so it goes out in fewer, bigger writes.
+     */
+    long coalesce_ms;
+    size_t coalesce_size;
+    int holding;
+    struct timespec holding_since;
+
+    /* Time spent with a full queue, i.e. holding up `in`'s writer. */
+    int stalled;
+    struct timespec stalled_since;
+    unsigned long long stalled_ns;
+
+    unsigned long long bytes;
+    unsigned long long transfers;
+    unsigned long long dropped;
+    /* Writes by size: under 16, 256, 4k and 64k bytes, and the rest */
+    unsigned long long batches[PROXY_BATCH_BUCKETS];
+    /* Holds, and how many of them were cut short by input */
+    unsigned long long holds;
+    unsigned long long echo_flushes;
+};
+
+/* One pty we proxy for, and the process (if any) attached to it. */
+struct proxy_target {
+    pid_t pid;
+    int pty;
+    int pty_flags;
+    struct proxy_dir input;     /* stdin -> pty */
+    struct proxy_dir output;    /* pty -> stdout */
+};
+
+/*
+ * Someone watching over a --share socket. Each gets the shared output
+ * at its own pace from its own cursor; one that falls too far behind
+ * misses some rather than holding up anyone else.
+ */
+struct proxy_viewer {
+    int fd;
+    unsigned long long cursor;
+    unsigned long long missed;
+};
+
+/*
+ * Everything one do_proxy() serves. With more than one target, all of
+ * their output is interleaved on stdout and stdin goes to the active
+ * one; PROXY_ESCAPE followed by a digit switches targets.
+ */
+struct proxy_session {
+    struct timespec start, end;
+    struct proxy_target *targets;
+    int ntargets;
+    int active;
+    int escape_pending;
+    int stdin_open;
+    /* When we last passed on input; output soon after is its echo. */
+    int typed;
+    struct timespec last_input;
+    /* PROXY_ESCAPE then 'd' ends the session early, leaving the ptys be. */
+    int detachable;
+    int detached;
+    /* If set, where to record what goes to stdout */
+    struct recorder *rec;
+    /*
+     * Set up by proxy_share(): watchers of what goes to stdout. Input
+     * only ever comes from our own stdin.
+     */
+    const char *share_path;
+    int share_fd;
+    struct scrollback *fanout;
+    struct proxy_viewer *viewers;
+    int nviewers;
+};
+
+#define PROXY_ESCAPE 0x1d       /* ^] */
+/* How much recent output a viewer can be behind, or sees on joining */
+#define PROXY_SCROLLBACK 65536
+
+/*
+ * How much each direction may queue, and whether pty output that
+ * doesn't fit is dropped instead of making the target wait.
+ */
+extern size_t proxy_buffer_size;
+extern int proxy_drop_output;
+/* pty output coalescing, off while proxy_coalesce_ms is 0 */
+extern long proxy_coalesce_ms;
+extern size_t proxy_coalesce_size;
+
+void resize_pty(int pty);
+int proxy_add_target(struct proxy_session *s, pid_t pid, int pty);
+/* Accept viewers on `path` for the next do_proxy(). */
+int proxy_share(struct proxy_session *s, const char *path);
+void proxy_unshare(struct proxy_session *s);
+void do_proxy(struct proxy_session *s);
+void proxy_report(struct proxy_session *s);
+
+#endif
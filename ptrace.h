@@ -45,6 +45,32 @@
 #define PTRACE_GETEVENTMSG  0x4201
 #endif
 
+/*
+ * Newer architectures have no PTRACE_GETREGS, and no struct user to go
+ * with it; the register file moves in and out in one piece as the
+ * NT_PRSTATUS regset instead. Give them a struct user shaped like
+ * everyone else's, so the rest of the code can stay the same.
+ */
+#if defined(__linux__) && defined(__aarch64__)
+#define PTRACE_REGS_VIA_REGSET
+struct user {
+    struct user_regs_struct regs;
+};
+#elif defined(__linux__) && defined(__riscv) && __riscv_xlen == 64
+#define PTRACE_REGS_VIA_REGSET
+/* The kernel's struct user_regs_struct, which not every libc has. */
+struct user {
+    struct {
+        unsigned long pc, ra, sp, gp, tp;
+        unsigned long t0, t1, t2;
+        unsigned long s0, s1;
+        unsigned long a0, a1, a2, a3, a4, a5, a6, a7;
+        unsigned long s2, s3, s4, s5, s6, s7, s8, s9, s10, s11;
+        unsigned long t3, t4, t5, t6;
+    } regs;
+};
+#endif
+
 enum child_state {
     ptrace_detached = 0,
     ptrace_at_syscall,
@@ -54,6 +80,9 @@ enum child_state {
     ptrace_exited
 };
 
+/* The most stack scratch attach.c will borrow; see alloc_scratch. */
+#define STACK_SCRATCH_MAX 512
+
 struct ptrace_child {
     pid_t pid;
     enum child_state state;
@@ -62,8 +91,18 @@ struct ptrace_child {
     int error;
     unsigned long forked_pid;
     unsigned long saved_syscall;
+    /* What was on the stack under any scratch we borrowed, to put back */
+    unsigned char stack_saved[STACK_SCRATCH_MAX];
+    /* The target's other threads, if ptrace_freeze_threads seized them */
+    pid_t *threads;
+    int nthreads;
 #ifdef __linux__
 	struct user user;
+	/* How to move bulk memory in and out of the child; see linux_ptrace.c */
+	int mem_method;
+	int mem_fd;
+	/* Set once the syscall trampoline has faulted in this child */
+	int no_trampoline;
 #endif
 #ifdef __FreeBSD__
 	struct reg regs;
@@ -78,13 +117,17 @@ struct syscall_numbers {
     long nr_setsid;
     long nr_setpgid;
     long nr_fork;
+    long nr_clone;
     long nr_wait4;
     long nr_signal;
     long nr_rt_sigaction;
     long nr_open;
+    long nr_openat;
     long nr_close;
     long nr_ioctl;
     long nr_dup2;
+    long nr_dup3;
+    long nr_fcntl;
     long nr_socket;
     long nr_connect;
     long nr_sendmsg;
@@ -93,13 +136,79 @@ struct syscall_numbers {
 
 typedef unsigned long child_addr_t;
 
+/*
+ * A single entry in a batch of syscalls for ptrace_remote_syscalls. The
+ * layout is shared with the in-child trampoline on architectures that
+ * have one, so don't reorder it.
+ */
+struct remote_syscall {
+    unsigned long sysno;
+    unsigned long args[6];
+    unsigned long result;
+    unsigned long flags;
+};
+
+/* Stop the batch if this call returns an error. */
+#define REMOTE_SYSCALL_ABORT_ON_ERROR 0x1
+
+#define remote_syscall_failed(rs) ((rs)->result > (unsigned long)-4096)
+/* Marks a batch entry that hasn't run; no syscall can return this. */
+#define REMOTE_SYSCALL_PENDING ((unsigned long)-4096)
+
+/*
+ * What we've asked of the kernel on our targets' behalf, for --stats.
+ * The ptrace layer only ever adds to these; it's up to the caller to
+ * reset them.
+ */
+enum ptrace_stat {
+    ptrace_stat_peekdata = 0,
+    ptrace_stat_pokedata,
+    ptrace_stat_peekuser,
+    ptrace_stat_pokeuser,
+    ptrace_stat_getregs,
+    ptrace_stat_setregs,
+    ptrace_stat_syscall,
+    ptrace_stat_cont,
+    ptrace_stat_attach,
+    ptrace_stat_detach,
+    ptrace_stat_other,
+    /* Not ptrace requests, but part of the same conversation */
+    ptrace_stat_wait,
+    ptrace_stat_bulk_read,
+    ptrace_stat_bulk_write,
+    ptrace_stat_max
+};
+
+struct ptrace_stats {
+    unsigned long requests[ptrace_stat_max];
+    /* Syscalls run in targets, and the round trips that took */
+    unsigned long remote_syscalls;
+    unsigned long remote_batches;
+    unsigned long long remote_ns;
+};
+
+extern struct ptrace_stats ptrace_stats;
+
+/*
+ * If set, a CLOCK_MONOTONIC time in ns after which anything that waits
+ * on a target gives up with ETIMEDOUT, for --max-stop. That keeps a
+ * target that never gets where we want it (say, one that keeps
+ * stopping with signals instead of at a syscall) from holding us, and
+ * it, forever. A request already in the kernel isn't interrupted.
+ */
+extern unsigned long long ptrace_deadline_ns;
+/* Whether ptrace_deadline_ns has passed; sets child->error if so. */
+int ptrace_past_deadline(struct ptrace_child *child);
+
 int ptrace_wait(struct ptrace_child *child);
 int ptrace_attach_child(struct ptrace_child *child, pid_t pid);
 int ptrace_finish_attach(struct ptrace_child *child, pid_t pid);
+int ptrace_freeze_threads(struct ptrace_child *child);
 int ptrace_detach_child(struct ptrace_child *child);
 int ptrace_wait(struct ptrace_child *child);
 int ptrace_advance_to_state(struct ptrace_child *child,
                             enum child_state desired);
+int ptrace_signal_stop(pid_t pid, int sig, long timeout_ms);
 int ptrace_save_regs(struct ptrace_child *child);
 int ptrace_restore_regs(struct ptrace_child *child);
 unsigned long ptrace_remote_syscall(struct ptrace_child *child,
@@ -108,8 +217,14 @@ unsigned long ptrace_remote_syscall(struct ptrace_child *child,
                                     unsigned long p2, unsigned long p3,
                                     unsigned long p4, unsigned long p5);
 
+int ptrace_remote_syscalls(struct ptrace_child *child,
+                           child_addr_t scratch, size_t len,
+                           struct remote_syscall *calls, int n);
+
 int ptrace_memcpy_to_child(struct ptrace_child *, child_addr_t, const void*, size_t);
 int ptrace_memcpy_from_child(struct ptrace_child *, void*, child_addr_t, size_t);
 struct syscall_numbers *ptrace_syscall_numbers(struct ptrace_child *child);
+/* The stack pointer as of the last ptrace_save_regs. */
+child_addr_t ptrace_stack_pointer(struct ptrace_child *child);
 
 #endif
@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#endif
+#ifdef __FreeBSD__
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
+#include "reactor.h"
+#include "reallocarray.h"
+
+static struct reactor_fd *reactor_find(struct reactor *r, int fd) {
+    int i;
+    for (i = 0; i < r->nfds; i++)
+        if (r->fds[i].fd == fd)
+            return &r->fds[i];
+    return NULL;
+}
+
+static struct reactor_fd *reactor_add(struct reactor *r, int fd) {
+    struct reactor_fd *rfd;
+
+    if (r->nfds == r->allocated) {
+        int n = r->allocated ? 2 * r->allocated : 4;
+        rfd = xreallocarray(r->fds, n, sizeof *rfd);
+        if (!rfd)
+            return NULL;
+        r->fds = rfd;
+        r->allocated = n;
+    }
+    rfd = &r->fds[r->nfds++];
+    memset(rfd, 0, sizeof *rfd);
+    rfd->fd = fd;
+    return rfd;
+}
+
+static int reactor_update(struct reactor *r, struct reactor_fd *rfd, int events);
+
+int reactor_watch(struct reactor *r, int fd, int events) {
+    struct reactor_fd *rfd = reactor_find(r, fd);
+
+    if (!rfd && !(rfd = reactor_add(r, fd)))
+        return -1;
+    if (rfd->events == events && (rfd->registered || rfd->always_ready || !events))
+        return 0;
+    if (rfd->always_ready) {
+        rfd->events = events;
+        return 0;
+    }
+    if (reactor_update(r, rfd, events) < 0)
+        return -1;
+    rfd->events = events;
+    return 0;
+}
+
+void reactor_forget(struct reactor *r, int fd) {
+    struct reactor_fd *rfd = reactor_find(r, fd);
+
+    if (!rfd)
+        return;
+    if (rfd->registered)
+        reactor_update(r, rfd, 0);
+    *rfd = r->fds[--r->nfds];
+}
+
+/*
+ * Fds the kernel can't poll are reported ready whenever someone is
+ * interested in them; the following read() or write() won't block.
+ */
+static int reactor_poll_always_ready(struct reactor *r, struct reactor_event *ev, int n) {
+    int i, out = 0;
+    for (i = 0; i < r->nfds && out < n; i++) {
+        if (!r->fds[i].always_ready || !r->fds[i].events)
+            continue;
+        ev[out].fd = r->fds[i].fd;
+        ev[out].events = r->fds[i].events;
+        ev[out].signo = 0;
+        out++;
+    }
+    return out;
+}
+
+static int reactor_have_always_ready(struct reactor *r) {
+    int i;
+    for (i = 0; i < r->nfds; i++)
+        if (r->fds[i].always_ready && r->fds[i].events)
+            return 1;
+    return 0;
+}
+
+static int reactor_block_signals(struct reactor *r, const sigset_t *sigs) {
+    int i, first = 1;
+
+    for (i = 1; i < NSIG; i++)
+        if (sigismember(&r->signals, i) == 1)
+            first = 0;
+    if (sigprocmask(SIG_BLOCK, sigs, first ? &r->saved_mask : NULL) < 0)
+        return -1;
+    for (i = 1; i < NSIG; i++)
+        if (sigismember(sigs, i) == 1)
+            sigaddset(&r->signals, i);
+    return first;
+}
+
+static void reactor_common_close(struct reactor *r) {
+    int i, any = 0;
+
+    for (i = 1; i < NSIG; i++)
+        if (sigismember(&r->signals, i) == 1)
+            any = 1;
+    if (any)
+        sigprocmask(SIG_SETMASK, &r->saved_mask, NULL);
+    free(r->fds);
+    r->fds = NULL;
+    r->nfds = r->allocated = 0;
+    if (r->fd >= 0)
+        close(r->fd);
+    r->fd = -1;
+}
+
+#ifdef __linux__
+
+int reactor_init(struct reactor *r) {
+    memset(r, 0, sizeof *r);
+    sigemptyset(&r->signals);
+    r->sigfd = -1;
+    r->fd = epoll_create1(EPOLL_CLOEXEC);
+    return r->fd < 0 ? -1 : 0;
+}
+
+void reactor_close(struct reactor *r) {
+    if (r->sigfd >= 0)
+        close(r->sigfd);
+    r->sigfd = -1;
+    reactor_common_close(r);
+}
+
+static int reactor_update(struct reactor *r, struct reactor_fd *rfd, int events) {
+    struct epoll_event ee = {};
+
+    /*
+     * epoll reports hangups even with an empty mask, so an fd nobody is
+     * interested in is taken out of the set rather than left idle.
+     */
+    if (!events) {
+        if (epoll_ctl(r->fd, EPOLL_CTL_DEL, rfd->fd, NULL) < 0 && errno != EBADF)
+            return -1;
+        rfd->registered = 0;
+        return 0;
+    }
+
+    if (events & REACTOR_READ)
+        ee.events |= EPOLLIN;
+    if (events & REACTOR_WRITE)
+        ee.events |= EPOLLOUT;
+    ee.data.fd = rfd->fd;
+    if (epoll_ctl(r->fd, rfd->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                  rfd->fd, &ee) < 0) {
+        if (errno != EPERM)
+            return -1;
+        rfd->always_ready = 1;
+        return 0;
+    }
+    rfd->registered = 1;
+    return 0;
+}
+
+int reactor_watch_signals(struct reactor *r, const sigset_t *sigs) {
+    struct epoll_event ee = { .events = EPOLLIN };
+    int fd;
+
+    if (reactor_block_signals(r, sigs) < 0)
+        return -1;
+    fd = signalfd(r->sigfd, &r->signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (r->sigfd < 0) {
+        r->sigfd = fd;
+        ee.data.fd = fd;
+        if (epoll_ctl(r->fd, EPOLL_CTL_ADD, fd, &ee) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int reactor_wait(struct reactor *r, struct reactor_event *ev, int n, int timeout_ms) {
+    struct epoll_event ee[n];
+    struct signalfd_siginfo si;
+    int i, got, out = 0;
+
+    if (reactor_have_always_ready(r))
+        timeout_ms = 0;
+    got = epoll_wait(r->fd, ee, n, timeout_ms);
+    if (got < 0)
+        return errno == EINTR ? 0 : -1;
+
+    for (i = 0; i < got && out < n; i++) {
+        int fd = ee[i].data.fd;
+
+        if (fd == r->sigfd) {
+            while (out < n && read(r->sigfd, &si, sizeof si) == sizeof si) {
+                ev[out].fd = -1;
+                ev[out].events = REACTOR_SIGNAL;
+                ev[out].signo = si.ssi_signo;
+                out++;
+            }
+            continue;
+        }
+
+        /*
+         * Errors and hangups are passed on as readiness so that the
+         * caller's next read() or write() reports them.
+         */
+        ev[out].fd = fd;
+        ev[out].events = 0;
+        ev[out].signo = 0;
+        if (ee[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            ev[out].events |= REACTOR_READ;
+        if (ee[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            ev[out].events |= REACTOR_WRITE;
+        out++;
+    }
+    return out + reactor_poll_always_ready(r, ev + out, n - out);
+}
+
+#endif
+
+#ifdef __FreeBSD__
+
+int reactor_init(struct reactor *r) {
+    memset(r, 0, sizeof *r);
+    sigemptyset(&r->signals);
+    r->fd = kqueue();
+    return r->fd < 0 ? -1 : 0;
+}
+
+void reactor_close(struct reactor *r) {
+    reactor_common_close(r);
+}
+
+static int reactor_update(struct reactor *r, struct reactor_fd *rfd, int events) {
+    struct kevent kev[2];
+    int nkev = 0;
+    int changed = events ^ (rfd->registered ? rfd->events : 0);
+
+    if (changed & REACTOR_READ) {
+        EV_SET(&kev[nkev], rfd->fd, EVFILT_READ,
+               (events & REACTOR_READ) ? EV_ADD : EV_DELETE, 0, 0, NULL);
+        nkev++;
+    }
+    if (changed & REACTOR_WRITE) {
+        EV_SET(&kev[nkev], rfd->fd, EVFILT_WRITE,
+               (events & REACTOR_WRITE) ? EV_ADD : EV_DELETE, 0, 0, NULL);
+        nkev++;
+    }
+    if (nkev && kevent(r->fd, kev, nkev, NULL, 0, NULL) < 0)
+        return -1;
+    rfd->registered = events != 0;
+    return 0;
+}
+
+int reactor_watch_signals(struct reactor *r, const sigset_t *sigs) {
+    struct kevent kev;
+    int i;
+
+    if (reactor_block_signals(r, sigs) < 0)
+        return -1;
+    /* kqueue still sees signals that are blocked, and never delivers them. */
+    for (i = 1; i < NSIG; i++) {
+        if (sigismember(sigs, i) != 1)
+            continue;
+        EV_SET(&kev, i, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+        if (kevent(r->fd, &kev, 1, NULL, 0, NULL) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int reactor_wait(struct reactor *r, struct reactor_event *ev, int n, int timeout_ms) {
+    struct kevent kev[n];
+    struct timespec ts, *tsp = NULL;
+    int i, got, out = 0;
+
+    if (reactor_have_always_ready(r))
+        timeout_ms = 0;
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        tsp = &ts;
+    }
+    got = kevent(r->fd, NULL, 0, kev, n, tsp);
+    if (got < 0)
+        return errno == EINTR ? 0 : -1;
+
+    for (i = 0; i < got; i++) {
+        ev[out].signo = 0;
+        switch (kev[i].filter) {
+        case EVFILT_SIGNAL:
+            ev[out].fd = -1;
+            ev[out].events = REACTOR_SIGNAL;
+            ev[out].signo = kev[i].ident;
+            break;
+        case EVFILT_READ:
+            ev[out].fd = kev[i].ident;
+            ev[out].events = REACTOR_READ;
+            break;
+        case EVFILT_WRITE:
+            ev[out].fd = kev[i].ident;
+            ev[out].events = REACTOR_WRITE;
+            break;
+        default:
+            continue;
+        }
+        out++;
+    }
+    return out + reactor_poll_always_ready(r, ev + out, n - out);
+}
+
+#endif
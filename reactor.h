@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <signal.h>
+
+/*
+ * A minimal readiness loop over epoll (Linux) or kqueue (FreeBSD).
+ * Interest is level-triggered and set per fd; signals are delivered as
+ * events rather than through handlers.
+ */
+
+#define REACTOR_READ    0x1
+#define REACTOR_WRITE   0x2
+#define REACTOR_SIGNAL  0x4
+
+struct reactor_fd {
+    int fd;
+    int events;
+    int registered;     /* currently known to the kernel */
+    int always_ready;   /* the kernel can't poll it (e.g. a regular file) */
+};
+
+struct reactor {
+    int fd;
+#ifdef __linux__
+    int sigfd;
+#endif
+    sigset_t signals;
+    sigset_t saved_mask;
+
+    struct reactor_fd *fds;
+    int nfds;
+    int allocated;
+};
+
+struct reactor_event {
+    int fd;             /* -1 for signals */
+    int events;
+    int signo;
+};
+
+int reactor_init(struct reactor *r);
+void reactor_close(struct reactor *r);
+/* Set the events we want for fd; 0 stops watching it for now. */
+int reactor_watch(struct reactor *r, int fd, int events);
+void reactor_forget(struct reactor *r, int fd);
+/* Block `sigs` and report them as REACTOR_SIGNAL events instead. */
+int reactor_watch_signals(struct reactor *r, const sigset_t *sigs);
+/*
+ * Wait up to timeout_ms (-1 for ever) and fill in at most n events.
+ * Returns the number of events, 0 on timeout or EINTR, -1 on error.
+ */
+int reactor_wait(struct reactor *r, struct reactor_event *ev, int n, int timeout_ms);
+
+#endif
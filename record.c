@@ -0,0 +1,279 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#ifdef __FreeBSD__
+#include <sys/endian.h>
+#else
+#include <endian.h>
+#endif
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "reptyr.h"
+#include "record.h"
+#include "reallocarray.h"
+
+/* Write out a batch once it gets this big. */
+#define RECORD_BATCH 65536
+
+static unsigned long long elapsed_ms(const struct timespec *since) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000ULL
+        + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static int record_reserve(struct recorder *r, size_t more) {
+    size_t want = r->capacity ? r->capacity : RECORD_BATCH;
+    char *buf;
+
+    if (r->len + more <= r->capacity)
+        return 0;
+    while (want < r->len + more)
+        want *= 2;
+    buf = xreallocarray(r->buf, want, 1);
+    if (!buf)
+        return -1;
+    r->buf = buf;
+    r->capacity = want;
+    return 0;
+}
+
+static int record_write(struct recorder *r, const char *p, size_t len) {
+    ssize_t n;
+
+    while (len) {
+        n = write(r->fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+        r->written += n;
+    }
+    return 0;
+}
+
+static void record_stop(struct recorder *r) {
+    error("Unable to record to %s: %m; recording stopped.", r->path);
+    close(r->fd);
+    r->fd = -1;
+    r->len = 0;
+}
+
+/* Start the next file, and give it its header. */
+static int record_open_file(struct recorder *r) {
+    char path[PATH_MAX], header[128];
+    struct winsize sz = { .ws_row = 24, .ws_col = 80 };
+    int len;
+
+    if (r->generation)
+        snprintf(path, sizeof path, "%s.%u", r->path, r->generation);
+    else
+        snprintf(path, sizeof path, "%s", r->path);
+    r->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (r->fd < 0)
+        return -1;
+    r->written = 0;
+    clock_gettime(CLOCK_MONOTONIC, &r->file_start);
+    debug("Recording to %s", path);
+
+    if (r->format != record_asciicast)
+        return 0;
+    ioctl(0, TIOCGWINSZ, &sz);
+    len = snprintf(header, sizeof header,
+                   "{\"version\": 2, \"width\": %d, \"height\": %d, "
+                   "\"timestamp\": %ld}\n", sz.ws_col, sz.ws_row, (long)time(NULL));
+    return record_write(r, header, len);
+}
+
+static void record_flush(struct recorder *r) {
+    if (r->fd < 0 || !r->len)
+        return;
+    if (record_write(r, r->buf, r->len) < 0) {
+        record_stop(r);
+        return;
+    }
+    r->len = 0;
+}
+
+int record_open(struct recorder *r, const char *path,
+                enum record_format format, size_t rotate_size) {
+    memset(r, 0, sizeof *r);
+    r->path = path;
+    r->format = format;
+    r->rotate_size = rotate_size;
+    if (record_open_file(r) < 0) {
+        if (r->fd >= 0)
+            close(r->fd);
+        r->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void put(struct recorder *r, const char *p, size_t len) {
+    memcpy(r->buf + r->len, p, len);
+    r->len += len;
+}
+
+/*
+ * asciicast stores output as JSON strings, which have to be valid
+ * UTF-8. Anything that isn't is replaced, the way asciinema does it, and
+ * a sequence a read cut in half waits for the rest of it.
+ */
+static void put_escaped(struct recorder *r, const unsigned char *p, size_t len) {
+    static const char replacement[] = "\xef\xbf\xbd";
+    char esc[8];
+    unsigned char c;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        c = p[i];
+        if (r->need) {
+            if ((c & 0xc0) == 0x80) {
+                r->partial[r->npartial++] = c;
+                if (--r->need == 0) {
+                    put(r, (char*)r->partial, r->npartial);
+                    r->npartial = 0;
+                }
+                continue;
+            }
+            put(r, replacement, 3);
+            r->need = r->npartial = 0;
+        }
+        if (c >= 0x80) {
+            if ((c & 0xe0) == 0xc0)
+                r->need = 1;
+            else if ((c & 0xf0) == 0xe0)
+                r->need = 2;
+            else if ((c & 0xf8) == 0xf0)
+                r->need = 3;
+            else
+                put(r, replacement, 3);
+            if (r->need)
+                r->partial[r->npartial++] = c;
+        } else if (c == '"' || c == '\\') {
+            esc[0] = '\\';
+            esc[1] = c;
+            put(r, esc, 2);
+        } else if (c == '\n') {
+            put(r, "\\n", 2);
+        } else if (c == '\r') {
+            put(r, "\\r", 2);
+        } else if (c < 0x20) {
+            snprintf(esc, sizeof esc, "\\u%04x", c);
+            put(r, esc, 6);
+        } else {
+            put(r, (char*)&c, 1);
+        }
+    }
+}
+
+void record_output(struct recorder *r, const char *data, size_t len) {
+    struct timespec now;
+    char prefix[64];
+    uint32_t hdr[3];
+    size_t start;
+    int n;
+
+    if (r->fd < 0 || !len)
+        return;
+    /*
+     * Only move on to the next file once there's something to put in
+     * it, and never in the middle of a batch, whose times are relative
+     * to the current one.
+     */
+    if (r->rotate_size && !r->len && r->written >= r->rotate_size) {
+        close(r->fd);
+        r->generation++;
+        if (record_open_file(r) < 0) {
+            record_stop(r);
+            return;
+        }
+    }
+    /* Worst case, every byte becomes a \u escape. */
+    if (record_reserve(r, len * 6 + sizeof prefix + 4) < 0) {
+        record_flush(r);
+        return;
+    }
+    if (!r->len)
+        clock_gettime(CLOCK_MONOTONIC, &r->pending_since);
+    start = r->len;
+
+    if (r->format == record_ttyrec) {
+        /* ttyrec headers are little-endian wall-clock times. */
+        clock_gettime(CLOCK_REALTIME, &now);
+        hdr[0] = htole32((uint32_t)now.tv_sec);
+        hdr[1] = htole32((uint32_t)(now.tv_nsec / 1000));
+        hdr[2] = htole32((uint32_t)len);
+        put(r, (char*)hdr, sizeof hdr);
+        put(r, data, len);
+    } else {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        n = snprintf(prefix, sizeof prefix, "[%.6f, \"o\", \"",
+                     (now.tv_sec - r->file_start.tv_sec)
+                     + (now.tv_nsec - r->file_start.tv_nsec) / 1e9);
+        put(r, prefix, n);
+        put_escaped(r, (const unsigned char*)data, len);
+        if (r->len == start + n)
+            r->len = start;     /* nothing but half a character */
+        else
+            put(r, "\"]\n", 3);
+    }
+
+    if (r->len >= RECORD_BATCH)
+        record_flush(r);
+}
+
+int record_timeout_ms(struct recorder *r) {
+    unsigned long long waited;
+
+    if (r->fd < 0 || !r->len)
+        return -1;
+    waited = elapsed_ms(&r->pending_since);
+    return waited >= RECORD_DELAY_MS ? 0 : RECORD_DELAY_MS - waited;
+}
+
+void record_tick(struct recorder *r) {
+    if (r->len && elapsed_ms(&r->pending_since) >= RECORD_DELAY_MS)
+        record_flush(r);
+}
+
+void record_close(struct recorder *r) {
+    record_flush(r);
+    if (r->fd >= 0)
+        close(r->fd);
+    r->fd = -1;
+    free(r->buf);
+    r->buf = NULL;
+    r->len = r->capacity = 0;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <sys/types.h>
+#include <time.h>
+
+enum record_format {
+    record_asciicast,   /* asciicast v2, as played back by asciinema */
+    record_ttyrec,      /* ttyrec, as played back by ttyplay */
+};
+
+/*
+ * A recording of everything the proxy shows on stdout. Output is
+ * timestamped as it's read, but only collected in memory, and written
+ * out in batches: once enough of it piles up, or once the oldest of it
+ * has waited RECORD_DELAY_MS. Writing to the file then costs the proxy
+ * loop one write() per batch rather than one per read.
+ */
+struct recorder {
+    enum record_format format;
+    const char *path;
+    int fd;
+    /* Start a new file once the current one has this much; 0 for never. */
+    size_t rotate_size;
+    unsigned generation;
+    size_t written;
+    struct timespec file_start;
+
+    char *buf;
+    size_t len, capacity;
+    struct timespec pending_since;
+
+    /* A UTF-8 sequence split across reads (asciicast only) */
+    unsigned char partial[4];
+    int npartial, need;
+};
+
+#define RECORD_DELAY_MS 200
+
+int record_open(struct recorder *r, const char *path,
+                enum record_format format, size_t rotate_size);
+void record_output(struct recorder *r, const char *data, size_t len);
+/* How long until record_tick needs to run, for reactor_wait. */
+int record_timeout_ms(struct recorder *r);
+void record_tick(struct recorder *r);
+void record_close(struct recorder *r);
+
+#endif
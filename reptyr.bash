@@ -4,10 +4,11 @@ _reptyr()
 {
     case $3 in
         -l|-L|-h|-v) return ;;
+        -r) COMPREPLY=( $(compgen -f -- "$2") ); return ;;
     esac
 
     if [[ $2 == -* ]]; then
-        COMPREPLY=( $(compgen -W '-l -L -s -T -h -v -V' -- "$2") )
+        COMPREPLY=( $(compgen -W '-l -L -s -T -d -r -h -v -V --stop-timeout= --max-stop= --buffer-size= --overflow= --coalesce= --coalesce-size= --pids-from= --jobs= --freeze= --stats --stats=json --record= --record-format= --record-rotate= --socket= --share= --view= --plan --plan-cache= --agent --agent= --use-agent --use-agent=' -- "$2") )
         return
     fi
 
@@ -22,17 +22,23 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
-#include <sys/select.h>
 #include <sys/ioctl.h>
+#include <sys/wait.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 #include <stdarg.h>
 #include <termios.h>
-#include <signal.h>
+#include <getopt.h>
 
 #include "reptyr.h"
+#include "proxy.h"
+#include "daemon.h"
+#include "agent.h"
+#include "stats.h"
+#include "plan.h"
 #include "reallocarray.h"
 #include "platform/platform.h"
 
@@ -74,107 +80,69 @@ void error(const char *msg, ...) {
     va_end(ap);
 }
 
-void setup_raw(struct termios *save) {
+int setup_raw(struct termios *save) {
     struct termios set;
     if (tcgetattr(0, save) < 0) {
-        fprintf(stderr, "Unable to read terminal attributes: %m");
-        return;
+        fprintf(stderr, "Unable to read terminal attributes: %m\n");
+        return -1;
     }
     set = *save;
     cfmakeraw(&set);
     if (tcsetattr(0, TCSANOW, &set) < 0)
         die("Unable to set terminal attributes: %m");
+    return 0;
 }
 
-void resize_pty(int pty) {
-    struct winsize sz;
-    if (ioctl(0, TIOCGWINSZ, &sz) < 0) {
-        // provide fake size to workaround some problems
-        struct winsize defaultsize = {30, 80, 640, 480};
-        if (ioctl(pty, TIOCSWINSZ, &defaultsize) < 0) {
-            fprintf(stderr, "Cannot set terminal size\n");
-        }
-        return;
-    }
-    ioctl(pty, TIOCSWINSZ, &sz);
-}
+/*
+ * Parse a duration like "250ms", "2s" or "1500" (milliseconds) into
+ * milliseconds. Returns 0 on success.
+ */
+int parse_duration_ms(const char *s, long *out) {
+    char *end;
+    long v;
 
-int writeall(int fd, const void *buf, ssize_t count) {
-    ssize_t rv;
-    while (count > 0) {
-        rv = write(fd, buf, count);
-        if (rv < 0) {
-            if (errno == EINTR)
-                continue;
-            return rv;
-        }
-        count -= rv;
-        buf += rv;
-    }
+    errno = 0;
+    v = strtol(s, &end, 10);
+    if (errno || end == s || v < 0)
+        return -1;
+    if (!strcmp(end, "s"))
+        v *= 1000;
+    else if (*end && strcmp(end, "ms"))
+        return -1;
+    *out = v;
     return 0;
 }
 
-volatile sig_atomic_t winch_happened = 0;
-
-void do_winch(int signal) {
-    winch_happened = 1;
-}
+/*
+ * Parse a size like "4096", "64k" or "1M" into bytes. Returns 0 on
+ * success.
+ */
+int parse_size(const char *s, size_t *out) {
+    char *end;
+    unsigned long long v;
 
-void do_proxy(int pty) {
-    char buf[4096];
-    ssize_t count;
-    fd_set set;
-    sigset_t mask;
-    sigset_t select_mask;
-    struct sigaction sa;
-
-    // Block WINCH while we're outside the select, but unblock it
-    // while we're inside:
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGWINCH);
-    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
-        fprintf(stderr, "sigprocmask: %m");
-        return;
-    }
-    sa.sa_handler = do_winch;
-    sa.sa_flags = 0;
-    sigemptyset(&sa.sa_mask);
-    sigaction(SIGWINCH, &sa, NULL);
-    resize_pty(pty);
-
-    while (1) {
-        if (winch_happened) {
-            winch_happened = 0;
-            resize_pty(pty);
-        }
-        FD_ZERO(&set);
-        FD_SET(0, &set);
-        FD_SET(pty, &set);
-        sigemptyset(&select_mask);
-        if (pselect(pty + 1, &set, NULL, NULL, NULL, &select_mask) < 0) {
-            if (errno == EINTR)
-                continue;
-            fprintf(stderr, "select: %m");
-            return;
-        }
-        if (FD_ISSET(0, &set)) {
-            count = read(0, buf, sizeof buf);
-            if (count < 0)
-                return;
-            writeall(pty, buf, count);
-        }
-        if (FD_ISSET(pty, &set)) {
-            count = read(pty, buf, sizeof buf);
-            if (count <= 0)
-                return;
-            writeall(1, buf, count);
-        }
-    }
+    errno = 0;
+    v = strtoull(s, &end, 10);
+    if (errno || end == s || *s == '-')
+        return -1;
+    if (!strcasecmp(end, "k"))
+        v <<= 10;
+    else if (!strcasecmp(end, "m"))
+        v <<= 20;
+    else if (*end)
+        return -1;
+    if (v == 0 || v > (1ULL << 30))
+        return -1;
+    *out = v;
+    return 0;
 }
 
 void usage(char *me) {
-    fprintf(stderr, "Usage: %s [-s] PID\n", me);
+    fprintf(stderr, "Usage: %s [-s] PID...\n", me);
     fprintf(stderr, "       %s -l|-L [COMMAND [ARGS]]\n", me);
+    fprintf(stderr, "       %s -r SOCKET|PID\n", me);
+    fprintf(stderr, "       %s --view=SOCKET\n", me);
+    fprintf(stderr, "       %s --agent[=SOCKET]\n", me);
     fprintf(stderr, "  -l    Create a new pty pair and print the name of the slave.\n");
     fprintf(stderr, "           if there are command-line arguments after -l\n");
     fprintf(stderr, "           they are executed with REPTYR_PTY set to path of pty.\n");
@@ -183,22 +151,253 @@ void usage(char *me) {
     fprintf(stderr, "  -T    Steal the entire terminal session of the target.\n");
     fprintf(stderr, "           [experimental] May be more reliable, and will attach all\n");
     fprintf(stderr, "           processes running on the terminal.\n");
+    fprintf(stderr, "  -d    Don't proxy; leave the pty with a daemon to reattach to later.\n");
+    fprintf(stderr, "  -r    Reattach to a daemon left by -d, given its socket or the\n");
+    fprintf(stderr, "           pid it was started for. Type ^] d to detach again.\n");
     fprintf(stderr, "  -h    Print this help message and exit.\n");
     fprintf(stderr, "  -v    Print the version number and exit.\n");
     fprintf(stderr, "  -V    Print verbose debug output.\n");
+    fprintf(stderr, "  --stop-timeout=TIME\n");
+    fprintf(stderr, "        How long to wait for the target to stop before attaching\n");
+    fprintf(stderr, "           anyway, e.g. 200ms or 2s. Defaults to 1s.\n");
+    fprintf(stderr, "  --max-stop=TIME\n");
+    fprintf(stderr, "        Give up on an attach that keeps the target stopped for longer\n");
+    fprintf(stderr, "           than TIME, e.g. 50ms, and put it back as it was.\n");
+    fprintf(stderr, "  --buffer-size=SIZE\n");
+    fprintf(stderr, "        How much to buffer in each direction, e.g. 4k or 1M.\n");
+    fprintf(stderr, "           Defaults to 64k.\n");
+    fprintf(stderr, "  --overflow=block|drop\n");
+    fprintf(stderr, "        What to do with output once its buffer is full: make the\n");
+    fprintf(stderr, "           target wait (the default) or discard it.\n");
+    fprintf(stderr, "  --coalesce=TIME\n");
+    fprintf(stderr, "        Hold output for up to TIME, e.g. 2ms, to write it in bigger\n");
+    fprintf(stderr, "           pieces. Echo of what's typed is never held. Off by default.\n");
+    fprintf(stderr, "  --coalesce-size=SIZE\n");
+    fprintf(stderr, "        Stop holding output once SIZE has built up. Defaults to 16k.\n");
+    fprintf(stderr, "  --pids-from=FILE\n");
+    fprintf(stderr, "        Also attach the pids listed in FILE, one per line.\n");
+    fprintf(stderr, "  --jobs=N\n");
+    fprintf(stderr, "        With several pids, attach up to N at once. Defaults to 8.\n");
+    fprintf(stderr, "  --freeze=all|target\n");
+    fprintf(stderr, "        Stop every thread of the target while attaching (the\n");
+    fprintf(stderr, "           default), or only the one reptyr works through.\n");
+    fprintf(stderr, "  --stats[=text|json]\n");
+    fprintf(stderr, "        Report how long each attach took, how long the target was\n");
+    fprintf(stderr, "           stopped, and which ptrace requests it needed.\n");
+    fprintf(stderr, "  --record=FILE\n");
+    fprintf(stderr, "        Record everything shown to FILE.\n");
+    fprintf(stderr, "  --record-format=asciicast|ttyrec\n");
+    fprintf(stderr, "        The format to record in. Defaults to asciicast.\n");
+    fprintf(stderr, "  --record-rotate=SIZE\n");
+    fprintf(stderr, "        Continue in FILE.1, FILE.2, ... once FILE reaches SIZE.\n");
+    fprintf(stderr, "  --socket=PATH\n");
+    fprintf(stderr, "        Where -d listens. Defaults to reptyr-PID.sock in\n");
+    fprintf(stderr, "           $XDG_RUNTIME_DIR, or to /tmp/reptyr-UID-PID.sock.\n");
+    fprintf(stderr, "  --share=SOCKET\n");
+    fprintf(stderr, "        Let others watch with --view=SOCKET. Input still only\n");
+    fprintf(stderr, "           comes from this terminal.\n");
+    fprintf(stderr, "  --view=SOCKET\n");
+    fprintf(stderr, "        Watch a session shared with --share. Type ^] d to stop.\n");
+    fprintf(stderr, "  --plan\n");
+    fprintf(stderr, "        Don't attach; say how each pid would be attached, without\n");
+    fprintf(stderr, "           stopping it, and save that for the real run to use.\n");
+    fprintf(stderr, "  --plan-cache=FILE\n");
+    fprintf(stderr, "        Where --plan saves its results. Defaults to reptyr-plan in\n");
+    fprintf(stderr, "           $XDG_RUNTIME_DIR, or to /tmp/reptyr-UID-plan.\n");
+    fprintf(stderr, "  --agent[=SOCKET]\n");
+    fprintf(stderr, "        Stay up and attach for --use-agent, keeping track of the\n");
+    fprintf(stderr, "           process table in between. Defaults to reptyr-agent.sock\n");
+    fprintf(stderr, "           in $XDG_RUNTIME_DIR, or to /tmp/reptyr-UID-agent.sock.\n");
+    fprintf(stderr, "  --use-agent[=SOCKET]\n");
+    fprintf(stderr, "        Have the agent on SOCKET do the attach, then proxy as usual.\n");
+}
+
+static pid_t parse_pid(const char *s) {
+    char *endptr = NULL;
+    errno = 0;
+    long t = strtol(s, &endptr, 10);
+    if (errno == ERANGE)
+        die("Invalid pid: %m");
+    if (endptr == s || *endptr)
+        die("Invalid pid: must be integer");
+    /* check for overflow/underflow */
+    pid_t child = (pid_t)t;
+    if (child < t || t < 1) /* pids can't be < 1, so no *real* underflow check */
+        die("Invalid pid: %s", strerror(ERANGE));
+    return child;
+}
+
+static int open_pty(void) {
+    int pty;
+    if ((pty = get_pt()) < 0)
+        die("Unable to allocate a new pseudo-terminal: %m");
+    if (unlockpt(pty) < 0)
+        die("Unable to unlockpt: %m");
+    if (grantpt(pty) < 0)
+        die("Unable to grantpt: %m");
+    return pty;
+}
+
+struct target {
+    pid_t pid;
+    int pty;
+    int err;
+    pid_t worker;
+    int killed_by;      /* the signal its attach worker died of, if any */
+};
+
+static void add_target(struct target **targets, int *n, pid_t pid) {
+    struct target *t = xreallocarray(*targets, *n + 1, sizeof *t);
+    if (!t)
+        die("Out of memory");
+    *targets = t;
+    memset(&t[*n], 0, sizeof *t);
+    t[*n].pid = pid;
+    t[*n].pty = -1;
+    (*n)++;
+}
+
+static void read_pids(const char *path, struct target **targets, int *n) {
+    char word[64];
+    FILE *f = fopen(path, "r");
+    if (!f)
+        die("Unable to open %s: %m", path);
+    while (fscanf(f, "%63s", word) == 1)
+        add_target(targets, n, parse_pid(word));
+    fclose(f);
+}
+
+/*
+ * Attach every target, running up to `jobs` attaches at once. Each one
+ * happens in a forked worker so it can ptrace and wait on its target
+ * without getting in anyone else's way; its result comes back as the
+ * worker's exit status, or as the signal that killed it if it crashed.
+ * The ptys are opened up front, so the workers only need their names.
+ */
+static void attach_targets(struct target *targets, int n, int force_stdio, int jobs) {
+    int next = 0, running = 0;
+    int status, i;
+    pid_t w;
+
+    if (n == 1) {
+        targets[0].err = attach_child(targets[0].pid, ptsname(targets[0].pty),
+                                      force_stdio);
+        return;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    while (next < n || running) {
+        while (next < n && running < jobs) {
+            struct target *t = &targets[next++];
+            w = fork();
+            if (w < 0) {
+                t->err = errno;
+                continue;
+            }
+            if (w == 0)
+                _exit(attach_child(t->pid, ptsname(t->pty), force_stdio));
+            t->worker = w;
+            running++;
+        }
+        if (!running)
+            break;
+        w = waitpid(-1, &status, 0);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            die("waitpid: %m");
+        }
+        for (i = 0; i < n; i++) {
+            if (targets[i].worker != w)
+                continue;
+            targets[i].worker = 0;
+            if (WIFEXITED(status))
+                targets[i].err = WEXITSTATUS(status);
+            else if (WIFSIGNALED(status))
+                targets[i].killed_by = WTERMSIG(status);
+            running--;
+        }
+    }
 }
 
 int main(int argc, char **argv) {
     struct termios saved_termios;
+    struct proxy_session session = {};
+    struct recorder recorder;
+    const char *record_path = NULL;
+    enum record_format record_format = record_asciicast;
+    size_t record_rotate = 0;
+    const char *socket_path = NULL;
+    const char *reattach = NULL;
+    const char *share_path = NULL;
+    const char *view_path = NULL;
+    int detach = 0;
+    int daemon_fd = -1;
+    struct target *targets = NULL;
+    int ntargets = 0;
+    int failed = 0;
+    int warned_scope = 0;
+    int jobs = 8;
+    int raw;
     int pty;
     int opt;
-    int err;
+    int i;
     int do_attach = 1;
     int force_stdio = 0;
     int do_steal = 0;
+    int do_plan = 0;
+    int do_agent = 0;
+    int use_agent = 0;
+    const char *agent_path = NULL;
     int unattached_script_redirection = 0;
+    enum {
+        OPT_STOP_TIMEOUT = 0x100,
+        OPT_MAX_STOP,
+        OPT_BUFFER_SIZE,
+        OPT_OVERFLOW,
+        OPT_COALESCE,
+        OPT_COALESCE_SIZE,
+        OPT_PIDS_FROM,
+        OPT_JOBS,
+        OPT_FREEZE,
+        OPT_STATS,
+        OPT_RECORD,
+        OPT_RECORD_FORMAT,
+        OPT_RECORD_ROTATE,
+        OPT_SOCKET,
+        OPT_SHARE,
+        OPT_VIEW,
+        OPT_PLAN,
+        OPT_PLAN_CACHE,
+        OPT_AGENT,
+        OPT_USE_AGENT,
+    };
+    static const struct option long_opts[] = {
+        { "stop-timeout", required_argument, NULL, OPT_STOP_TIMEOUT },
+        { "max-stop", required_argument, NULL, OPT_MAX_STOP },
+        { "buffer-size", required_argument, NULL, OPT_BUFFER_SIZE },
+        { "overflow", required_argument, NULL, OPT_OVERFLOW },
+        { "coalesce", required_argument, NULL, OPT_COALESCE },
+        { "coalesce-size", required_argument, NULL, OPT_COALESCE_SIZE },
+        { "pids-from", required_argument, NULL, OPT_PIDS_FROM },
+        { "jobs", required_argument, NULL, OPT_JOBS },
+        { "freeze", required_argument, NULL, OPT_FREEZE },
+        { "stats", optional_argument, NULL, OPT_STATS },
+        { "record", required_argument, NULL, OPT_RECORD },
+        { "record-format", required_argument, NULL, OPT_RECORD_FORMAT },
+        { "record-rotate", required_argument, NULL, OPT_RECORD_ROTATE },
+        { "socket", required_argument, NULL, OPT_SOCKET },
+        { "share", required_argument, NULL, OPT_SHARE },
+        { "view", required_argument, NULL, OPT_VIEW },
+        { "plan", no_argument, NULL, OPT_PLAN },
+        { "plan-cache", required_argument, NULL, OPT_PLAN_CACHE },
+        { "agent", optional_argument, NULL, OPT_AGENT },
+        { "use-agent", optional_argument, NULL, OPT_USE_AGENT },
+        { NULL, 0, NULL, 0 },
+    };
 
-    while ((opt = getopt(argc, argv, "hlLsTvV")) != -1) {
+    while ((opt = getopt_long(argc, argv, "hlLsTvVdr:", long_opts, NULL)) != -1) {
         switch (opt) {
         case 'h':
             usage(argv[0]);
@@ -216,6 +415,12 @@ int main(int argc, char **argv) {
         case 'T':
             do_steal = 1;
             break;
+        case 'd':
+            detach = 1;
+            break;
+        case 'r':
+            reattach = optarg;
+            break;
         case 'v':
             printf("This is reptyr version %s.\n", REPTYR_VERSION);
             printf(" by Nelson Elhage <nelhage@nelhage.com>\n");
@@ -224,6 +429,96 @@ int main(int argc, char **argv) {
         case 'V':
             verbose = 1;
             break;
+        case OPT_STOP_TIMEOUT:
+            if (parse_duration_ms(optarg, &stop_timeout_ms))
+                die("Invalid --stop-timeout: %s", optarg);
+            break;
+        case OPT_MAX_STOP:
+            if (parse_duration_ms(optarg, &max_stop_ms) || max_stop_ms <= 0)
+                die("Invalid --max-stop: %s", optarg);
+            break;
+        case OPT_BUFFER_SIZE:
+            if (parse_size(optarg, &proxy_buffer_size))
+                die("Invalid --buffer-size: %s", optarg);
+            break;
+        case OPT_OVERFLOW:
+            if (!strcmp(optarg, "block"))
+                proxy_drop_output = 0;
+            else if (!strcmp(optarg, "drop"))
+                proxy_drop_output = 1;
+            else
+                die("Invalid --overflow: %s", optarg);
+            break;
+        case OPT_COALESCE:
+            if (parse_duration_ms(optarg, &proxy_coalesce_ms))
+                die("Invalid --coalesce: %s", optarg);
+            break;
+        case OPT_COALESCE_SIZE:
+            if (parse_size(optarg, &proxy_coalesce_size))
+                die("Invalid --coalesce-size: %s", optarg);
+            break;
+        case OPT_PIDS_FROM:
+            read_pids(optarg, &targets, &ntargets);
+            break;
+        case OPT_JOBS:
+            jobs = atoi(optarg);
+            if (jobs < 1)
+                die("Invalid --jobs: %s", optarg);
+            break;
+        case OPT_FREEZE:
+            if (!strcmp(optarg, "all"))
+                freeze_threads = 1;
+            else if (!strcmp(optarg, "target"))
+                freeze_threads = 0;
+            else
+                die("Invalid --freeze: %s", optarg);
+            break;
+        case OPT_STATS:
+            if (!optarg || !strcmp(optarg, "text"))
+                stats_format = stats_text;
+            else if (!strcmp(optarg, "json"))
+                stats_format = stats_json;
+            else
+                die("Invalid --stats: %s", optarg);
+            break;
+        case OPT_RECORD:
+            record_path = optarg;
+            break;
+        case OPT_RECORD_FORMAT:
+            if (!strcmp(optarg, "asciicast"))
+                record_format = record_asciicast;
+            else if (!strcmp(optarg, "ttyrec"))
+                record_format = record_ttyrec;
+            else
+                die("Invalid --record-format: %s", optarg);
+            break;
+        case OPT_RECORD_ROTATE:
+            if (parse_size(optarg, &record_rotate))
+                die("Invalid --record-rotate: %s", optarg);
+            break;
+        case OPT_SOCKET:
+            socket_path = optarg;
+            break;
+        case OPT_SHARE:
+            share_path = optarg;
+            break;
+        case OPT_VIEW:
+            view_path = optarg;
+            break;
+        case OPT_PLAN:
+            do_plan = 1;
+            break;
+        case OPT_PLAN_CACHE:
+            plan_cache_path = optarg;
+            break;
+        case OPT_AGENT:
+            do_agent = 1;
+            agent_path = optarg;
+            break;
+        case OPT_USE_AGENT:
+            use_agent = 1;
+            agent_path = optarg;
+            break;
         default:
             usage(argv[0]);
             return 1;
@@ -231,50 +526,122 @@ int main(int argc, char **argv) {
         if (opt == 'l' || opt == 'L') break; // the rest is a command line
     }
 
-    if (do_attach && optind >= argc) {
-        fprintf(stderr, "%s: No pid specified to attach\n", argv[0]);
-        usage(argv[0]);
-        return 1;
+    /* Nobody looks at a detached session, so there's nothing to record. */
+    if (detach && (record_path || reattach || share_path))
+        die("-d can't be combined with %s",
+            reattach ? "-r" : record_path ? "--record" : "--share");
+    if (view_path && (detach || reattach || share_path))
+        die("--view can't be combined with -d, -r or --share");
+    if (do_plan && (!do_attach || detach || reattach || view_path ||
+                    share_path || record_path))
+        die("--plan only takes pids; it doesn't attach anything");
+    if (do_agent) {
+        int err;
+
+        if (use_agent || do_plan || !do_attach || optind < argc || targets ||
+            detach || reattach || view_path || share_path || record_path)
+            die("--agent takes no pids, and doesn't combine with other modes");
+        if ((err = agent_run(agent_path)))
+            die("Unable to run the agent: %s", strerror(err));
+        return 0;
     }
+    if (use_agent && (do_plan || !do_attach || reattach || view_path))
+        die("--use-agent only takes pids to attach");
+    if (share_path && proxy_share(&session, share_path) < 0)
+        die("Unable to share on %s: %m", share_path);
 
-    if (!do_steal) {
-        if ((pty = get_pt()) < 0)
-            die("Unable to allocate a new pseudo-terminal: %m");
-        if (unlockpt(pty) < 0)
-            die("Unable to unlockpt: %m");
-        if (grantpt(pty) < 0)
-            die("Unable to grantpt: %m");
+    /* Find out about a bad path before we've attached anything. */
+    if (record_path) {
+        if (record_open(&recorder, record_path, record_format, record_rotate) < 0)
+            die("Unable to record to %s: %m", record_path);
+        session.rec = &recorder;
     }
 
-    if (do_attach) {
-        char *endptr = NULL;
-        errno = 0;
-        long t = strtol(argv[optind], &endptr, 10);
-        if (errno == ERANGE)
-            die("Invalid pid: %m");
-        if (*endptr)
-            die("Invalid pid: must be integer");
-        /* check for overflow/underflow */
-        pid_t child = (pid_t)t;
-        if (child < t || t < 1) /* pids can't be < 1, so no *real* underflow check */
-            die("Invalid pid: %s", strerror(ERANGE));
-
-        if (do_steal) {
-            err = steal_pty(child, &pty);
+    if (view_path) {
+        /* The shared output is all that comes over the socket. */
+        if ((daemon_fd = daemon_connect(view_path)) < 0)
+            die("Unable to connect to %s: %m", view_path);
+        if (proxy_add_target(&session, 0, daemon_fd) < 0)
+            die("Out of memory");
+        session.detachable = 1;
+        fprintf(stderr, "Watching %s; type ^] d to stop.\n", view_path);
+    } else if (reattach) {
+        if ((daemon_fd = daemon_reattach(&session, reattach)) < 0)
+            die("Unable to reattach to %s: %m", reattach);
+        session.detachable = 1;
+        fprintf(stderr, "Type ^] d to detach again.\n");
+    } else if (do_attach) {
+        for (i = optind; i < argc; i++)
+            add_target(&targets, &ntargets, parse_pid(argv[i]));
+        if (!ntargets) {
+            fprintf(stderr, "%s: No pid specified to attach\n", argv[0]);
+            usage(argv[0]);
+            return 1;
+        }
+
+        if (do_plan) {
+            struct plan *plans = xreallocarray(NULL, ntargets, sizeof *plans);
+            int err;
+
+            if (!plans)
+                die("Out of memory");
+            for (i = 0; i < ntargets; i++) {
+                if (plan_target(targets[i].pid, &plans[i]))
+                    failed++;
+                plan_print(&plans[i]);
+            }
+            if ((err = plan_cache_store(plans, ntargets)))
+                error("Unable to save the plan: %s", strerror(err));
+            free(plans);
+            return failed ? 1 : 0;
+        }
+
+        if (use_agent) {
+            for (i = 0; i < ntargets; i++)
+                targets[i].err = agent_request(agent_path,
+                                               do_steal ? agent_steal : agent_attach,
+                                               targets[i].pid,
+                                               force_stdio ? AGENT_FORCE_STDIO : 0,
+                                               &targets[i].pty);
+        } else if (do_steal) {
+            for (i = 0; i < ntargets; i++)
+                targets[i].err = steal_pty(targets[i].pid, &targets[i].pty);
         } else {
-            err = attach_child(child, ptsname(pty), force_stdio);
+            for (i = 0; i < ntargets; i++)
+                targets[i].pty = open_pty();
+            attach_targets(targets, ntargets, force_stdio, jobs);
         }
-        if (err) {
-            fprintf(stderr, "Unable to attach to pid %d: %s\n", child, strerror(err));
-            if (err == EPERM) {
-                check_ptrace_scope();
+
+        for (i = 0; i < ntargets; i++) {
+            struct target *t = &targets[i];
+            if (t->err || t->killed_by) {
+                if (t->killed_by)
+                    fprintf(stderr, "Unable to attach to pid %d: attach worker died of %s\n",
+                            t->pid, strsignal(t->killed_by));
+                else
+                    fprintf(stderr, "Unable to attach to pid %d: %s\n", t->pid,
+                            strerror(t->err));
+                if (t->err == EPERM && !warned_scope++)
+                    check_ptrace_scope();
+                failed++;
+                if (t->pty >= 0)
+                    close(t->pty);
+                continue;
             }
-            return 1;
+            if (ntargets > 1)
+                fprintf(stderr, "Attached pid %d to %s\n", t->pid, ptsname(t->pty));
+            if (proxy_add_target(&session, t->pid, t->pty) < 0)
+                die("Out of memory");
         }
+        if (!session.ntargets)
+            return 1;
+        if (session.ntargets > 1)
+            fprintf(stderr, "Type ^] and a number to choose which one gets input.\n");
     } else {
+        pty = open_pty();
         printf("Opened a new pty: %s\n", ptsname(pty));
         fflush(stdout);
-        if (argc > 2) {
+        if (optind < argc) {
             if (!fork()) {
                 setenv("REPTYR_PTY", ptsname(pty), 1);
                 if (unattached_script_redirection) {
@@ -290,19 +657,38 @@ int main(int argc, char **argv) {
                     close(f);
                 }
                 close(pty);
-                execvp(argv[2], argv + 2);
+                execvp(argv[optind], argv + optind);
                 exit(1);
             }
         }
+        if (proxy_add_target(&session, 0, pty) < 0)
+            die("Out of memory");
+    }
+
+    if (detach) {
+        int err = daemon_detach(&session, socket_path);
+        if (err)
+            die("Unable to detach: %s", strerror(err));
+        return failed ? 1 : 0;
     }
 
-    setup_raw(&saved_termios);
-    do_proxy(pty);
-    do {
+    raw = setup_raw(&saved_termios) == 0;
+    do_proxy(&session);
+    if (session.rec)
+        record_close(session.rec);
+    while (raw) {
         errno = 0;
-        if (tcsetattr(0, TCSANOW, &saved_termios) && errno != EINTR)
+        if (tcsetattr(0, TCSANOW, &saved_termios) == 0)
+            break;
+        if (errno != EINTR)
             die("Unable to tcsetattr: %m");
-    } while (errno == EINTR);
+    }
+    proxy_report(&session);
+    proxy_unshare(&session);
+    if (session.detached && reattach)
+        fprintf(stderr, "Detached; reattach with: reptyr -r %s\n", reattach);
+    if (daemon_fd >= 0)
+        close(daemon_fd);
 
-    return 0;
+    return failed ? 1 : 0;
 }
@@ -30,6 +30,22 @@
         })
 
 int attach_child(pid_t pid, const char *pty, int force_stdio);
+/*
+ * attach_child, working from a process table the caller keeps (and
+ * brings up to date first) instead of building one for each attach.
+ */
+struct proc_table;
+int attach_child_procs(pid_t pid, const char *pty, int force_stdio,
+                       struct proc_table *procs);
+/* How long attach_child waits for the target to stop, in ms. */
+extern long stop_timeout_ms;
+/*
+ * With --max-stop, the most time in ms the target may spend stopped
+ * under our control before we undo what we've done and let it go.
+ */
+extern long max_stop_ms;
+/* Whether to stop all of the target's threads while we work on it. */
+extern int freeze_threads;
 int steal_pty(pid_t pid, int *pty);
 #define __printf __attribute__((format(printf, 1, 2)))
 void __printf die(const char *msg, ...) __attribute__((noreturn));
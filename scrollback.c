@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "scrollback.h"
+
+int scrollback_init(struct scrollback *sb, size_t size) {
+    size_t n = 1;
+
+    while (n < size)
+        n <<= 1;
+    memset(sb, 0, sizeof *sb);
+    if (!(sb->buf = malloc(n)))
+        return -1;
+    sb->size = n;
+    return 0;
+}
+
+void scrollback_free(struct scrollback *sb) {
+    free(sb->buf);
+    sb->buf = NULL;
+}
+
+void scrollback_append(struct scrollback *sb, const char *p, size_t len) {
+    size_t off, chunk;
+
+    /* Only the last ring's worth of a big write would survive anyway. */
+    if (len > sb->size) {
+        sb->head += len - sb->size;
+        p += len - sb->size;
+        len = sb->size;
+    }
+    while (len) {
+        off = sb->head & (sb->size - 1);
+        chunk = sb->size - off;
+        if (chunk > len)
+            chunk = len;
+        memcpy(sb->buf + off, p, chunk);
+        sb->head += chunk;
+        p += chunk;
+        len -= chunk;
+    }
+}
+
+unsigned long long scrollback_oldest(struct scrollback *sb) {
+    return sb->head > sb->size ? sb->head - sb->size : 0;
+}
+
+unsigned long long scrollback_catch_up(struct scrollback *sb,
+                                       unsigned long long *cursor) {
+    unsigned long long oldest = scrollback_oldest(sb), missed = 0;
+
+    if (*cursor < oldest) {
+        missed = oldest - *cursor;
+        *cursor = oldest;
+    }
+    if (*cursor > sb->head)
+        *cursor = sb->head;
+    return missed;
+}
+
+int scrollback_iov(struct scrollback *sb, unsigned long long cursor,
+                   struct iovec iov[2]) {
+    size_t len = sb->head - cursor;
+    size_t off = cursor & (sb->size - 1);
+    size_t first = sb->size - off;
+
+    if (!len)
+        return 0;
+    if (first >= len) {
+        iov[0].iov_base = sb->buf + off;
+        iov[0].iov_len = len;
+        return 1;
+    }
+    iov[0].iov_base = sb->buf + off;
+    iov[0].iov_len = first;
+    iov[1].iov_base = sb->buf;
+    iov[1].iov_len = len - first;
+    return 2;
+}
+
+ssize_t scrollback_write(struct scrollback *sb, int fd,
+                         unsigned long long *cursor) {
+    struct iovec iov[2];
+    ssize_t n;
+    int cnt;
+
+    scrollback_catch_up(sb, cursor);
+    if (!(cnt = scrollback_iov(sb, *cursor, iov)))
+        return 0;
+    n = writev(fd, iov, cnt);
+    if (n > 0)
+        *cursor += n;
+    return n;
+}
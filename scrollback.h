@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef SCROLLBACK_H
+#define SCROLLBACK_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * The most recent output from a pty, in a fixed-size ring. There's one
+ * writer, which appends and never waits: once the ring is full, the
+ * oldest output is overwritten. Readers each keep their own cursor, an
+ * offset into everything ever appended, and are handed iovecs pointing
+ * straight into the ring instead of copies; a reader that falls more
+ * than a ring's worth behind skips ahead to the oldest output left.
+ */
+struct scrollback {
+    char *buf;
+    size_t size;                /* a power of two */
+    unsigned long long head;    /* bytes appended so far */
+};
+
+int scrollback_init(struct scrollback *sb, size_t size);
+void scrollback_free(struct scrollback *sb);
+void scrollback_append(struct scrollback *sb, const char *p, size_t len);
+/* The cursor of the oldest byte still in the ring. */
+unsigned long long scrollback_oldest(struct scrollback *sb);
+/*
+ * Move a cursor that fell behind up to the oldest byte we still have,
+ * and return how many it missed.
+ */
+unsigned long long scrollback_catch_up(struct scrollback *sb,
+                                       unsigned long long *cursor);
+/*
+ * Point iov (at most two entries) at everything from cursor on, and
+ * return how many entries were used.
+ */
+int scrollback_iov(struct scrollback *sb, unsigned long long cursor,
+                   struct iovec iov[2]);
+/*
+ * writev() what fd hasn't seen yet and advance its cursor past what was
+ * written. Returns the bytes written, or -1 with errno set.
+ */
+ssize_t scrollback_write(struct scrollback *sb, int fd,
+                         unsigned long long *cursor);
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ptrace.h"
+#include "stats.h"
+
+enum stats_format stats_format;
+
+static const char *phase_names[stats_nphases] = {
+    [stats_preflight]      = "preflight",
+    [stats_copy_tty_state] = "copy_tty_state",
+    [stats_wait_for_stop]  = "wait_for_stop",
+    [stats_grab_pid]       = "grab_pid",
+    [stats_critical]       = "critical",
+    [stats_ignore_hup]     = "ignore_hup",
+    [stats_detach]         = "detach",
+};
+
+static const char *request_names[ptrace_stat_max] = {
+    [ptrace_stat_peekdata]   = "peekdata",
+    [ptrace_stat_pokedata]   = "pokedata",
+    [ptrace_stat_peekuser]   = "peekuser",
+    [ptrace_stat_pokeuser]   = "pokeuser",
+    [ptrace_stat_getregs]    = "getregs",
+    [ptrace_stat_setregs]    = "setregs",
+    [ptrace_stat_syscall]    = "syscall",
+    [ptrace_stat_cont]       = "cont",
+    [ptrace_stat_attach]     = "attach",
+    [ptrace_stat_detach]     = "detach",
+    [ptrace_stat_other]      = "other",
+    [ptrace_stat_wait]       = "waitpid",
+    [ptrace_stat_bulk_read]  = "bulk_read",
+    [ptrace_stat_bulk_write] = "bulk_write",
+};
+
+struct phase {
+    unsigned count;
+    /* Relative to stats_begin */
+    unsigned long long first;
+    unsigned long long total;
+    unsigned long long entered;
+};
+
+static struct {
+    pid_t pid;
+    unsigned long long begin;
+    struct phase phases[stats_nphases];
+    unsigned long long stopped_at;
+    unsigned long long stopped;
+} stats;
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_begin(pid_t pid) {
+    if (!stats_format)
+        return;
+    memset(&stats, 0, sizeof stats);
+    memset(&ptrace_stats, 0, sizeof ptrace_stats);
+    stats.pid = pid;
+    stats.begin = now_ns();
+}
+
+void stats_enter(enum stats_phase phase) {
+    struct phase *p = &stats.phases[phase];
+
+    if (!stats_format)
+        return;
+    p->entered = now_ns();
+    if (!p->count++)
+        p->first = p->entered - stats.begin;
+}
+
+void stats_leave(enum stats_phase phase) {
+    struct phase *p = &stats.phases[phase];
+
+    if (!stats_format || !p->entered)
+        return;
+    p->total += now_ns() - p->entered;
+    p->entered = 0;
+}
+
+void stats_target_stopped(void) {
+    if (stats_format && !stats.stopped_at)
+        stats.stopped_at = now_ns();
+}
+
+void stats_target_resumed(void) {
+    if (!stats_format || !stats.stopped_at)
+        return;
+    stats.stopped += now_ns() - stats.stopped_at;
+    stats.stopped_at = 0;
+}
+
+/*
+ * Each report goes out in a single write(2): attaches run in parallel
+ * workers, and stderr is unbuffered, so printing it piece by piece would
+ * let their reports interleave.
+ */
+static struct {
+    char buf[4096];
+    size_t len;
+} out;
+
+static void __attribute__((format(printf, 1, 2))) put(const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(out.buf + out.len, sizeof out.buf - out.len, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        out.len += n;
+    if (out.len >= sizeof out.buf)
+        out.len = sizeof out.buf - 1;
+}
+
+static void flush_report(void) {
+    size_t off = 0;
+    ssize_t n;
+
+    while (off < out.len) {
+        n = write(STDERR_FILENO, out.buf + off, out.len - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        off += n;
+    }
+    out.len = 0;
+}
+
+static void report_json(int err, unsigned long long elapsed) {
+    struct phase *p;
+    int i;
+
+    put("{\"pid\":%d,\"error\":%d,\"elapsed_ns\":%llu,"
+            "\"stopped_ns\":%llu,\"phases\":{",
+            (int)stats.pid, err, elapsed, stats.stopped);
+    for (i = 0; i < stats_nphases; i++) {
+        p = &stats.phases[i];
+        put("%s\"%s\":{\"count\":%u,\"start_ns\":%llu,\"ns\":%llu}",
+                i ? "," : "", phase_names[i], p->count, p->first, p->total);
+    }
+    put("},\"remote_syscalls\":{\"count\":%lu,\"round_trips\":%lu,"
+            "\"ns\":%llu},\"requests\":{",
+            ptrace_stats.remote_syscalls, ptrace_stats.remote_batches,
+            ptrace_stats.remote_ns);
+    for (i = 0; i < ptrace_stat_max; i++)
+        put("%s\"%s\":%lu", i ? "," : "", request_names[i],
+                ptrace_stats.requests[i]);
+    put("}}\n");
+}
+
+static void report_text(int err, unsigned long long elapsed) {
+    struct phase *p;
+    int i;
+
+    put("[=] pid %d: %s in %.3fms, stopped for %.3fms\n",
+            (int)stats.pid, err ? strerror(err) : "attached",
+            elapsed / 1e6, stats.stopped / 1e6);
+    for (i = 0; i < stats_nphases; i++) {
+        p = &stats.phases[i];
+        if (!p->count)
+            continue;
+        put("[=]   %-16s at %8.3fms took %8.3fms",
+                phase_names[i], p->first / 1e6, p->total / 1e6);
+        if (p->count > 1)
+            put(" (%u times)", p->count);
+        put("\n");
+    }
+    put("[=]   %lu remote syscalls in %lu round trips, %.3fms\n",
+            ptrace_stats.remote_syscalls, ptrace_stats.remote_batches,
+            ptrace_stats.remote_ns / 1e6);
+    put("[=]  ");
+    for (i = 0; i < ptrace_stat_max; i++)
+        if (ptrace_stats.requests[i])
+            put(" %s=%lu", request_names[i], ptrace_stats.requests[i]);
+    put("\n");
+}
+
+void stats_report(int err) {
+    unsigned long long elapsed;
+
+    if (!stats_format)
+        return;
+    elapsed = now_ns() - stats.begin;
+    if (stats_format == stats_json)
+        report_json(err, elapsed);
+    else
+        report_text(err, elapsed);
+    flush_report();
+}
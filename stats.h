@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef STATS_H
+#define STATS_H
+
+#include <sys/types.h>
+
+/*
+ * Where an attach spends its time. Each phase may run more than once
+ * (-T grabs two processes, for instance); we keep when it first started
+ * and how long it took altogether.
+ */
+enum stats_phase {
+    stats_preflight = 0,
+    stats_copy_tty_state,
+    stats_wait_for_stop,
+    stats_grab_pid,
+    /* From grabbing an attach's target to letting go of it */
+    stats_critical,
+    stats_ignore_hup,
+    stats_detach,
+    stats_nphases
+};
+
+enum stats_format {
+    stats_off = 0,
+    stats_text,
+    stats_json
+};
+
+/* Set by --stats. */
+extern enum stats_format stats_format;
+
+void stats_begin(pid_t pid);
+void stats_enter(enum stats_phase phase);
+void stats_leave(enum stats_phase phase);
+/* Bracket the time the target can't run. */
+void stats_target_stopped(void);
+void stats_target_resumed(void);
+/* Print what we collected since stats_begin to stderr. */
+void stats_report(int err);
+
+#endif
@@ -0,0 +1,46 @@
+import os
+import pexpect
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+log = getattr(sys.stdout, "buffer", sys.stdout)
+
+sock = os.path.join(tempfile.mkdtemp(), "agent.sock")
+agent = subprocess.Popen(["./reptyr", "--agent=" + sock])
+for i in range(50):
+    if os.path.exists(sock):
+        break
+    time.sleep(0.1)
+assert os.path.exists(sock)
+
+for args in [[], ["-T"]]:
+    child = pexpect.spawn("test/victim")
+    child.setecho(False)
+    child.sendline("hello")
+    child.expect("ECHO: hello")
+
+    reptyr = pexpect.spawn("./reptyr", ["--use-agent=" + sock] + args +
+                           [str(child.pid)])
+    reptyr.logfile = log
+    reptyr.sendline("world")
+    reptyr.expect("ECHO: world")
+
+    # We hold the master the agent sent over.
+    fds = os.listdir("/proc/%d/fd" % reptyr.pid)
+    assert "/dev/ptmx" in [os.readlink("/proc/%d/fd/%s" % (reptyr.pid, fd))
+                           for fd in fds]
+
+    reptyr.sendeof()
+    reptyr.expect(pexpect.EOF)
+
+# Failures come back from the agent, too.
+out = subprocess.run(["./reptyr", "--use-agent=" + sock, "999999"],
+                     stderr=subprocess.PIPE, stdin=subprocess.DEVNULL)
+assert out.returncode != 0
+
+agent.send_signal(signal.SIGTERM)
+agent.wait(timeout=5)
+assert not os.path.exists(sock)
@@ -0,0 +1,573 @@
+/*
+ * Benchmarks for reptyr: how long attaches take and how long they keep
+ * the target stopped, for targets with more fds, threads, or processes in
+ * their session, and how fast and how responsive the proxy is once
+ * attached. Results go to stdout as one JSON object per line, so runs
+ * from different commits can be compared mechanically.
+ *
+ * Each attach gets a fresh victim: a "shell" that leads a session on a
+ * new pty, some idle jobs in their own process groups, and the target
+ * in the foreground. reptyr runs with pipes for stdin and stdout, and
+ * the target answers commands sent through it:
+ *
+ *   ping N     reply "pong N"
+ *   rate B     write B bytes/s of filler in the background (0 to stop)
+ *   burst B    write B bytes of filler, then "done"
+ *   quit       exit, which makes reptyr exit too
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+
+#ifndef PR_SET_PTRACER
+#define PR_SET_PTRACER 0x59616d61
+#endif
+
+#ifndef PR_SET_PTRACER_ANY
+# define PR_SET_PTRACER_ANY ((unsigned long)-1)
+#endif
+#endif
+#ifdef __FreeBSD__
+#include <sys/procctl.h>
+#endif
+
+#define TIMEOUT_MS 10000
+#define MAX_LIST 16
+#define FILLER_LINE 64
+
+static const char *reptyr_path = "./reptyr";
+static char *reptyr_args[MAX_LIST];
+static int nreptyr_args;
+
+static void die(const char *msg, ...) __attribute__((noreturn, format(printf, 1, 2)));
+static void die(const char *msg, ...) {
+    va_list ap;
+    va_start(ap, msg);
+    fprintf(stderr, "bench: ");
+    vfprintf(stderr, msg, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    exit(1);
+}
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* The target. */
+
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile unsigned long out_rate;
+
+static void write_out(const char *buf, size_t len) {
+    ssize_t n;
+
+    pthread_mutex_lock(&out_lock);
+    while (len) {
+        n = write(1, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            _exit(1);
+        }
+        buf += n;
+        len -= n;
+    }
+    pthread_mutex_unlock(&out_lock);
+}
+
+static void write_filler(unsigned long bytes) {
+    char buf[FILLER_LINE * 64];
+    size_t n;
+
+    memset(buf, '.', sizeof buf);
+    for (n = FILLER_LINE - 1; n < sizeof buf; n += FILLER_LINE)
+        buf[n] = '\n';
+    bytes -= bytes % FILLER_LINE;
+    while (bytes) {
+        n = bytes < sizeof buf ? bytes : sizeof buf;
+        write_out(buf, n);
+        bytes -= n;
+    }
+}
+
+static void *idle_thread(void *arg) {
+    struct timespec ms = { 0, 1000000 };
+
+    while (1)
+        nanosleep(&ms, NULL);
+    return NULL;
+}
+
+static void *rate_thread(void *arg) {
+    struct timespec ms = { 0, 1000000 };
+    unsigned long long start = 0, sent = 0, due;
+    unsigned long rate = 0;
+
+    while (1) {
+        nanosleep(&ms, NULL);
+        if (out_rate != rate) {
+            rate = out_rate;
+            start = now_ns();
+            sent = 0;
+        }
+        if (!rate)
+            continue;
+        due = (now_ns() - start) * rate / 1000000000ULL;
+        if (due >= sent + FILLER_LINE) {
+            write_filler(due - sent);
+            sent = due - due % FILLER_LINE;
+        }
+    }
+    return NULL;
+}
+
+/* Make sure nothing we leave running outlives us. */
+static void die_with_parent(void) {
+#ifdef __linux__
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+#elif defined(__FreeBSD__)
+    int sig = SIGKILL;
+    procctl(P_PID, 0, PROC_PDEATHSIG_CTL, &sig);
+#endif
+}
+
+static void run_target(int fds, int threads, int ready) {
+    char line[128], reply[64];
+    pthread_t t;
+    pid_t pid = getpid();
+    int i;
+
+#ifdef __linux__
+    prctl(PR_SET_PTRACER, PR_SET_PTRACER_ANY);
+#endif
+    for (i = 0; i < fds; i++)
+        if (open("/dev/null", O_RDONLY) < 0)
+            die("open: %m");
+    for (i = 1; i < threads; i++)
+        if (pthread_create(&t, NULL, idle_thread, NULL))
+            die("pthread_create failed");
+    if (pthread_create(&t, NULL, rate_thread, NULL))
+        die("pthread_create failed");
+
+    if (write(ready, &pid, sizeof pid) != sizeof pid)
+        _exit(1);
+    close(ready);
+
+    while (fgets(line, sizeof line, stdin)) {
+        if (!strncmp(line, "ping ", 5)) {
+            snprintf(reply, sizeof reply, "pong %s", line + 5);
+            write_out(reply, strlen(reply));
+        } else if (!strncmp(line, "rate ", 5)) {
+            out_rate = strtoul(line + 5, NULL, 10);
+        } else if (!strncmp(line, "burst ", 6)) {
+            write_filler(strtoul(line + 6, NULL, 10));
+            write_out("done\n", 5);
+        } else if (!strncmp(line, "quit", 4)) {
+            break;
+        }
+    }
+    _exit(0);
+}
+
+struct victim {
+    pid_t shell;
+    pid_t target;
+    int master;
+};
+
+/*
+ * The shell: lead a session on the pty, start `jobs` idle jobs and then
+ * the target in the foreground, and wait to be killed.
+ */
+static void run_shell(const char *slave, int fds, int threads, int jobs,
+                      int ready) {
+    pid_t pid;
+    int fd, i;
+
+    setsid();
+    if ((fd = open(slave, O_RDWR)) < 0)
+        die("open %s: %m", slave);
+    ioctl(fd, TIOCSCTTY, 0);
+    dup2(fd, 0);
+    dup2(fd, 1);
+    dup2(fd, 2);
+    if (fd > 2)
+        close(fd);
+    signal(SIGTTOU, SIG_IGN);
+
+    for (i = 0; i < jobs; i++) {
+        if ((pid = fork()) == 0) {
+            die_with_parent();
+            setpgid(0, 0);
+            close(ready);
+            while (1)
+                pause();
+        }
+        setpgid(pid, pid);
+    }
+
+    if ((pid = fork()) == 0) {
+        setpgid(0, 0);
+        tcsetpgrp(0, getpid());
+        signal(SIGTTOU, SIG_DFL);
+        run_target(fds, threads, ready);
+    }
+    setpgid(pid, pid);
+    tcsetpgrp(0, pid);
+    close(ready);
+    while (1)
+        pause();
+}
+
+static void spawn_victim(struct victim *v, int fds, int threads, int jobs) {
+    struct termios tio;
+    char slave[64];
+    int ready[2];
+
+    if ((v->master = posix_openpt(O_RDWR | O_NOCTTY)) < 0 ||
+        grantpt(v->master) < 0 || unlockpt(v->master) < 0 ||
+        ptsname_r(v->master, slave, sizeof slave))
+        die("Unable to open a pty: %m");
+    tcgetattr(v->master, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(v->master, TCSANOW, &tio);
+
+    if (pipe(ready) < 0)
+        die("pipe: %m");
+    if ((v->shell = fork()) == 0) {
+        close(ready[0]);
+        close(v->master);
+        run_shell(slave, fds, threads, jobs, ready[1]);
+    }
+    close(ready[1]);
+    if (read(ready[0], &v->target, sizeof v->target) != sizeof v->target)
+        die("The victim didn't start");
+    close(ready[0]);
+}
+
+static void reap_victim(struct victim *v) {
+    kill(v->target, SIGKILL);
+    kill(v->shell, SIGKILL);
+    waitpid(v->shell, NULL, 0);
+    close(v->master);
+}
+
+/* reptyr, and talking to the target through it. */
+
+struct reader {
+    int fd;
+    char buf[65536];
+    size_t len;
+};
+
+struct reptyr {
+    pid_t pid;
+    int in;
+    struct reader out, err;
+};
+
+static void spawn_reptyr(struct reptyr *r, pid_t target) {
+    char *argv[MAX_LIST + 4], pidbuf[16];
+    int in[2], out[2], err[2];
+    int i, n = 0;
+
+    argv[n++] = (char*)reptyr_path;
+    argv[n++] = "--stats=json";
+    for (i = 0; i < nreptyr_args; i++)
+        argv[n++] = reptyr_args[i];
+    snprintf(pidbuf, sizeof pidbuf, "%d", (int)target);
+    argv[n++] = pidbuf;
+    argv[n] = NULL;
+
+    if (pipe(in) < 0 || pipe(out) < 0 || pipe(err) < 0)
+        die("pipe: %m");
+    if ((r->pid = fork()) == 0) {
+        dup2(in[0], 0);
+        dup2(out[1], 1);
+        dup2(err[1], 2);
+        for (i = 3; i < 1024; i++)
+            close(i);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    close(err[1]);
+    r->in = in[1];
+    memset(&r->out, 0, sizeof r->out);
+    memset(&r->err, 0, sizeof r->err);
+    r->out.fd = out[0];
+    r->err.fd = err[0];
+}
+
+static void finish_reptyr(struct reptyr *r) {
+    close(r->in);
+    close(r->out.fd);
+    close(r->err.fd);
+    waitpid(r->pid, NULL, 0);
+}
+
+static void send_line(struct reptyr *r, const char *fmt, ...) {
+    char buf[128];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf, sizeof buf, fmt, ap);
+    va_end(ap);
+    if (write(r->in, buf, n) != n)
+        die("Writing to reptyr: %m");
+}
+
+/*
+ * Read lines from rd until one starts with `prefix`, throwing away any
+ * others (filler, mostly), and copy it to `line`. Returns 0 on success,
+ * or -1 on EOF or timeout.
+ */
+static int expect_line(struct reader *rd, const char *prefix,
+                       char *line, size_t size) {
+    struct pollfd pfd = { rd->fd, POLLIN, 0 };
+    char *nl;
+    size_t len;
+    ssize_t n;
+
+    while (1) {
+        while ((nl = memchr(rd->buf, '\n', rd->len)) != NULL) {
+            len = nl - rd->buf + 1;
+            if (!strncmp(rd->buf, prefix, strlen(prefix))) {
+                snprintf(line, size, "%.*s", (int)len, rd->buf);
+                memmove(rd->buf, rd->buf + len, rd->len - len);
+                rd->len -= len;
+                return 0;
+            }
+            memmove(rd->buf, rd->buf + len, rd->len - len);
+            rd->len -= len;
+        }
+        if (rd->len == sizeof rd->buf)
+            rd->len = 0;
+        if (poll(&pfd, 1, TIMEOUT_MS) <= 0)
+            return -1;
+        n = read(rd->fd, rd->buf + rd->len, sizeof rd->buf - rd->len);
+        if (n <= 0)
+            return -1;
+        rd->len += n;
+    }
+}
+
+static unsigned long long json_field(const char *json, const char *name) {
+    char key[64];
+    const char *p;
+
+    snprintf(key, sizeof key, "\"%s\":", name);
+    if ((p = strstr(json, key)) == NULL)
+        return 0;
+    return strtoull(p + strlen(key), NULL, 10);
+}
+
+/* Summaries */
+
+struct sample {
+    unsigned long long *v;
+    int n;
+};
+
+static int cmp_ull(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long*)a;
+    unsigned long long y = *(const unsigned long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void print_sample(const char *name, struct sample *s) {
+    unsigned long long sum = 0;
+    int i;
+
+    if (!s->n) {
+        printf(",\"%s\":null", name);
+        return;
+    }
+    qsort(s->v, s->n, sizeof *s->v, cmp_ull);
+    for (i = 0; i < s->n; i++)
+        sum += s->v[i];
+    printf(",\"%s\":{\"min\":%llu,\"median\":%llu,\"mean\":%llu,"
+           "\"p99\":%llu,\"max\":%llu}", name, s->v[0], s->v[s->n / 2],
+           sum / s->n, s->v[(s->n * 99) / 100], s->v[s->n - 1]);
+}
+
+/*
+ * Attach to `iters` fresh victims and report how long reptyr took to
+ * start forwarding input, and what it says about its attach.
+ */
+static void bench_attach(int iters, int fds, int threads, int jobs) {
+    unsigned long long w[iters], e[iters], st[iters], start;
+    struct sample wall = { w, 0 }, elapsed = { e, 0 }, stopped = { st, 0 };
+    struct victim v;
+    struct reptyr r;
+    char line[4096];
+    int i, failed = 0;
+
+    for (i = 0; i < iters; i++) {
+        spawn_victim(&v, fds, threads, jobs);
+        start = now_ns();
+        spawn_reptyr(&r, v.target);
+        send_line(&r, "ping %d\n", i);
+        if (expect_line(&r.out, "pong", line, sizeof line) < 0) {
+            failed++;
+            kill(r.pid, SIGTERM);
+        } else {
+            w[wall.n++] = now_ns() - start;
+            if (expect_line(&r.err, "{", line, sizeof line) == 0) {
+                e[elapsed.n++] = json_field(line, "elapsed_ns");
+                st[stopped.n++] = json_field(line, "stopped_ns");
+            }
+            send_line(&r, "quit\n");
+        }
+        finish_reptyr(&r);
+        reap_victim(&v);
+    }
+
+    printf("{\"bench\":\"attach\",\"fds\":%d,\"threads\":%d,\"jobs\":%d,"
+           "\"iterations\":%d,\"failed\":%d", fds, threads, jobs, iters, failed);
+    print_sample("ready_ns", &wall);
+    print_sample("attach_ns", &elapsed);
+    print_sample("stopped_ns", &stopped);
+    printf("}\n");
+    fflush(stdout);
+}
+
+/*
+ * Measure how fast output gets through the proxy, and how long a
+ * keystroke takes to come back while the target is writing `rate`
+ * bytes/s in the background.
+ */
+static void bench_proxy(int pings, unsigned long burst, unsigned long rate) {
+    unsigned long long l[pings], start, took = 0;
+    struct sample latency = { l, 0 };
+    struct victim v;
+    struct reptyr r;
+    char line[128];
+    int i, failed = 0;
+
+    spawn_victim(&v, 0, 1, 0);
+    spawn_reptyr(&r, v.target);
+    send_line(&r, "ping -1\n");
+    if (expect_line(&r.out, "pong", line, sizeof line) < 0)
+        die("Unable to attach with %s", reptyr_path);
+
+    if (burst) {
+        start = now_ns();
+        send_line(&r, "burst %lu\n", burst);
+        if (expect_line(&r.out, "done", line, sizeof line) == 0)
+            took = now_ns() - start;
+        else
+            failed++;
+    }
+
+    send_line(&r, "rate %lu\n", rate);
+    for (i = 0; i < pings; i++) {
+        start = now_ns();
+        send_line(&r, "ping %d\n", i);
+        if (expect_line(&r.out, "pong", line, sizeof line) < 0) {
+            failed++;
+            break;
+        }
+        l[latency.n++] = now_ns() - start;
+    }
+    send_line(&r, "quit\n");
+    finish_reptyr(&r);
+    reap_victim(&v);
+
+    printf("{\"bench\":\"proxy\",\"rate\":%lu,\"burst\":%lu,\"failed\":%d,"
+           "\"burst_ns\":%llu,\"throughput\":%llu", rate, burst, failed,
+           took, took ? burst * 1000000000ULL / took : 0);
+    print_sample("latency_ns", &latency);
+    printf("}\n");
+    fflush(stdout);
+}
+
+static int parse_list(char *s, unsigned long *out) {
+    char *tok, *save = NULL;
+    int n = 0;
+
+    for (tok = strtok_r(s, ",", &save); tok && n < MAX_LIST;
+         tok = strtok_r(NULL, ",", &save))
+        out[n++] = strtoul(tok, NULL, 10);
+    return n;
+}
+
+static void usage(const char *me) {
+    fprintf(stderr, "Usage: %s [-r REPTYR] [-a ARG]... [-n ITERATIONS]\n"
+            "          [-f FDS,...] [-t THREADS,...] [-j JOBS,...]\n"
+            "          [-p PINGS] [-b BURST] [-R RATE,...]\n", me);
+}
+
+int main(int argc, char **argv) {
+    unsigned long fds[MAX_LIST] = { 0, 64, 1024 };
+    unsigned long threads[MAX_LIST] = { 1, 16, 128 };
+    unsigned long jobs[MAX_LIST] = { 0, 16, 128 };
+    unsigned long rates[MAX_LIST] = { 0, 1 << 20, 16 << 20 };
+    int nfds = 3, nthreads = 3, njobs = 3, nrates = 3;
+    unsigned long burst = 64 << 20;
+    int iters = 20, pings = 200;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "r:a:n:f:t:j:p:b:R:h")) != -1) {
+        switch (opt) {
+        case 'r': reptyr_path = optarg; break;
+        case 'a':
+            if (nreptyr_args == MAX_LIST)
+                die("Too many -a options");
+            reptyr_args[nreptyr_args++] = optarg;
+            break;
+        case 'n': iters = atoi(optarg); break;
+        case 'f': nfds = parse_list(optarg, fds); break;
+        case 't': nthreads = parse_list(optarg, threads); break;
+        case 'j': njobs = parse_list(optarg, jobs); break;
+        case 'p': pings = atoi(optarg); break;
+        case 'b': burst = strtoul(optarg, NULL, 10); break;
+        case 'R': nrates = parse_list(optarg, rates); break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (iters < 1 || pings < 1)
+        die("Need at least one iteration and one ping");
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Vary one thing at a time from a plain single-threaded target. */
+    for (i = 0; i < nfds; i++)
+        bench_attach(iters, fds[i], 1, 0);
+    for (i = 0; i < nthreads; i++)
+        if (threads[i] != 1)
+            bench_attach(iters, 0, threads[i], 0);
+    for (i = 0; i < njobs; i++)
+        if (jobs[i] != 0)
+            bench_attach(iters, 0, 1, jobs[i]);
+    for (i = 0; i < nrates; i++)
+        bench_proxy(pings, i ? 0 : burst, rates[i]);
+    return 0;
+}
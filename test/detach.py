@@ -0,0 +1,66 @@
+import os
+import pexpect
+import sys
+import time
+
+log = getattr(sys.stdout, "buffer", sys.stdout)
+
+# Like test/victim, but slow to answer "later", so that there's output
+# while nobody is attached.
+VICTIM = """
+import ctypes, sys, time
+ctypes.CDLL(None).prctl(0x59616d61, ctypes.c_ulong(-1), 0, 0, 0)
+for line in iter(sys.stdin.readline, ''):
+    if line.startswith('later'):
+        time.sleep(1)
+    sys.stdout.write('ECHO: ' + line)
+    sys.stdout.flush()
+"""
+
+child = pexpect.spawn(sys.executable, ["-c", VICTIM])
+child.setecho(False)
+child.sendline("hello")
+child.expect("ECHO: hello")
+
+# -d moves the target onto a pty the daemon keeps, and goes away.
+daemon = pexpect.spawn("./reptyr -d %d" % (child.pid,))
+daemon.logfile = log
+daemon.expect(r"reattach with: reptyr -r (\S+)")
+sock = daemon.match.group(1).decode()
+daemon.expect(pexpect.EOF)
+assert os.path.exists(sock)
+
+# Reattach by pid.
+reptyr = pexpect.spawn("./reptyr -r %d" % (child.pid,))
+reptyr.logfile = log
+reptyr.expect("detach again")
+reptyr.sendline("world")
+reptyr.expect("ECHO: world")
+
+# There's only room for one client at a time.
+second = pexpect.spawn("./reptyr -r %s" % (sock,))
+second.expect("busy")
+second.expect(pexpect.EOF)
+
+# Detach before the answer comes back; it waits in the scrollback.
+reptyr.sendline("later")
+reptyr.send("\x1dd")
+reptyr.expect("Detached")
+reptyr.expect(pexpect.EOF)
+time.sleep(1.5)
+
+# Reattach by socket, and get what we missed.
+reptyr = pexpect.spawn("./reptyr -r %s" % (sock,))
+reptyr.logfile = log
+reptyr.expect("ECHO: later")
+reptyr.sendline("again")
+reptyr.expect("ECHO: again")
+
+# Once the target is done, so is the daemon, and it cleans up.
+reptyr.sendeof()
+reptyr.expect(pexpect.EOF)
+for i in range(50):
+    if not os.path.exists(sock):
+        break
+    time.sleep(0.1)
+assert not os.path.exists(sock)
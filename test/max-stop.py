@@ -0,0 +1,58 @@
+import os
+import pexpect
+import sys
+
+# Like test/victim, but with thousands of fds on the tty, so that taking
+# copies of them all takes long enough to run out of --max-stop partway.
+VICTIM = """
+import ctypes, os, resource, sys
+resource.setrlimit(resource.RLIMIT_NOFILE, (12000, 12000))
+ctypes.CDLL(None).prctl(0x59616d61, ctypes.c_ulong(-1), 0, 0, 0)
+fds = [os.dup(0) for i in range(5000)]
+for line in iter(sys.stdin.readline, ''):
+    sys.stdout.write('ECHO: ' + line)
+    sys.stdout.flush()
+"""
+
+def snapshot(pid):
+    fds = {}
+    for fd in os.listdir("/proc/%d/fd" % pid):
+        fds[fd] = os.readlink("/proc/%d/fd/%s" % (pid, fd))
+    sig = [l for l in open("/proc/%d/status" % pid)
+           if l.startswith(("SigIgn", "SigCgt"))]
+    stat = open("/proc/%d/stat" % pid).read().rsplit(")", 1)[1].split()
+    # session and tty_nr
+    return fds, sig, stat[3], stat[4]
+
+# Walk the budget up a millisecond at a time: the early ones run out
+# before anything has changed, the later ones once the target has a new
+# fd and SIGHUP handler, and eventually one is enough for the attach.
+# We want to have seen the middle case.
+late = 0
+for attempt in range(5):
+    child = pexpect.spawn(sys.executable, ["-c", VICTIM])
+    child.setecho(False)
+    child.sendline("hello")
+    child.expect("ECHO: hello")
+    before = snapshot(child.pid)
+
+    for ms in range(1, 200):
+        reptyr = pexpect.spawn("./reptyr --max-stop=%dms %d" % (ms, child.pid))
+        if reptyr.expect([r"while ([^;]*); put it back as it was",
+                          "Set the controlling tty", pexpect.TIMEOUT],
+                         timeout=5) != 0:
+            break
+        step = reptyr.match.group(1)
+        reptyr.expect(pexpect.EOF)
+        assert snapshot(child.pid) == before
+        child.sendline("still here")
+        child.expect("ECHO: still here")
+        if step != b"copying in the tty's path":
+            late += 1
+        reptyr.close()
+    reptyr.close(force=True)
+    child.close(force=True)
+    if late:
+        break
+
+assert late > 0
@@ -0,0 +1,56 @@
+import json
+import os
+import pexpect
+import struct
+import sys
+import tempfile
+
+log = getattr(sys.stdout, "buffer", sys.stdout)
+
+# Quotes, backslashes and control characters to escape, a character
+# split across two writes, and a byte that isn't UTF-8 at all.
+TARGET = """
+import sys, time
+out = sys.stdout.buffer
+for chunk in [b'say "hi" \\\\ \\x01 caf\\xc3\\xa9 ', b'\\xe2\\x9c', b'\\x93 bad\\xff end\\n']:
+    out.write(chunk)
+    out.flush()
+    time.sleep(0.3)
+"""
+
+def record(fmt):
+    path = os.path.join(tempfile.mkdtemp(), "session")
+    reptyr = pexpect.spawn("./reptyr", ["--record=" + path,
+                                        "--record-format=" + fmt,
+                                        "-L", sys.executable, "-c", TARGET])
+    reptyr.logfile = log
+    reptyr.expect(pexpect.EOF)
+    return open(path, "rb").read()
+
+# asciicast v2: a header, then one [time, "o", text] event per line.
+lines = record("asciicast").decode("utf-8").rstrip("\n").split("\n")
+header = json.loads(lines[0])
+assert header["version"] == 2
+assert header["width"] > 0 and header["height"] > 0
+events = []
+last = 0
+for line in lines[1:]:
+    t, kind, data = json.loads(line)
+    assert kind == "o"
+    assert t >= last
+    last = t
+    events.append(data)
+# Half a character waits for the rest, rather than being mangled.
+assert any(e.startswith("\u2713") for e in events)
+assert 'say "hi" \\ \x01 café ✓ bad� end\r\n' in "".join(events)
+
+# ttyrec: each frame is seconds, microseconds and length, then the bytes.
+data = record("ttyrec")
+raw = b""
+while data:
+    sec, usec, n = struct.unpack("<III", data[:12])
+    assert usec < 1000000
+    assert len(data) >= 12 + n
+    raw += data[12:12 + n]
+    data = data[12 + n:]
+assert b'say "hi" \\ \x01 caf\xc3\xa9 \xe2\x9c\x93 bad\xff end\r\n' in raw
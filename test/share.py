@@ -0,0 +1,62 @@
+import os
+import pexpect
+import socket
+import sys
+import tempfile
+import time
+
+log = getattr(sys.stdout, "buffer", sys.stdout)
+
+# Answers each line with a lot of output, so that a viewer that doesn't
+# read falls behind quickly.
+TARGET = """
+import sys
+for line in iter(sys.stdin.readline, ''):
+    sys.stdout.write('GOT %s %s\\n' % (line.strip(), 'x' * 2000))
+    sys.stdout.flush()
+"""
+
+sock = os.path.join(tempfile.mkdtemp(), "share.sock")
+main = pexpect.spawn("./reptyr", ["-V", "--share=" + sock,
+                                  "-L", sys.executable, "-c", TARGET])
+main.expect("Opened a new pty")
+for i in range(50):
+    if os.path.exists(sock):
+        break
+    time.sleep(0.1)
+
+# A viewer that never reads mustn't hold up the session.
+stuck = socket.socket(socket.AF_UNIX)
+stuck.connect(sock)
+
+viewer = pexpect.spawn("./reptyr --view=%s" % (sock,))
+viewer.logfile = log
+viewer.expect("Watching")
+
+for i in range(300):
+    main.sendline("line%d" % i)
+    main.expect("GOT line%d " % i)
+viewer.expect("GOT line299 ")
+
+# It skipped ahead rather than being sent everything.
+stuck.close()
+main.expect(r"left, (\d+) bytes missed")
+assert int(main.match.group(1)) > 0
+
+# What viewers type goes nowhere.
+viewer.sendline("typed-by-viewer")
+time.sleep(0.3)
+main.sendline("done")
+main.expect("GOT done ")
+assert b"typed-by-viewer" not in main.before
+
+viewer.send("\x1dd")
+viewer.expect(pexpect.EOF)
+
+main.sendeof()
+main.expect(pexpect.EOF)
+for i in range(50):
+    if not os.path.exists(sock):
+        break
+    time.sleep(0.1)
+assert not os.path.exists(sock)